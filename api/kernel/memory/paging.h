@@ -9,6 +9,8 @@
 #define PAGE_PR (1ULL << 0)
 #define PAGE_WR (1ULL << 1)
 #define PAGE_US (1ULL << 2)
+#define PAGE_AC (1ULL << 5)
+#define PAGE_DT (1ULL << 6)
 #define PAGE_LG (1ULL << 7)
 #define PAGE_NX (1ULL << 63)
 
@@ -10,6 +10,27 @@
 typedef uint64_t kc_phys_addr;
 typedef void * kc_virt_addr;
 
+#define KCC_MEMORY_ZONES 3
+
+struct kcc_memory_zone_stats
+{
+    uint64_t total_pages;
+    uint64_t free_pages;
+    uint64_t min_pages;
+    uint64_t low_pages;
+    uint64_t high_pages;
+};
+
+struct kcc_memory_stats
+{
+    uint64_t total_pages;
+    uint64_t free_pages;
+    // low (<1MiB), conventional (<4GiB) and high memory
+    struct kcc_memory_zone_stats zones[KCC_MEMORY_ZONES];
+};
+
 kc_phys_addr kcc_page_alloc(void);
 void kcc_page_free(kc_phys_addr page);
 
+void kcc_memory_stats(struct kcc_memory_stats *stats);
+
@@ -0,0 +1,136 @@
+#include "acpi.h"
+#include "memory.h"
+
+#include <kernel/entry.h>
+#include <lib/kstdio.h>
+#include <lib/kstring.h>
+
+static struct acpi_state
+{
+    struct acpi_header *root;
+    size_t entry_size;
+}
+acpi_state;
+
+static void *map_table(phys_addr_t paddr)
+{
+    struct acpi_header *header = page_map_physical(
+            paddr,
+            sizeof(*header),
+            CONTENT_RODATA);
+
+    if (!header)
+    {
+        return NULL;
+    }
+
+    // map it again now that we know how big it really is
+    uint32_t length = header->length;
+    page_unmap_physical(header, sizeof(*header));
+
+    return page_map_physical(paddr, length, CONTENT_RODATA);
+}
+
+static int acpi_init(void)
+{
+    struct kc_boot_data *boot_data = get_boot_data();
+
+    if (!boot_data->acpi.rsdp)
+    {
+        return -1;
+    }
+
+    struct acpi_rsdp *rsdp = page_map_physical(
+            (phys_addr_t)boot_data->acpi.rsdp,
+            sizeof(*rsdp),
+            CONTENT_RODATA);
+
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8))
+    {
+        kprintf("warning: bad ACPI RSDP at %p\n", boot_data->acpi.rsdp);
+
+        if (rsdp)
+        {
+            page_unmap_physical(rsdp, sizeof(*rsdp));
+        }
+
+        return -1;
+    }
+
+    // the root table stays mapped for every lookup after this one
+    if ((boot_data->acpi.version == ACPI_CURRENT) && rsdp->xsdt_address)
+    {
+        acpi_state.root = map_table(rsdp->xsdt_address);
+        acpi_state.entry_size = sizeof(uint64_t);
+    }
+    else
+    {
+        acpi_state.root = map_table(rsdp->rsdt_address);
+        acpi_state.entry_size = sizeof(uint32_t);
+    }
+
+    page_unmap_physical(rsdp, sizeof(*rsdp));
+
+    return acpi_state.root ? 0 : -1;
+}
+
+void *acpi_find_table(const char *signature)
+{
+    if (!acpi_state.root && acpi_init())
+    {
+        return NULL;
+    }
+
+    unsigned char *entries = (unsigned char *)(acpi_state.root + 1);
+    size_t count = (acpi_state.root->length - sizeof(*acpi_state.root)) /
+        acpi_state.entry_size;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        phys_addr_t paddr;
+
+        if (acpi_state.entry_size == sizeof(uint64_t))
+        {
+            uint64_t entry;
+            memcpy(&entry, &entries[i * sizeof(entry)], sizeof(entry));
+            paddr = entry;
+        }
+        else
+        {
+            uint32_t entry;
+            memcpy(&entry, &entries[i * sizeof(entry)], sizeof(entry));
+            paddr = entry;
+        }
+
+        struct acpi_header *header = page_map_physical(
+                paddr,
+                sizeof(*header),
+                CONTENT_RODATA);
+
+        if (!header)
+        {
+            continue;
+        }
+
+        int found = !memcmp(header->signature, signature, 4);
+        page_unmap_physical(header, sizeof(*header));
+
+        if (found)
+        {
+            return map_table(paddr);
+        }
+    }
+
+    return NULL;
+}
+
+// unmap a table from acpi_find_table(), NULL is fine
+void acpi_release_table(void *table)
+{
+    struct acpi_header *header = table;
+
+    if (header)
+    {
+        page_unmap_physical(header, header->length);
+    }
+}
@@ -4,7 +4,17 @@
 
 #include <stdnoreturn.h>
 
+// the most cpus that per-cpu structures are sized for
+#define CPU_COUNT_MAX 16
+
 void cpu_init(void);
+unsigned cpu_get_index(void);
+
+void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4]);
+uint32_t cpu_get_apic_id(void);
+
+uint64_t cpu_timestamp(void);
+uint64_t cpu_boot_timestamp(void);
 
 noreturn void cpu_task_begin(void);
 void cpu_task_set(struct kc_thread *task);
@@ -7,6 +7,7 @@
 #include "descriptor.h"
 #include "irq.h"
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -34,6 +35,7 @@ enum kernel_segment_indices
 #define MSR_LSTAR 0xc0000082
 #define MSR_CSTAR 0xc0000083
 #define MSR_SFMASK 0xc0000084
+#define MSR_GS_BASE 0xc0000101
 
 struct cpu_state
 {
@@ -45,12 +47,94 @@ struct cpu_state
 static struct segment_descriptor gdt[GDT_ENTRIES];
 static struct gate_descriptor idt[IDT_ENTRIES];
 static struct task64_segment tss;
+static uint64_t boot_timestamp;
+
+// what a cpu finds at its gs base, the index has to stay first
+struct cpu_local
+{
+    unsigned index;
+    uint32_t apic_id;
+};
+
+static struct cpu_local cpu_locals[CPU_COUNT_MAX];
+static atomic_uint cpu_count;
 
 uint64_t *get_tss_rsp0(void)
 {
     return &tss.rsp0;
 }
 
+// hand the running cpu the next index and point its gs base at its slot.
+// loading a segment register clears the base, so this goes after the gdt
+static void cpu_local_init(void)
+{
+    unsigned index = atomic_fetch_add(&cpu_count, 1);
+
+    if (index >= CPU_COUNT_MAX)
+    {
+        kprintf("error: more than %u cpus\n", CPU_COUNT_MAX);
+        PANIC(GENERAL_PANIC);
+    }
+
+    cpu_locals[index] = (struct cpu_local){index, cpu_get_apic_id()};
+    msr_write(MSR_GS_BASE, (uintptr_t)&cpu_locals[index]);
+}
+
+unsigned cpu_get_index(void)
+{
+    unsigned index;
+
+    __asm__ volatile
+        (
+         "movl %%gs:0, %0\n\t"
+         : "=r"(index)
+        );
+
+    return index;
+}
+
+void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+{
+    __asm__ volatile
+        (
+         "cpuid\n\t"
+         :
+            "=a"(registers[0]),
+            "=b"(registers[1]),
+            "=c"(registers[2]),
+            "=d"(registers[3])
+         :
+            "a"(leaf),
+            "c"(subleaf)
+        );
+}
+
+uint32_t cpu_get_apic_id(void)
+{
+    uint32_t registers[4];
+    cpu_cpuid(1, 0, registers);
+    return registers[1] >> 24;
+}
+
+uint64_t cpu_timestamp(void)
+{
+    uint32_t low;
+    uint32_t high;
+
+    __asm__ volatile
+        (
+         "rdtsc\n\t"
+         : "=a"(low), "=d"(high)
+        );
+
+    return ((uint64_t)high << 32)|low;
+}
+
+uint64_t cpu_boot_timestamp(void)
+{
+    return boot_timestamp;
+}
+
 static void syscall_entry(void)
 {
     kprintf("system call\n");
@@ -225,7 +309,9 @@ static struct dtr64 idt_init(void)
 
 void cpu_init(void)
 {
+    boot_timestamp = cpu_timestamp();
     gdt_init();
+    cpu_local_init();
     idt_init();
     exceptions_init();
 
@@ -14,3 +14,9 @@ void kcc_page_free(kc_phys_addr page)
     page_free(page);
 }
 
+
+KC_EXPORT
+void kcc_memory_stats(struct kcc_memory_stats *stats)
+{
+    page_get_stats(stats);
+}
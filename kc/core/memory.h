@@ -6,8 +6,11 @@
 
 #include <lib/kstring.h>
 
+#include <stdbool.h>
+
 #include <core/memory.h>
 
+#include "vm_object.h"
 #include "vm_tree.h"
 
 typedef int (*memory_space_handler_func)(uint32_t code, void *vaddr);
@@ -34,14 +37,44 @@ enum page_alloc_flags
     PAGE_ALLOC_LOW,
     PAGE_ALLOC_CONV,
     PAGE_ALLOC_HIGH,
-    PAGE_ALLOC_ANY
+    PAGE_ALLOC_ANY,
+    PAGE_ALLOC_TYPE_MASK = 7,
+
+    PAGE_ALLOC_ZEROED = 8,
+    PAGE_ALLOC_MOVABLE = 16,
 };
 
+// where a zone's free memory sits relative to its watermarks
+enum page_watermark
+{
+    PAGE_WATERMARK_MIN, // below the min watermark
+    PAGE_WATERMARK_LOW, // below the low watermark
+    PAGE_WATERMARK_HIGH, // below the high watermark
+    PAGE_WATERMARK_OK // above all of them
+};
+
+typedef int (*page_watermark_callback)(
+        enum page_alloc_flags zone,
+        enum page_watermark level);
+
+struct page_watermark_callback_list
+{
+    page_watermark_callback func;
+    struct page_watermark_callback_list *next;
+};
+
+// largest block the page frame allocator hands out, 2^18 pages is 1GiB
+#define PAGE_ORDER_MAX 18
+
+// called for every page table and mapped frame of kernel space
+typedef void (*page_walk_func)(phys_addr_t paddr);
+
 enum vm_alloc_flags
 {
     VM_ALLOC_ANY = 0,
     VM_ALLOC_CACHE = 1,
     VM_ALLOC_CORE = 2,
+    VM_ALLOC_MERGEABLE = 3,
     VM_ALLOC_TYPE_MASK = 3,
 
     VM_ALLOC_IMMEDIATE = 4,
@@ -63,17 +96,127 @@ int page_inc_ref(kc_phys_addr page);
 int page_dec_ref(kc_phys_addr page); 
 
 void *page_map(phys_addr_t paddr, enum page_map_flags flags);
+void *page_map_at(
+        void *vaddr,
+        phys_addr_t paddr,
+        enum page_map_flags flags);
+void *page_map_physical(
+        phys_addr_t paddr,
+        size_t size,
+        enum page_map_flags flags);
+void page_unmap_physical(void *vaddr, size_t size);
+void *page_map_range(
+        void *vaddr,
+        phys_addr_t paddr,
+        size_t size,
+        enum page_map_flags flags);
+void page_unmap_range(void *vaddr, size_t size);
 void *page_set_flags(void *vaddr, enum page_map_flags flags);
+void *page_populate(void *vaddr, size_t size, enum page_map_flags flags);
+void page_clear(phys_addr_t paddr, int nontemporal);
+void page_walk_kernel(page_walk_func func);
+
+void page_direct_map_enable(bool enabled);
+bool page_direct_map_huge(void);
+void *phys_to_virt(phys_addr_t paddr);
+phys_addr_t virt_to_phys(void *vaddr);
 void page_unmap(void *vaddr);
+size_t page_unmap_all(phys_addr_t paddr);
+size_t page_remap_all(phys_addr_t paddr, phys_addr_t target);
 
 phys_addr_t page_alloc(enum page_alloc_flags flags);
+phys_addr_t page_alloc_colored(enum page_alloc_flags flags, void *vaddr);
+phys_addr_t page_alloc_color(
+        enum page_alloc_flags flags,
+        void *vaddr,
+        bool colored);
 void page_free(phys_addr_t paddr);
 
+size_t page_alloc_bulk(
+        enum page_alloc_flags flags,
+        size_t count,
+        phys_addr_t *pages);
+void page_free_bulk(size_t count, phys_addr_t *pages);
+
+void page_get_stats(struct kcc_memory_stats *stats);
+int page_append_watermark_callback(page_watermark_callback func);
+
+phys_addr_t page_alloc_order(unsigned order, enum page_alloc_flags flags);
+void page_free_order(phys_addr_t paddr, unsigned order);
+
+void *page_get_movable(phys_addr_t paddr);
+phys_addr_t page_migrate(phys_addr_t paddr, void *vaddr);
+
+void *page_get_swappable(phys_addr_t paddr);
+void *page_get_mergeable(phys_addr_t paddr);
+int page_clear_accessed(void *vaddr);
+int page_clear_dirty(void *vaddr);
+void page_unmap_swapped(void *vaddr, uint64_t swap);
+size_t page_share(phys_addr_t paddr, phys_addr_t target);
+phys_addr_t vm_get_zero_page(void);
+
+phys_addr_t dma_alloc_contiguous(size_t size, phys_addr_t max_phys);
+void dma_free_contiguous(phys_addr_t paddr, size_t size);
+
 void *heap_alloc(size_t size);
 void heap_free(void *block);
 
 void *vm_alloc(size_t size, enum vm_alloc_flags flags);
+void *vm_alloc_at(void *address, size_t size, enum vm_alloc_flags flags);
 void vm_free(void *block);
+void vm_set_fault_around(size_t pages);
+void vm_get_gap_stats(struct vm_tree_gap_stats *stats);
+void vm_fault_report(void);
+
+// pages mapped along with a faulting one, in the block around it for a
+// read and ahead of it for a write that carries on from the last one
+#define VM_FAULT_AROUND_PAGES 16
+
+// how the anonymous fault handler treats a region
+struct vm_fault_policy
+{
+    // anonymous memory is backed by 2MiB pages where a whole one fits
+    bool huge;
+    // a write gets its own frame right away instead of the zero page first
+    bool write_first;
+    size_t around;
+};
+
+// anonymous memory that goes by fault settings of its own instead of the
+// global ones, so trying something out on one region changes nothing for
+// everyone else
+struct vm_policy_object
+{
+    struct vm_object object;
+    struct vm_fault_policy policy;
+    size_t faults;
+};
+
+void vm_get_fault_policy(struct vm_fault_policy *policy);
+void *vm_alloc_policy(
+        size_t size,
+        enum vm_alloc_flags flags,
+        struct vm_policy_object *object);
+
+// the part of the bottom half that each address space maps for itself
+#define VM_SPACE_BASE 0x400000000000ULL
+#define VM_SPACE_LIMIT 0x800000000000ULL
+
+// a top level slot right above the direct map that nothing else uses, for
+// vm_alloc_at() regions that need more aligned space than the allocation
+// range under the kernel image has
+#define VM_SCRATCH_BASE 0xffffc00000000000ULL
+#define VM_SCRATCH_LIMIT 0xffffc08000000000ULL
+
+phys_addr_t page_map_get_kernel(void);
+phys_addr_t page_map_create(void);
+void page_map_destroy(phys_addr_t map);
+void page_map_release_range(phys_addr_t map, void *base, size_t size);
+size_t page_map_clone_range(
+        phys_addr_t map,
+        phys_addr_t target,
+        void *base,
+        size_t size);
 
 void *memory_alloc(size_t size);
 void memory_free(void *block);
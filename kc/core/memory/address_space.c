@@ -0,0 +1,268 @@
+/* address spaces
+ *
+ * an address space is a page map and a vm tree of its own for a window
+ * of the bottom half, from VM_SPACE_BASE to VM_SPACE_LIMIT. everything
+ * else is shared with the kernel's map, so a thread that enters one keeps
+ * running as before and only sees different memory in the window.
+ *
+ * cloning copies the regions and maps every frame read-only in both. the
+ * anonymous fault handler copies a frame on the first write to it, or
+ * just makes it writable again once a single mapping is left.
+ */
+
+#include "address_space.h"
+
+#include "cpu.h"
+#include "panic.h"
+#include "task.h"
+#include "vm_object.h"
+#include "cpu/irq.h"
+#include "cpu/mmu.h"
+
+#include <lib/kstdio.h>
+
+static struct address_space_state
+{
+    struct address_space *spaces;
+    struct vm_object object;
+}
+space_state = {NULL, {ANONYMOUS_VM_OBJECT, anonymous_page_handler}};
+
+static void address_space_benchmark(void);
+
+void address_space_init(void)
+{
+    if (KC_BENCHMARKS)
+    {
+        task_append_thread(address_space_benchmark);
+    }
+}
+
+struct address_space *address_space_create(void)
+{
+    struct address_space *space = heap_alloc(sizeof(*space));
+
+    if (!space)
+    {
+        return NULL;
+    }
+
+    uint64_t flags = irq_lock();
+
+    *space = (struct address_space){{NULL, NULL, 0}, page_map_create(), NULL};
+    space->next = space_state.spaces;
+    space_state.spaces = space;
+
+    irq_unlock(flags);
+    return space;
+}
+
+static struct vm_tree_node *space_add(
+        struct address_space *space,
+        void *base,
+        size_t size)
+{
+    struct vm_tree_node *node = heap_alloc(sizeof(*node));
+
+    if (node)
+    {
+        vmt_init_node(
+                &space->tree,
+                node,
+                &space_state.object,
+                base,
+                (char *)base + size);
+    }
+
+    return node;
+}
+
+struct address_space *address_space_clone(struct address_space *space)
+{
+    struct address_space *clone = address_space_create();
+
+    if (!clone)
+    {
+        return NULL;
+    }
+
+    uint64_t flags = irq_lock();
+
+    for (struct vm_tree_node *node = vmt_first(&space->tree);
+            node;
+            node = vmn_successor_node(node))
+    {
+        void *base = (void *)node->key.address;
+
+        if (!space_add(clone, base, node->key.size))
+        {
+            kprintf("error: failed allocating regions for a clone\n");
+            PANIC(OUT_OF_MEMORY);
+        }
+
+        page_map_clone_range(space->map, clone->map, base, node->key.size);
+    }
+
+    irq_unlock(flags);
+    return clone;
+}
+
+void address_space_destroy(struct address_space *space)
+{
+    uint64_t flags = irq_lock();
+    struct address_space **link = &space_state.spaces;
+
+    while (*link != space)
+    {
+        link = &(*link)->next;
+    }
+
+    *link = space->next;
+
+    struct vm_tree_node *node;
+
+    while ((node = vmt_first(&space->tree)))
+    {
+        vmt_delete(&space->tree, node);
+        heap_free(node);
+    }
+
+    page_map_destroy(space->map);
+    heap_free(space);
+    irq_unlock(flags);
+}
+
+void *address_space_alloc(struct address_space *space, size_t size)
+{
+    size = page_count(size, 1) * page_size(1);
+
+    uint64_t flags = irq_lock();
+    void *address = vmt_find_gap(
+            &space->tree,
+            VM_SPACE_BASE,
+            VM_SPACE_LIMIT,
+            size,
+            page_size(1));
+
+    if (address && !space_add(space, address, size))
+    {
+        address = NULL;
+    }
+
+    irq_unlock(flags);
+    return address;
+}
+
+void address_space_free(struct address_space *space, void *block)
+{
+    struct vm_tree_key key = {(uintptr_t)block, 1};
+    uint64_t flags = irq_lock();
+    struct vm_tree_node *node = vmt_search_key(&space->tree, &key);
+
+    if (!node || (node->key.address != (uintptr_t)block))
+    {
+        kprintf("warning: address_space_free of %p which isn't an "
+                "allocated region\n", block);
+    }
+    else
+    {
+        page_map_release_range(space->map, block, node->key.size);
+        vmt_delete(&space->tree, node);
+        heap_free(node);
+    }
+
+    irq_unlock(flags);
+}
+
+// run the current thread in an address space, or back in the kernel's
+// map alone for NULL
+void address_space_enter(struct address_space *space)
+{
+    task_set_page_map(space ? space->map : page_map_get_kernel());
+}
+
+struct vm_tree *address_space_get_tree(kc_phys_addr map)
+{
+    uint64_t flags = irq_lock();
+    struct address_space *space = space_state.spaces;
+
+    while (space && (space->map != map))
+    {
+        space = space->next;
+    }
+
+    irq_unlock(flags);
+    return space ? &space->tree : NULL;
+}
+
+static const size_t address_space_benchmark_sizes[] = {
+    16 * 4096,
+    256 * 4096,
+    4096 * 4096,
+};
+
+// fill a region, clone the space it's in and time that against the size,
+// then check a write on one side stays there
+static void address_space_benchmark(void)
+{
+    for (size_t i = 0;
+            i < sizeof(address_space_benchmark_sizes) / sizeof(size_t);
+            i++)
+    {
+        size_t size = address_space_benchmark_sizes[i];
+        struct address_space *space = address_space_create();
+        uint64_t *region = space ? address_space_alloc(space, size) : NULL;
+
+        if (!region)
+        {
+            kprintf("warning: skipping address space benchmark\n");
+            break;
+        }
+
+        address_space_enter(space);
+
+        for (size_t offset = 0; offset < size / sizeof(*region);
+                offset += page_size(1) / sizeof(*region))
+        {
+            region[offset] = offset;
+        }
+
+        uint64_t cycles = cpu_timestamp();
+        struct address_space *clone = address_space_clone(space);
+        cycles = cpu_timestamp() - cycles;
+
+        if (!clone)
+        {
+            kprintf("warning: skipping address space benchmark\n");
+            address_space_enter(NULL);
+            address_space_destroy(space);
+            break;
+        }
+
+        uint64_t fault = cpu_timestamp();
+        region[0] = -1ULL;
+        fault = cpu_timestamp() - fault;
+
+        address_space_enter(clone);
+        uint64_t seen = region[0];
+        address_space_enter(NULL);
+
+        if (seen != 0)
+        {
+            kprintf("error: a write after the clone showed up in it\n");
+            PANIC(GENERAL_PANIC);
+        }
+
+        kprintf("address space clone of %zuKiB: %lu cycles, %lu per page, "
+                "%lu cycles for the first write after\n",
+                size >> 10,
+                cycles,
+                cycles / (size / page_size(1)),
+                fault);
+
+        address_space_destroy(clone);
+        address_space_destroy(space);
+    }
+
+    task_exit();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "memory.h"
+#include "vm_tree.h"
+
+struct address_space
+{
+    struct vm_tree tree;
+    kc_phys_addr map;
+    struct address_space *next;
+};
+
+struct address_space *address_space_create(void);
+struct address_space *address_space_clone(struct address_space *space);
+void address_space_destroy(struct address_space *space);
+
+void *address_space_alloc(struct address_space *space, size_t size);
+void address_space_free(struct address_space *space, void *block);
+
+void address_space_enter(struct address_space *space);
+struct vm_tree *address_space_get_tree(kc_phys_addr map);
+
+void address_space_init(void);
@@ -7,15 +7,31 @@
  *    recorded in the boot data structures
  */
 
+#include "page_cma.h"
+#include "page_color.h"
+#include "page_compact.h"
 #include "page_early.h"
+#include "page_magazine.h"
+#include "page_merge.h"
 #include "page_stack.h"
-
+#include "page_zero.h"
+#include "page_node.h"
+#include "page_rmap.h"
+#include "page_swap.h"
+#include "address_space.h"
+#include "memory_benchmark.h"
+#include "vm_lookup.h"
+
+#include "cpu.h"
 #include "memory.h"
 #include "panic.h"
+#include "task.h"
 #include "vm_object.h"
+#include "cpu/irq.h"
 #include "cpu/mmu.h"
 #include "cpu/exceptions.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <kc.h>
@@ -28,11 +44,6 @@ static void *temp_page_map(kc_phys_addr paddr, enum page_map_flags flags);
 static void temp_page_unmap(void *address);
 static kc_phys_addr boot_page_alloc(enum page_alloc_flags type);
 
-static void *page_map_at(
-        void *vaddr,
-        phys_addr_t paddr,
-        enum page_map_flags flags);
-
 enum vm_core_state_items
 {
     KERNEL_VM_STATE,
@@ -52,15 +63,22 @@ static struct vm_core_state
     struct vm_tree tree;
     struct vm_object global_null;
     struct vm_object global_anonymous;
+    struct vm_object global_cache;
+    struct vm_object global_mergeable;
     struct vm_object global_direct;
     struct vm_object global_translate;
     struct vm_core_static_state statics[4];
     kc_phys_addr zero_page;
-    void *first_free;
+    uintptr_t alloc_base;
+    uintptr_t alloc_limit;
+    kc_phys_addr kernel_map;
+    bool kernel_half_ready;
 } vm_state = {
     {0},
     {NULL_VM_OBJECT, NULL},
     {ANONYMOUS_VM_OBJECT, anonymous_page_handler},
+    {ANONYMOUS_VM_OBJECT, anonymous_page_handler},
+    {ANONYMOUS_VM_OBJECT, anonymous_page_handler},
     {DIRECT_VM_OBJECT, NULL},
     {TRANSLATION_VM_OBJECT, NULL},
     {
@@ -70,7 +88,10 @@ static struct vm_core_state
         {{0}, &vm_state.global_null},
     },
     0,
-    NULL
+    0,
+    0,
+    0,
+    false
 };
 
 static struct vm_temp_state
@@ -80,7 +101,77 @@ static struct vm_temp_state
 }
 temp_state;
 
+// all of physical memory, mapped with large pages below this address
+#define DIRECT_MAP_BASE 0xffff800000000000ULL
+#define DIRECT_MAP_SIZE (1ULL << 46)
+#define DIRECT_MAP_RUNS 32
+
+#define space_contains(a) \
+    (((uintptr_t)(a) >= VM_SPACE_BASE) && ((uintptr_t)(a) < VM_SPACE_LIMIT))
+#define scratch_contains(a) \
+    (((uintptr_t)(a) >= VM_SCRATCH_BASE) && \
+     ((uintptr_t)(a) < VM_SCRATCH_LIMIT))
+#define alloc_contains(a) \
+    (((uintptr_t)(a) >= vm_state.alloc_base) && \
+     ((uintptr_t)(a) < vm_state.alloc_limit))
+
+struct vm_direct_run
+{
+    kc_phys_addr base;
+    kc_phys_addr limit;
+};
+
+static struct vm_direct_state
+{
+    struct vm_tree_node node;
+    struct vm_direct_run runs[DIRECT_MAP_RUNS];
+    size_t run_count;
+    kc_phys_addr limit;
+    size_t large_pages[2];
+    bool huge;
+    bool ready;
+}
+direct_state;
+
+static struct vm_huge_state
+{
+    size_t faults;
+    size_t huge_faults;
+    size_t fallbacks;
+    size_t splits;
+}
+huge_state = {0, 0, 0, 0};
+
+static struct vm_fault_policy fault_policy = {
+    true,
+    true,
+    VM_FAULT_AROUND_PAGES
+};
+
+static struct vm_fault_state
+{
+    // where the last write fault on each cpu left off, streams are told
+    // apart by cpu rather than all sharing one position
+    uintptr_t next[CPU_COUNT_MAX];
+    size_t write_faults;
+    size_t around_pages;
+}
+fault_state;
+
+static void direct_map_init(void);
+static int policy_page_handler(
+        struct vm_tree_node *node,
+        uint32_t code,
+        void *address);
+static void *region_alloc(
+        size_t size,
+        enum vm_alloc_flags flags,
+        struct vm_object *object);
+static int vm_populate(struct vm_tree_node *node);
+static void vm_release(struct vm_tree_node *node);
+
 static kc_phys_addr (*current_alloc_func)(enum page_alloc_flags) = boot_page_alloc;
+static void (*current_free_func)(kc_phys_addr) = page_stack_free;
 
 struct vm_tree *vm_get_tree(void)
 {
@@ -92,6 +183,7 @@ void page_init(void)
     kprintf("initializing page frame allocator\n");
     page_early_init();
     page_stack_init();
+    direct_map_init();
 }
 
 void page_init_final(void)
@@ -99,8 +191,29 @@ void page_init_final(void)
     if (current_alloc_func == boot_page_alloc)
     {
         kprintf("finishing page frame allocator initialization\n");
+        page_node_init();
+        page_color_init();
         page_early_final();
-        current_alloc_func = page_stack_alloc;
+        current_alloc_func = page_magazine_alloc;
+        current_free_func = page_magazine_free;
+        page_append_watermark_callback(page_magazine_shrink);
+        page_zero_init();
+        page_compact_init();
+        page_swap_init();
+        page_merge_init();
+        address_space_init();
+
+        if (KC_BENCHMARKS)
+        {
+            page_ref_stress_init();
+            task_append_thread(page_color_benchmark);
+            task_append_thread(page_rmap_benchmark);
+            task_append_thread(page_huge_benchmark);
+            task_append_thread(vm_churn_benchmark);
+            task_append_thread(vm_tree_benchmark);
+            task_append_thread(vm_fault_benchmark);
+            task_append_thread(page_range_benchmark);
+        }
     }
 }
 
@@ -136,340 +249,1970 @@ static kc_phys_addr boot_page_alloc(enum page_alloc_flags type)
     return paddr;
 }
 
-kc_phys_addr page_alloc(enum page_alloc_flags type)
-{
-    return current_alloc_func(type);
-}
-
-void page_free(kc_phys_addr page)
-{
-    page_stack_free(page);
-}
-
-#define TABLESET_COUNT 3
-
-static void *map_tableset(void *vaddr, uint64_t *tables[TABLESET_COUNT])
+static kc_phys_addr page_alloc_once(enum page_alloc_flags flags)
 {
-    uint64_t current_phys;
-    uint64_t *current_pte;
-    // pml4 is guaranteed to be present. no checks necessary.
-    //
+    enum page_alloc_flags type = flags & PAGE_ALLOC_TYPE_MASK;
 
-    current_phys = page_address(mmu_get_map(), 1);
-    tables[TABLESET_COUNT] = temp_page_map(current_phys, CONTENT_RWDATA);
-    int n = TABLESET_COUNT;
-
-    while (n)
+    // movable pages borrow from the contiguous area first
+    if ((flags & PAGE_ALLOC_MOVABLE) &&
+            (current_alloc_func != boot_page_alloc) &&
+            ((type == PAGE_ALLOC_CONV) || (type == PAGE_ALLOC_ANY)))
     {
-        if (tables[n])
-        {
-            current_pte = &tables[n][pte_index(vaddr, n+1)];
+        kc_phys_addr page = page_cma_alloc_movable();
 
-            if (!page_address(*current_pte, 1))
-            {
-                current_phys = page_alloc(PAGE_ALLOC_CONV);
-                if (current_phys)
-                {
-                    tables[n-1] = temp_page_map(current_phys, CONTENT_RWDATA);
-                    memset(tables[n-1], 0, page_size(1));
-                    *current_pte = current_phys |= PAGE_NX|PAGE_WR|PAGE_PR;
-                }
-                else
-                {
-                    kprintf("error: failed allocating memory for page table\n");
-                    PANIC(OUT_OF_MEMORY);
-                }
-            }
-            else
+        if (page)
+        {
+            if (flags & PAGE_ALLOC_ZEROED)
             {
-                current_phys = page_address(*current_pte, 1);
-                tables[n-1] = temp_page_map(current_phys, CONTENT_RWDATA);
+                page_clear(page, 0);
             }
+
+            return page;
         }
-        n--;
     }
 
-    if (tables[0])
+    if (flags & PAGE_ALLOC_ZEROED)
     {
-        current_pte = &tables[0][pte_index(vaddr, 1)];
+        return page_zero_alloc(type);
     }
 
-    return vaddr;
+    return current_alloc_func(type);
 }
 
-void *page_set_flags(void *vaddr, enum page_map_flags flags)
+kc_phys_addr page_alloc(enum page_alloc_flags flags)
 {
-    uint64_t *mapset[PAGE_MAP_LEVELS] = {NULL};
-
-    if (vaddr != map_tableset(vaddr, mapset))
-    {
-        PANIC(GENERAL_PANIC);
-    }
+    kc_phys_addr page = page_alloc_once(flags);
 
-    if (flags & PRIV_MASK)
+    // give caches a chance to shrink before giving up
+    if (!page && (current_alloc_func != boot_page_alloc))
     {
-        mapset[3][pte_index(vaddr, 4)] |= PAGE_US;
-        mapset[2][pte_index(vaddr, 3)] |= PAGE_US;
-        mapset[1][pte_index(vaddr, 2)] |= PAGE_US;
-        mapset[0][pte_index(vaddr, 1)] |= PAGE_US;
+        page_stack_pressure(flags & PAGE_ALLOC_TYPE_MASK);
+        page = page_alloc_once(flags);
     }
 
-    for(int i = 0; i < PAGE_MAP_LEVELS; i++)
-    {
-        if (mapset[i])
-            temp_page_unmap(mapset[i]);
-    }
+    page_stack_notify();
 
-    return vaddr;
+    return page;
 }
 
-static void *page_map_at(
+// a frame of vaddr's color if colored is set, any frame otherwise
+kc_phys_addr page_alloc_color(
+        enum page_alloc_flags flags,
         void *vaddr,
-        phys_addr_t paddr,
-        enum page_map_flags flags)
+        bool colored)
 {
-    // TODO: add checks to prevent attempts to map reserved addreses
-    //
-    uint64_t *mapset[PAGE_MAP_LEVELS] = {NULL};
-
-    if (vaddr != map_tableset(vaddr, mapset))
+    if (!colored || (current_alloc_func == boot_page_alloc))
     {
-        PANIC(GENERAL_PANIC);
+        return page_alloc(flags);
     }
 
-    uint64_t entry = PAGE_PR;
+    // magazines and the contiguous area don't know colors, go around them
+    kc_phys_addr page = page_stack_alloc_color(
+            flags & PAGE_ALLOC_TYPE_MASK,
+            page_color_for(vaddr));
+    page_stack_notify();
 
-    switch (flags & CONTENT_MASK)
+    if (!page)
     {
-        case CONTENT_RODATA:
-            entry |= PAGE_NX;
-            break;
-        case CONTENT_RWDATA:
-            entry |= PAGE_NX|PAGE_WR;
-            break;
-        default:
-            break;
+        return page_alloc(flags);
     }
 
-    size_t offset;
-
-    switch (flags & SIZE_MASK)
+    if (flags & PAGE_ALLOC_ZEROED)
     {
-        case SIZE_1G:
-            offset = page_offset(paddr, 3);
-            break;
-        case SIZE_2M:
-            offset = page_offset(paddr, 2);
-            break;
-        case 0:
-        case SIZE_4K:
-            offset = page_offset(paddr, 1);
-            break;
-        default:
-            vaddr = NULL;
+        page_clear(page, 0);
     }
 
-    if (flags & PRIV_MASK)
-    {
-        entry |= PAGE_US;
-    }
+    return page;
+}
 
-    if (vaddr)
-    {
-        mapset[0][pte_index(vaddr, 1)] = page_address(paddr, 1) | entry;
-    }
+kc_phys_addr page_alloc_colored(enum page_alloc_flags flags, void *vaddr)
+{
+    return page_alloc_color(flags, vaddr, page_color_enabled());
+}
 
-    for (int i = 0; i < PAGE_MAP_LEVELS; i++)
+void page_free(kc_phys_addr page)
+{
+    if (page_cma_contains(page))
     {
-        if (mapset[i])
-        {
-            temp_page_unmap(mapset[i]);
-        }
+        page_cma_free(page);
+        return;
     }
 
-    // take a reference to the page
-    page_inc_ref(paddr);
-
-    return (char *)vaddr + offset;
+    current_free_func(page);
+    page_stack_notify();
 }
 
-int page_inc_ref(kc_phys_addr page)
+void page_get_stats(struct kcc_memory_stats *stats)
 {
-    return page_stack_inc_ref(page);
+    page_stack_get_stats(stats);
 }
 
-int page_dec_ref(kc_phys_addr page)
+int page_append_watermark_callback(page_watermark_callback func)
 {
-    return page_stack_dec_ref(page);
+    return page_stack_append_watermark_callback(func);
 }
 
-#define VM_HEAP_SIZE 16 * page_size(2)
-
-static void *temp_page_alloc(void)
+size_t page_alloc_bulk(
+        enum page_alloc_flags flags,
+        size_t count,
+        kc_phys_addr *pages)
 {
-    int index = temp_state.first_free;
+    enum page_alloc_flags type = flags & PAGE_ALLOC_TYPE_MASK;
+    size_t taken = 0;
 
-    // do not allocate the 511th index!!
-    if (index > -1 && index < 511)
+    // the early allocator only knows single pages
+    if (current_alloc_func == boot_page_alloc)
     {
-        temp_state.first_free = temp_state.table[index] >> 1;
-        temp_state.table[index] = 0;
+        for (; taken < count; taken++)
+        {
+            if (!(pages[taken] = boot_page_alloc(type)))
+            {
+                break;
+            }
+        }
     }
     else
     {
-        return NULL;
+        taken = page_stack_alloc_bulk(type, count, pages);
+        page_stack_notify();
     }
 
-    return (void *)-((512ULL - index) << 12);
-}
-
-static void temp_page_free(void *address)
-{
-    int index = pte_index(address, 1);
-
-    if (index > -1 && index < 511)
+    if (flags & PAGE_ALLOC_ZEROED)
     {
-        temp_state.table[index] = temp_state.first_free << 1;
-        temp_state.first_free = index;
+        for (size_t i = 0; i < taken; i++)
+        {
+            page_clear(pages[i], 0);
+        }
     }
+
+    return taken;
 }
 
-static void *temp_page_map(kc_phys_addr paddr, enum page_map_flags flags)
+void page_free_bulk(size_t count, kc_phys_addr *pages)
 {
-    uint64_t entry = PAGE_PR;
-    size_t offset = 0;
+    size_t first = 0;
 
-    switch (flags & SIZE_MASK)
+    for (size_t i = 0; i <= count; i++)
     {
-        case 0:
-        case SIZE_4K:
-            offset = page_offset(paddr, 1);
-            break;
-        default:
-            return NULL;
+        if ((i < count) && !page_cma_contains(pages[i]))
+        {
+            continue;
+        }
+
+        // everything since the last frame of the contiguous area goes back
+        // to the page stacks in one go
+        page_stack_free_bulk(i - first, &pages[first]);
+
+        if (i < count)
+        {
+            page_cma_free(pages[i]);
+        }
+
+        first = i + 1;
     }
 
-    switch (flags & CONTENT_MASK)
+    page_stack_notify();
+}
+
+kc_phys_addr page_alloc_order(unsigned order, enum page_alloc_flags flags)
+{
+    // the early allocator can only hand out single pages
+    kc_phys_addr page = page_stack_alloc_order(
+            order,
+            flags & PAGE_ALLOC_TYPE_MASK);
+
+    // move pages out of the way to make a block and try again
+    if (!page && order && (current_alloc_func != boot_page_alloc) &&
+            page_compact(order, flags & PAGE_ALLOC_TYPE_MASK))
     {
-        case CONTENT_RODATA:
-            entry |= PAGE_NX;
-            break;
-        case CONTENT_RWDATA:
-            entry |= PAGE_NX|PAGE_WR;
-            break;
-        default:
-            break;
+        page = page_stack_alloc_order(order, flags & PAGE_ALLOC_TYPE_MASK);
     }
 
-    unsigned char *vaddr = temp_page_alloc();
+    page_stack_notify();
 
-    if (vaddr)
+    if (page && (flags & PAGE_ALLOC_ZEROED))
     {
-        vaddr += offset;
-        temp_state.table[pte_index(vaddr, 1)] = page_address(paddr, 1) | entry;
+        for (size_t i = 0; i < (1UL << order); i++)
+        {
+            page_clear(page + i * page_size(1), 0);
+        }
     }
 
-    return vaddr;
+    return page;
 }
 
-static void temp_page_unmap(void *vaddr)
+void page_free_order(kc_phys_addr page, unsigned order)
 {
-    temp_page_free(vaddr);
-    mmu_invalidate(vaddr);
+    page_stack_free_order(page, order);
+    page_stack_notify();
 }
 
-static void vm_init(void)
+struct page_movable
 {
-    kprintf("initializing vm state\n");
-    struct kc_boot_data *boot_data = get_boot_data();
-    struct vm_core_static_state *states = &vm_state.statics[0];
+    void *vaddr;
+    bool anonymous;
+};
 
-    // initialize the static vm node entries
-    struct
-    {
-        unsigned char *base;
-        unsigned char *head;
-    } vm_ranges[] = {
-        {&kc_image_base, &kc_image_end},
-        {&kc_image_end, &kc_image_end + VM_HEAP_SIZE},
-        {
-            boot_data->buffer.base - page_size(1) * 2,
-            boot_data->buffer.base - page_size(1)
-        },
-        {
-            boot_data->buffer.current,
-            boot_data->buffer.current + boot_data->buffer.max_size,
-        }
-    };
+static void movable_check(void *vaddr, void *data)
+{
+    struct page_movable *movable = data;
+    struct vm_tree_key key = {(uintptr_t)vaddr, page_size(1)};
+    struct vm_tree_node *node = vmt_search_key(vm_get_tree(), &key);
 
-    vm_state.first_free = &kc_image_end;
+    movable->vaddr = vaddr;
+    movable->anonymous &= node && (node->object->type == ANONYMOUS_VM_OBJECT);
+}
 
-    for (int i = 0; i <= TEMPS_VM_STATE; i++)
+void *page_get_movable(kc_phys_addr page)
+{
+    struct page_movable movable = {NULL, true};
+    uint64_t flags = irq_lock();
+    size_t count = page_rmap_walk(page, movable_check, &movable);
+    int refs = page_stack_get_ref(page);
+
+    irq_unlock(flags);
+
+    // one reference from the allocation and one from each mapping, more
+    // means someone holds the frame outside of the page tables. huge
+    // pages only move once they're split
+    if (!count || (refs < 0) || ((size_t)refs != count + 1) ||
+            page_stack_get_order(page))
     {
-        vmt_init_node
-            (
-             vm_get_tree(),
-             &states[i].node,
-             states[i].object,
-             (void *)vm_ranges[i].base,
-             (void *)vm_ranges[i].head
-            );
+        return NULL;
     }
 
-    // init the temporary mappings table state
-    temp_state.table = (uint64_t *)-page_size(1);
-    temp_state.first_free = -1;
-    for (int index = 0; index < 512; index++)
+    // and only anonymous memory can be moved behind its owner's back
+    return movable.anonymous ? movable.vaddr : NULL;
+}
+
+kc_phys_addr page_migrate(kc_phys_addr page, void *vaddr)
+{
+    if (!vaddr)
     {
-        // i love these array-based linked list stacks
-        if (!(temp_state.table[index] & PAGE_PR))
-        {
-            temp_page_free((void *)-((512ULL - index) << 12));
-        }
+        return 0;
     }
 
-    page_init();
+    kc_phys_addr target = page_alloc(PAGE_ALLOC_CONV);
 
-    vm_state.zero_page = page_alloc(PAGE_ALLOC_CONV);
-    if (!vm_state.zero_page)
+    if (!target)
     {
-        kprintf("failed allocating for zero page\n");
-        PANIC(GENERAL_PANIC);
+        return 0;
     }
 
-    void *zero_temp = temp_page_map(vm_state.zero_page, CONTENT_RWDATA);
+    // nothing may write to the frame or map it again between the check and
+    // the remap, or the write would stay behind in the old frame
+    uint64_t flags = irq_lock();
 
-    if (!zero_temp)
+    if (vaddr != page_get_movable(page))
     {
-        kprintf("failed mapping zero page for initialization\n");
-        PANIC(GENERAL_PANIC);
+        irq_unlock(flags);
+        page_free(target);
+        return 0;
     }
 
-    // make the zero page live up to its name;
-    memset(zero_temp, 0, page_size(1));
-    temp_page_unmap(zero_temp);
+    memcpy(phys_to_virt(target), phys_to_virt(page), page_size(1));
+    page_remap_all(page, target);
+    irq_unlock(flags);
 
-    page_init_final();
+    // the mappings took their references along, drop the allocation's
+    // straight to the page stacks so the frame can merge with its neighbours
+    if (page_cma_contains(page))
+    {
+        page_cma_free(page);
+    }
+    else
+    {
+        page_stack_free(page);
+        page_stack_notify();
+    }
+
+    return target;
+}
+
+kc_phys_addr dma_alloc_contiguous(size_t size, kc_phys_addr max_phys)
+{
+    size_t count = page_count(size, 1);
+    kc_phys_addr base = page_cma_alloc(count, max_phys);
+
+    // the page stacks may still have a block that fits
+    if (!base)
+    {
+        unsigned order = 0;
+
+        while ((1UL << order) < count)
+        {
+            order++;
+        }
+
+        base = page_alloc_order(
+                order,
+                max_phys > -1U ? PAGE_ALLOC_ANY : PAGE_ALLOC_CONV);
+
+        if (base && (base + (page_size(1) << order) > max_phys))
+        {
+            page_free_order(base, order);
+            base = 0;
+        }
+    }
+
+    if (base)
+    {
+        memset(phys_to_virt(base), 0, count * page_size(1));
+    }
+
+    return base;
+}
+
+void dma_free_contiguous(kc_phys_addr base, size_t size)
+{
+    size_t count = page_count(size, 1);
+
+    if (page_cma_contains(base))
+    {
+        page_cma_release(base, count);
+        return;
+    }
+
+    unsigned order = 0;
+
+    while ((1UL << order) < count)
+    {
+        order++;
+    }
+
+    page_free_order(base, order);
+}
+
+#define TABLESET_COUNT 3
+
+// page tables and frames are reached through the direct map once it is up
+static uint64_t *frame_map(kc_phys_addr frame)
+{
+    if (direct_state.ready)
+    {
+        return phys_to_virt(frame);
+    }
+
+    return temp_page_map(frame, CONTENT_RWDATA);
+}
+
+static void frame_unmap(uint64_t *frame)
+{
+    if ((uintptr_t)frame < DIRECT_MAP_BASE ||
+            (uintptr_t)frame >= DIRECT_MAP_BASE + DIRECT_MAP_SIZE)
+    {
+        temp_page_unmap(frame);
+    }
+}
+
+static uint64_t *table_alloc(uint64_t *entry)
+{
+    kc_phys_addr table = page_alloc(PAGE_ALLOC_CONV);
+
+    if (!table)
+    {
+        kprintf("error: failed allocating memory for page table\n");
+        PANIC(OUT_OF_MEMORY);
+    }
+
+    uint64_t *entries = frame_map(table);
+    memset(entries, 0, page_size(1));
+    *entry = table|PAGE_NX|PAGE_WR|PAGE_PR;
+
+    return entries;
+}
+
+// the table for vaddr at a level, NULL if a large page already covers it
+static uint64_t *map_table_at(kc_phys_addr map, uintptr_t vaddr, int level)
+{
+    uint64_t *entries = frame_map(page_address(map, 1));
+
+    for (int n = PAGE_MAP_LEVELS; n > level; n--)
+    {
+        uint64_t *entry = &entries[pte_index(vaddr, n)];
+        uint64_t *next;
+
+        if (!(*entry & PAGE_PR))
+        {
+            next = table_alloc(entry);
+        }
+        else if (*entry & PAGE_LG)
+        {
+            next = NULL;
+        }
+        else
+        {
+            next = frame_map(page_address(*entry & PAGE_ADDRESS_MASK, 1));
+        }
+
+        frame_unmap(entries);
+
+        if (!(entries = next))
+        {
+            break;
+        }
+    }
+
+    return entries;
+}
+
+static uint64_t *table_at(uintptr_t vaddr, int level)
+{
+    return map_table_at(mmu_get_map(), vaddr, level);
+}
+
+static void direct_map_add(kc_phys_addr base, kc_phys_addr limit)
+{
+    base = page_address(base, 2);
+    limit = page_align(limit - 1, 2);
+
+    if (direct_state.run_count)
+    {
+        struct vm_direct_run *last =
+            &direct_state.runs[direct_state.run_count - 1];
+
+        // firmware maps come sorted, so only the last run can be extended
+        if ((base >= last->base) && (base <= last->limit))
+        {
+            last->limit = limit > last->limit ? limit : last->limit;
+            return;
+        }
+
+        // out of runs, cover the hole in between
+        if (direct_state.run_count == DIRECT_MAP_RUNS)
+        {
+            last->base = base < last->base ? base : last->base;
+            last->limit = limit > last->limit ? limit : last->limit;
+            return;
+        }
+    }
+
+    direct_state.runs[direct_state.run_count++] =
+        (struct vm_direct_run){base, limit};
+}
+
+static void direct_map_run(kc_phys_addr base, kc_phys_addr limit, bool huge)
+{
+    while (base < limit)
+    {
+        uintptr_t vaddr = DIRECT_MAP_BASE + base;
+        int level = 2;
+
+        if (huge && !page_offset(base, 3) && (limit - base >= page_size(3)))
+        {
+            level = 3;
+        }
+
+        uint64_t *table = table_at(vaddr, level);
+
+        if (table)
+        {
+            if (!(table[pte_index(vaddr, level)] & PAGE_PR))
+            {
+                table[pte_index(vaddr, level)] =
+                    base|PAGE_LG|PAGE_NX|PAGE_WR|PAGE_PR;
+                direct_state.large_pages[level - 2]++;
+            }
+
+            frame_unmap(table);
+        }
+
+        base += page_size(level);
+    }
+}
+
+static void direct_map_init(void)
+{
+    struct kc_boot_data *boot_data = get_boot_data();
+    uint32_t registers[4];
+
+    // collect the runs before the early allocator starts taking from them
+    for (size_t i = 0; i < boot_data->memory.count; i++)
+    {
+        struct memory_range *range = &boot_data->memory.entries[i];
+
+        switch (range->type)
+        {
+            case SYSTEM_MEMORY:
+            case AVAILABLE_MEMORY:
+            case FIRMWARE_MEMORY:
+                if (range->size)
+                {
+                    direct_map_add(range->base, range->base + range->size);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    // 1GiB pages are edx bit 26 of the extended feature leaf
+    cpu_cpuid(0x80000001, 0, registers);
+    bool huge = (registers[3] >> 26) & 1;
+    direct_state.huge = huge;
+
+    for (size_t i = 0; i < direct_state.run_count; i++)
+    {
+        kc_phys_addr limit = direct_state.runs[i].limit;
+
+        if (limit > DIRECT_MAP_SIZE)
+        {
+            kprintf("warning: memory above %#lx is not direct mapped\n",
+                    DIRECT_MAP_SIZE);
+            limit = DIRECT_MAP_SIZE;
+        }
+
+        direct_map_run(direct_state.runs[i].base, limit, huge);
+
+        if (limit > direct_state.limit)
+        {
+            direct_state.limit = limit;
+        }
+    }
+
+    vmt_init_node(
+            vm_get_tree(),
+            &direct_state.node,
+            &vm_state.global_direct,
+            (void *)DIRECT_MAP_BASE,
+            (void *)(DIRECT_MAP_BASE + direct_state.limit));
+
+    direct_state.ready = true;
+
+    kprintf("direct map: %zu runs up to %#lx, %zu 1GiB and %zu 2MiB pages\n",
+            direct_state.run_count,
+            direct_state.limit,
+            direct_state.large_pages[1],
+            direct_state.large_pages[0]);
+}
+
+// walks go through temporary windows while the direct map is off, which
+// is only ever done to time one against the other
+void page_direct_map_enable(bool enabled)
+{
+    direct_state.ready = enabled;
+}
+
+// whether the direct map, and with it page_map_range(), has 1GiB pages
+bool page_direct_map_huge(void)
+{
+    return direct_state.huge;
+}
+
+void *phys_to_virt(kc_phys_addr paddr)
+{
+    return (void *)(DIRECT_MAP_BASE + paddr);
+}
+
+kc_phys_addr virt_to_phys(void *vaddr)
+{
+    uintptr_t address = (uintptr_t)vaddr;
+
+    if ((address >= DIRECT_MAP_BASE) &&
+            (address < DIRECT_MAP_BASE + direct_state.limit))
+    {
+        return address - DIRECT_MAP_BASE;
+    }
+
+    // anything else has to be looked up in the page tables
+    uint64_t *entries = frame_map(page_address(mmu_get_map(), 1));
+
+    for (int level = PAGE_MAP_LEVELS; entries; level--)
+    {
+        uint64_t entry = entries[pte_index(address, level)];
+        frame_unmap(entries);
+
+        if (!(entry & PAGE_PR))
+        {
+            break;
+        }
+
+        if ((level == 1) || (entry & PAGE_LG))
+        {
+            return page_address(entry & PAGE_ADDRESS_MASK, level) +
+                page_offset(address, level);
+        }
+
+        entries = frame_map(page_address(entry & PAGE_ADDRESS_MASK, 1));
+    }
+
+    return 0;
+}
+
+static void *map_tableset(void *vaddr, uint64_t *tables[TABLESET_COUNT])
+{
+    uint64_t current_phys;
+    uint64_t *current_pte;
+    // pml4 is guaranteed to be present. no checks necessary.
+    //
+
+    current_phys = page_address(mmu_get_map(), 1);
+    tables[TABLESET_COUNT] = frame_map(current_phys);
+    int n = TABLESET_COUNT;
+
+    while (n)
+    {
+        if (tables[n])
+        {
+            current_pte = &tables[n][pte_index(vaddr, n+1)];
+
+            if (!page_address(*current_pte, 1))
+            {
+                tables[n-1] = table_alloc(current_pte);
+            }
+            else
+            {
+                current_phys = page_address(*current_pte & PAGE_ADDRESS_MASK, 1);
+                tables[n-1] = frame_map(current_phys);
+            }
+        }
+        n--;
+    }
+
+    if (tables[0])
+    {
+        current_pte = &tables[0][pte_index(vaddr, 1)];
+    }
+
+    return vaddr;
+}
+
+void *page_set_flags(void *vaddr, enum page_map_flags flags)
+{
+    uint64_t *mapset[PAGE_MAP_LEVELS] = {NULL};
+
+    if (vaddr != map_tableset(vaddr, mapset))
+    {
+        PANIC(GENERAL_PANIC);
+    }
+
+    if (flags & PRIV_MASK)
+    {
+        mapset[3][pte_index(vaddr, 4)] |= PAGE_US;
+        mapset[2][pte_index(vaddr, 3)] |= PAGE_US;
+        mapset[1][pte_index(vaddr, 2)] |= PAGE_US;
+        mapset[0][pte_index(vaddr, 1)] |= PAGE_US;
+    }
+
+    for(int i = 0; i < PAGE_MAP_LEVELS; i++)
+    {
+        if (mapset[i])
+            frame_unmap(mapset[i]);
+    }
+
+    return vaddr;
+}
+
+// a 4KiB mapping inside a huge page, or taking part of it away, breaks
+// it up into a table of small pages that map the same frames
+static bool huge_split(void *vaddr)
+{
+    if (((uintptr_t)vaddr >= DIRECT_MAP_BASE) &&
+            ((uintptr_t)vaddr < DIRECT_MAP_BASE + DIRECT_MAP_SIZE))
+    {
+        return false;
+    }
+
+    uint64_t *table = table_at((uintptr_t)vaddr, 2);
+
+    if (!table)
+    {
+        return false;
+    }
+
+    uint64_t flags = irq_lock();
+    uint64_t *entry = &table[pte_index(vaddr, 2)];
+    uint64_t large = *entry;
+    bool split = (large & PAGE_PR) && (large & PAGE_LG);
+
+    if (split)
+    {
+        kc_phys_addr base = page_address(large & PAGE_ADDRESS_MASK, 2);
+        char *page = (char *)page_address(vaddr, 2);
+        uint64_t *small = table_alloc(entry);
+        *entry = (*entry & ~PAGE_NX) | (large & (PAGE_NX|PAGE_US));
+
+        for (int i = 0; i < 512; i++)
+        {
+            small[i] = (base + i * page_size(1)) |
+                (large & ~(PAGE_ADDRESS_MASK|PAGE_LG));
+        }
+
+        frame_unmap(small);
+        mmu_invalidate(page);
+
+        // the block becomes single pages, each with its own mapping held
+        // in its descriptor
+        if (page_stack_get_order(base) == 9)
+        {
+            page_stack_split(base);
+
+            for (int i = 1; i < 512; i++)
+            {
+                page_inc_ref(base + i * page_size(1));
+                page_rmap_add(
+                        base + i * page_size(1),
+                        page + i * page_size(1));
+            }
+        }
+
+        huge_state.splits++;
+    }
+
+    frame_unmap(table);
+    irq_unlock(flags);
+
+    return split;
+}
+
+// the bits a present entry gets for flags, apart from its size
+static uint64_t map_entry_bits(enum page_map_flags flags)
+{
+    uint64_t entry = PAGE_PR;
+
+    switch (flags & CONTENT_MASK)
+    {
+        case CONTENT_RODATA:
+            entry |= PAGE_NX;
+            break;
+        case CONTENT_RWDATA:
+            entry |= PAGE_NX|PAGE_WR;
+            break;
+        default:
+            break;
+    }
+
+    if (flags & PRIV_MASK)
+    {
+        entry |= PAGE_US;
+    }
+
+    return entry;
+}
+
+void *page_map_at(
+        void *vaddr,
+        phys_addr_t paddr,
+        enum page_map_flags flags)
+{
+    // TODO: add checks to prevent attempts to map reserved addreses
+    //
+    uint64_t entry = map_entry_bits(flags);
+
+    int level;
+
+    switch (flags & SIZE_MASK)
+    {
+        case SIZE_1G:
+            level = 3;
+            entry |= PAGE_LG;
+            break;
+        case SIZE_2M:
+            level = 2;
+            entry |= PAGE_LG;
+            break;
+        case 0:
+        case SIZE_4K:
+            level = 1;
+            break;
+        default:
+            return NULL;
+    }
+
+    size_t offset = page_offset(paddr, level);
+    paddr = page_address(paddr, level);
+
+    uint64_t *table = table_at((uintptr_t)vaddr, level);
+
+    if (!table && (level == 1) && huge_split(vaddr))
+    {
+        table = table_at((uintptr_t)vaddr, level);
+    }
+
+    if (!table)
+    {
+        kprintf("error: %p is already covered by a larger page\n", vaddr);
+        PANIC(GENERAL_PANIC);
+    }
+
+    // the entry and the reverse maps of both frames change together
+    uint64_t *pte = &table[pte_index(vaddr, level)];
+    void *page = (void *)page_address(vaddr, level);
+    kc_phys_addr previous = 0;
+    uint64_t lock = irq_lock();
+
+    if (*pte & PAGE_PR)
+    {
+        if ((level > 1) && !(*pte & PAGE_LG))
+        {
+            kprintf("error: large page at %p would drop a page table\n",
+                    vaddr);
+            PANIC(GENERAL_PANIC);
+        }
+
+        previous = page_address(*pte & PAGE_ADDRESS_MASK, level);
+    }
+
+    // the zero page is mapped everywhere and never moves, and an address
+    // in an address space's window means nothing on its own. a frame that
+    // is mapped elsewhere already needs chain entries, which can only be
+    // allocated with the lock released
+    while ((previous != paddr) && (paddr != vm_state.zero_page) &&
+            !space_contains(page) && (page_rmap_add(paddr, page) < 0))
+    {
+        irq_unlock(lock);
+
+        if (page_rmap_reserve(2) < 0)
+        {
+            frame_unmap(table);
+            return NULL;
+        }
+
+        lock = irq_lock();
+        previous = *pte & PAGE_PR ?
+            page_address(*pte & PAGE_ADDRESS_MASK, level) : 0;
+    }
+
+    *pte = paddr | entry;
+
+    // take a reference to the page
+    if (previous != paddr)
+    {
+        page_inc_ref(paddr);
+    }
+
+    // the replaced frame loses its mapping, and with it the reference, a
+    // frame that is mapped again where it already was keeps both as they
+    // are
+    if (previous && (previous != paddr))
+    {
+        mmu_invalidate(page);
+        page_rmap_remove(previous, page);
+        page_free(previous);
+    }
+
+    irq_unlock(lock);
+    frame_unmap(table);
+
+    return (char *)vaddr + offset;
+}
+
+// take back the frames page_populate() put in before it failed
+static void populate_unwind(char *vaddr, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += page_size(1))
+    {
+        char *page = vaddr + offset;
+        kc_phys_addr paddr = virt_to_phys(page);
+
+        // the mapping's reference goes with the entry, the allocation's here
+        page_unmap(page);
+        page_free(paddr);
+    }
+}
+
+void *page_populate(void *vaddr, size_t size, enum page_map_flags flags)
+{
+    // back every page of a range with a fresh zeroed frame up front
+    for (size_t offset = 0; offset < size; offset += page_size(1))
+    {
+        char *page = (char *)vaddr + offset;
+        kc_phys_addr paddr = page_alloc_colored(PAGE_ALLOC_CONV, page);
+
+        if (!paddr)
+        {
+            kprintf("warning: failed populating page at %p\n", page);
+            populate_unwind(vaddr, offset);
+            return NULL;
+        }
+
+        if (!page_map_at(page, paddr, (flags & ~SIZE_MASK)|SIZE_4K))
+        {
+            kprintf("warning: failed mapping page at %p\n", page);
+            page_free(paddr);
+            populate_unwind(vaddr, offset);
+            return NULL;
+        }
+
+        mmu_invalidate(page);
+        memset(page, 0, page_size(1));
+    }
+
+    return vaddr;
+}
+
+static void clear_nontemporal(uint64_t *page)
+{
+    for (size_t i = 0; i < page_size(1) / sizeof(*page); i += 4)
+    {
+        __asm__ volatile
+            (
+             "movnti %1, 0(%0)\n\t"
+             "movnti %1, 8(%0)\n\t"
+             "movnti %1, 16(%0)\n\t"
+             "movnti %1, 24(%0)\n\t"
+             :
+             : "r"(&page[i]), "r"(0ULL)
+             : "memory"
+            );
+    }
+
+    __asm__ volatile ("sfence" ::: "memory");
+}
+
+void page_clear(kc_phys_addr paddr, int nontemporal)
+{
+    uint64_t *page = frame_map(page_address(paddr, 1));
+
+    if (!page)
+    {
+        kprintf("error: failed mapping page %#lx for clearing\n", paddr);
+        PANIC(GENERAL_PANIC);
+    }
+
+    if (nontemporal)
+    {
+        clear_nontemporal(page);
+    }
+    else
+    {
+        memset(page, 0, page_size(1));
+    }
+
+    frame_unmap(page);
+}
+
+static void walk_table(kc_phys_addr table, int level, page_walk_func func)
+{
+    uint64_t *entries = frame_map(table);
+
+    if (!entries)
+    {
+        kprintf("error: failed mapping page table %#lx for walking\n", table);
+        PANIC(GENERAL_PANIC);
+    }
+
+    func(table);
+
+    // the bottom half of the top level table belongs to the firmware
+    for (int index = level == PAGE_MAP_LEVELS ? 256 : 0; index < 512; index++)
+    {
+        uint64_t entry = entries[index];
+
+        if (!(entry & PAGE_PR))
+        {
+            continue;
+        }
+
+        // the direct map covers everything, it doesn't mean anything is used
+        if ((level == PAGE_MAP_LEVELS) &&
+                (index >= (int)pte_index(DIRECT_MAP_BASE, PAGE_MAP_LEVELS)) &&
+                (index <= (int)pte_index((DIRECT_MAP_BASE + DIRECT_MAP_SIZE - 1),
+                                         PAGE_MAP_LEVELS)))
+        {
+            continue;
+        }
+
+        if (level == 1)
+        {
+            func(page_address(entry & PAGE_ADDRESS_MASK, 1));
+        }
+        else if (entry & PAGE_LG)
+        {
+            kc_phys_addr base = page_address(entry & PAGE_ADDRESS_MASK, level);
+
+            for (size_t offset = 0;
+                    offset < (size_t)page_size(level);
+                    offset += page_size(1))
+            {
+                func(base + offset);
+            }
+        }
+        else
+        {
+            // the self-mapped table only ever shows up as a leaf here
+            walk_table(
+                    page_address(entry & PAGE_ADDRESS_MASK, 1),
+                    level - 1,
+                    func);
+        }
+    }
+
+    frame_unmap(entries);
+}
+
+void page_walk_kernel(page_walk_func func)
+{
+    walk_table(page_address(mmu_get_map(), 1), PAGE_MAP_LEVELS, func);
+}
+
+int page_inc_ref(kc_phys_addr page)
+{
+    return page_stack_inc_ref(page);
+}
+
+int page_dec_ref(kc_phys_addr page)
+{
+    return page_stack_dec_ref(page);
+}
+
+#define VM_HEAP_SIZE 16 * page_size(2)
+
+static void *temp_page_alloc(void)
+{
+    int index = temp_state.first_free;
+
+    // do not allocate the 511th index!!
+    if (index > -1 && index < 511)
+    {
+        temp_state.first_free = temp_state.table[index] >> 1;
+        temp_state.table[index] = 0;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    return (void *)-((512ULL - index) << 12);
+}
+
+static void temp_page_free(void *address)
+{
+    int index = pte_index(address, 1);
+
+    if (index > -1 && index < 511)
+    {
+        temp_state.table[index] = temp_state.first_free << 1;
+        temp_state.first_free = index;
+    }
+}
+
+static void *temp_page_map(kc_phys_addr paddr, enum page_map_flags flags)
+{
+    uint64_t entry = PAGE_PR;
+    size_t offset = 0;
+
+    switch (flags & SIZE_MASK)
+    {
+        case 0:
+        case SIZE_4K:
+            offset = page_offset(paddr, 1);
+            break;
+        default:
+            return NULL;
+    }
+
+    switch (flags & CONTENT_MASK)
+    {
+        case CONTENT_RODATA:
+            entry |= PAGE_NX;
+            break;
+        case CONTENT_RWDATA:
+            entry |= PAGE_NX|PAGE_WR;
+            break;
+        default:
+            break;
+    }
+
+    unsigned char *vaddr = temp_page_alloc();
+
+    if (vaddr)
+    {
+        vaddr += offset;
+        temp_state.table[pte_index(vaddr, 1)] = page_address(paddr, 1) | entry;
+    }
+
+    return vaddr;
+}
+
+static void temp_page_unmap(void *vaddr)
+{
+    temp_page_free(vaddr);
+    mmu_invalidate(vaddr);
+}
+
+static void vm_init(void)
+{
+    kprintf("initializing vm state\n");
+    struct kc_boot_data *boot_data = get_boot_data();
+    struct vm_core_static_state *states = &vm_state.statics[0];
+
+    // initialize the static vm node entries
+    struct
+    {
+        unsigned char *base;
+        unsigned char *head;
+    } vm_ranges[] = {
+        {&kc_image_base, &kc_image_end},
+        {&kc_image_end, &kc_image_end + VM_HEAP_SIZE},
+        {
+            boot_data->buffer.base - page_size(1) * 2,
+            boot_data->buffer.base - page_size(1)
+        },
+        {
+            boot_data->buffer.current,
+            boot_data->buffer.current + boot_data->buffer.max_size,
+        }
+    };
+
+    vm_state.kernel_map = mmu_get_map();
+
+    // regions go between the end of the heap and the boot stack
+    vm_state.alloc_base = (uintptr_t)vm_ranges[HEAP_VM_STATE].head;
+    vm_state.alloc_limit = (uintptr_t)vm_ranges[STACK_VM_STATE].base;
+
+    for (int i = 0; i <= TEMPS_VM_STATE; i++)
+    {
+        vmt_init_node
+            (
+             vm_get_tree(),
+             &states[i].node,
+             states[i].object,
+             (void *)vm_ranges[i].base,
+             (void *)vm_ranges[i].head
+            );
+    }
+
+    // init the temporary mappings table state
+    temp_state.table = (uint64_t *)-page_size(1);
+    temp_state.first_free = -1;
+    for (int index = 0; index < 512; index++)
+    {
+        // i love these array-based linked list stacks
+        if (!(temp_state.table[index] & PAGE_PR))
+        {
+            temp_page_free((void *)-((512ULL - index) << 12));
+        }
+    }
+
+    page_init();
+
+    vm_state.zero_page = page_alloc(PAGE_ALLOC_CONV);
+    if (!vm_state.zero_page)
+    {
+        kprintf("failed allocating for zero page\n");
+        PANIC(GENERAL_PANIC);
+    }
+
+    // make the zero page live up to its name;
+    page_clear(vm_state.zero_page, 0);
+
+    if (KC_BENCHMARKS)
+    {
+        page_map_benchmark();
+    }
+
+    page_init_final();
+}
+
+// pages mapped around a fault from now on, 0 for just the one faulting
+void vm_set_fault_around(size_t pages)
+{
+    fault_policy.around = pages;
+}
+
+void vm_get_fault_policy(struct vm_fault_policy *policy)
+{
+    *policy = fault_policy;
+}
+
+void vm_fault_report(void)
+{
+    kprintf("huge pages: %zu of %zu anonymous faults, %zu fallbacks, "
+            "%zu splits\n",
+            huge_state.huge_faults,
+            huge_state.faults,
+            huge_state.fallbacks,
+            huge_state.splits);
+    kprintf("faults: %zu write-first, %zu pages mapped around\n",
+            fault_state.write_faults,
+            fault_state.around_pages);
+}
+
+void memory_init(void)
+{
+    vm_init();
+}
+
+void *page_map(phys_addr_t page, enum page_map_flags flags)
+{
+    void *vm_page = vm_alloc(4096, VM_ALLOC_TRANSLATE);
+    if (vm_page)
+    {
+        return page_map_at(vm_page, page, flags);
+    }
+    return NULL;
+}
+
+void *page_map_physical(
+        phys_addr_t paddr,
+        size_t size,
+        enum page_map_flags flags)
+{
+    size_t offset = page_offset(paddr, 1);
+    size_t count = page_count(offset + size, 1);
+    char *vaddr = vm_alloc(count * page_size(1), VM_ALLOC_TRANSLATE);
+
+    if (!vaddr)
+    {
+        return NULL;
+    }
+
+    page_map_range(
+            vaddr,
+            page_address(paddr, 1),
+            count * page_size(1),
+            flags & ~SIZE_MASK);
+
+    return vaddr + offset;
+}
+
+// take down a mapping from page_map_physical() along with its region
+void page_unmap_physical(void *vaddr, size_t size)
+{
+    void *base = (void *)page_address(vaddr, 1);
+
+    page_unmap_range(
+            base,
+            page_count(page_offset(vaddr, 1) + size, 1) * page_size(1));
+    vm_free(base);
+}
+
+#define MAP_RANGE_TABLE_BATCH 16
+#define MAP_RANGE_INVALIDATE_PAGES 64
+
+struct map_range
+{
+    uintptr_t vaddr;
+    uintptr_t end;
+    kc_phys_addr paddr;
+    uint64_t entry;
+    int level;
+    bool replaced;
+    kc_phys_addr tables[MAP_RANGE_TABLE_BATCH];
+    size_t table_count;
+    size_t tables_needed;
+};
+
+#define range_entry_size(l) (1ULL << pte_index_bits(l))
+
+// a zeroed table for a range walk. they come from the allocator a batch
+// at a time, never more than the rest of the range could still need
+static kc_phys_addr map_range_table(struct map_range *range)
+{
+    if (!range->table_count)
+    {
+        size_t count = range->tables_needed < MAP_RANGE_TABLE_BATCH ?
+            range->tables_needed : MAP_RANGE_TABLE_BATCH;
+
+        range->table_count = page_alloc_bulk(
+                PAGE_ALLOC_CONV|PAGE_ALLOC_ZEROED,
+                count ? count : 1,
+                range->tables);
+
+        if (!range->table_count)
+        {
+            kprintf("error: failed allocating memory for page table\n");
+            PANIC(OUT_OF_MEMORY);
+        }
+    }
+
+    range->tables_needed -= range->tables_needed ? 1 : 0;
+    return range->tables[--range->table_count];
+}
+
+// fill the part of the range that falls in one table, going down a level
+// only where an entry can't cover a whole aligned piece of it
+static void map_range_fill(
+        struct map_range *range,
+        kc_phys_addr table,
+        int level)
+{
+    uint64_t *entries = frame_map(table);
+    uint64_t size = range_entry_size(level);
+
+    for (size_t i = pte_index(range->vaddr, level);
+            (i < 512) && (range->vaddr < range->end);
+            i++)
+    {
+        uint64_t *entry = &entries[i];
+        bool table_below = (*entry & PAGE_PR) && !(*entry & PAGE_LG) &&
+            (level > 1);
+
+        if ((level <= range->level) && !table_below &&
+                !((range->vaddr | range->paddr) & (size - 1)) &&
+                (range->end - range->vaddr >= size))
+        {
+            range->replaced |= *entry & PAGE_PR;
+            *entry = range->paddr|range->entry|(level > 1 ? PAGE_LG : 0);
+            range->vaddr += size;
+            range->paddr += size;
+            continue;
+        }
+
+        if (!(*entry & PAGE_PR))
+        {
+            *entry = map_range_table(range)|PAGE_NX|PAGE_WR|PAGE_PR;
+        }
+        else if (*entry & PAGE_LG)
+        {
+            kprintf("error: %#lx is already covered by a larger page\n",
+                    range->vaddr);
+            PANIC(GENERAL_PANIC);
+        }
+
+        map_range_fill(
+                range,
+                page_address(*entry & PAGE_ADDRESS_MASK, 1),
+                level - 1);
+    }
+
+    frame_unmap(entries);
+}
+
+// map size bytes of physical memory at vaddr with a single walk, in the
+// largest pages alignment allows up to the size in flags, any without one.
+// the frames aren't counted or reverse mapped, which suits device memory
+// and ranges that are taken down again with page_unmap_range()
+void *page_map_range(
+        void *vaddr,
+        phys_addr_t paddr,
+        size_t size,
+        enum page_map_flags flags)
+{
+    uintptr_t base = page_address(vaddr, 1);
+    struct map_range range = {
+        .vaddr = base,
+        .end = page_align((uintptr_t)vaddr + size - 1, 1),
+        .paddr = page_address(paddr, 1),
+        .entry = map_entry_bits(flags),
+        .level = 3,
+    };
+
+    switch (flags & SIZE_MASK)
+    {
+        case SIZE_4K:
+            range.level = 1;
+            break;
+        case SIZE_2M:
+            range.level = 2;
+            break;
+        default:
+            break;
+    }
+
+    if ((range.level == 3) && !direct_state.huge)
+    {
+        range.level = 2;
+    }
+
+    if (!size)
+    {
+        return vaddr;
+    }
+
+    // at most a table for every 2MiB, 1GiB and 512GiB the range touches
+    for (int level = 2; level <= PAGE_MAP_LEVELS; level++)
+    {
+        range.tables_needed += ((range.end - 1) >> pte_index_bits(level)) -
+            (base >> pte_index_bits(level)) + 1;
+    }
+
+    uint64_t lock = irq_lock();
+
+    map_range_fill(&range, page_address(mmu_get_map(), 1), PAGE_MAP_LEVELS);
+
+    if (range.replaced)
+    {
+        mmu_set_map(mmu_get_map());
+    }
+
+    irq_unlock(lock);
+
+    page_free_bulk(range.table_count, range.tables);
+
+    return vaddr;
+}
+
+// clear the part of the range that falls in one table. tables the range
+// covers completely go with it, apart from those the top level points to,
+// which every page map shares
+static void unmap_range_clear(
+        struct map_range *range,
+        kc_phys_addr table,
+        int level)
+{
+    uint64_t *entries = frame_map(table);
+    uint64_t size = range_entry_size(level);
+
+    for (size_t i = pte_index(range->vaddr, level);
+            (i < 512) && (range->vaddr < range->end);
+            i++)
+    {
+        uint64_t *entry = &entries[i];
+        uintptr_t next = (range->vaddr & ~(size - 1)) + size;
+        bool whole = !(range->vaddr & (size - 1)) &&
+            (range->end - range->vaddr >= size);
+
+        if (!(*entry & PAGE_PR))
+        {
+            range->vaddr = next;
+            continue;
+        }
+
+        if ((level == 1) || (*entry & PAGE_LG))
+        {
+            if (!whole)
+            {
+                kprintf("error: unmapping part of a larger page at %#lx\n",
+                        range->vaddr);
+                PANIC(GENERAL_PANIC);
+            }
+
+            *entry = 0;
+            range->vaddr = next;
+            continue;
+        }
+
+        kc_phys_addr below = page_address(*entry & PAGE_ADDRESS_MASK, 1);
+
+        unmap_range_clear(range, below, level - 1);
+
+        if (whole && (level < PAGE_MAP_LEVELS))
+        {
+            *entry = 0;
+            page_free(below);
+        }
+    }
+
+    frame_unmap(entries);
+}
+
+// take down a range from page_map_range() with a single walk
+void page_unmap_range(void *vaddr, size_t size)
+{
+    struct map_range range = {
+        .vaddr = page_address(vaddr, 1),
+        .end = page_align((uintptr_t)vaddr + size - 1, 1),
+    };
+
+    if (!size)
+    {
+        return;
+    }
+
+    uint64_t lock = irq_lock();
+    size_t pages = (range.end - range.vaddr) / page_size(1);
+
+    unmap_range_clear(&range, page_address(mmu_get_map(), 1), PAGE_MAP_LEVELS);
+
+    // invalidating a page also drops the cached tables above it
+    if (pages <= MAP_RANGE_INVALIDATE_PAGES)
+    {
+        for (size_t i = 0; i < pages; i++)
+        {
+            mmu_invalidate((char *)page_address(vaddr, 1) + i * page_size(1));
+        }
+    }
+    else
+    {
+        mmu_set_map(mmu_get_map());
+    }
+
+    irq_unlock(lock);
+}
+
+// the last level table for vaddr, NULL if there is none
+static uint64_t *map_table_lookup(kc_phys_addr map, void *vaddr)
+{
+    uint64_t *entries = frame_map(page_address(map, 1));
+
+    for (int level = PAGE_MAP_LEVELS; level > 1; level--)
+    {
+        uint64_t entry = entries[pte_index(vaddr, level)];
+        frame_unmap(entries);
+
+        if (!(entry & PAGE_PR) || (entry & PAGE_LG))
+        {
+            return NULL;
+        }
+
+        entries = frame_map(page_address(entry & PAGE_ADDRESS_MASK, 1));
+    }
+
+    return entries;
+}
+
+static uint64_t *table_lookup(void *vaddr)
+{
+    return map_table_lookup(mmu_get_map(), vaddr);
+}
+
+void page_unmap(void *vaddr)
+{
+    void *page = (void *)page_address(vaddr, 1);
+    uint64_t *table = table_lookup(page);
+
+    if (!table && huge_split(page))
+    {
+        table = table_lookup(page);
+    }
+
+    if (!table)
+    {
+        return;
+    }
+
+    uint64_t flags = irq_lock();
+    uint64_t entry = table[pte_index(page, 1)];
+
+    table[pte_index(page, 1)] = 0;
+    frame_unmap(table);
+    mmu_invalidate(page);
+
+    if (page_swap_entry(entry))
+    {
+        page_swap_discard(entry);
+    }
+    else if (entry & PAGE_PR)
+    {
+        kc_phys_addr paddr = page_address(entry & PAGE_ADDRESS_MASK, 1);
+
+        // drop the mapping's reference
+        page_rmap_remove(paddr, page);
+        page_free(paddr);
+    }
+
+    irq_unlock(flags);
+}
+
+// take every mapping of a frame away, returning how many there were
+size_t page_unmap_all(kc_phys_addr page)
+{
+    uint64_t flags = irq_lock();
+    size_t count = 0;
+    void *vaddr;
+
+    while ((vaddr = page_rmap_first(page)))
+    {
+        page_unmap(vaddr);
+        count++;
+
+        // no-op unless the tables lost the mapping behind the map's back
+        page_rmap_remove(page, vaddr);
+    }
+
+    irq_unlock(flags);
+    return count;
+}
+
+kc_phys_addr page_map_get_kernel(void)
+{
+    return vm_state.kernel_map;
+}
+
+// a page map for an address space, with tables of its own for the window
+// and the kernel's everywhere else
+kc_phys_addr page_map_create(void)
+{
+    uint64_t flags = irq_lock();
+    uint64_t *kernel = frame_map(vm_state.kernel_map);
+
+    // a table the kernel half got after a map was made wouldn't show up in
+    // it, so the kernel half gets all of its tables on the first one
+    if (!vm_state.kernel_half_ready)
+    {
+        for (size_t i = 256; i < 512; i++)
+        {
+            if (!(kernel[i] & PAGE_PR))
+            {
+                frame_unmap(table_alloc(&kernel[i]));
+            }
+        }
+
+        vm_state.kernel_half_ready = true;
+    }
+
+    kc_phys_addr map = page_alloc(PAGE_ALLOC_CONV);
+
+    if (!map)
+    {
+        kprintf("error: failed allocating page map\n");
+        PANIC(OUT_OF_MEMORY);
+    }
+
+    uint64_t *entries = frame_map(map);
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        bool private = (i >= pte_index(VM_SPACE_BASE, PAGE_MAP_LEVELS)) &&
+            (i <= pte_index((VM_SPACE_LIMIT - 1), PAGE_MAP_LEVELS));
+
+        entries[i] = private ? 0 : kernel[i];
+    }
+
+    frame_unmap(entries);
+    frame_unmap(kernel);
+    irq_unlock(flags);
+
+    return map;
+}
+
+// drop a window entry's frame, which goes back to the allocator along
+// with its last mapping
+static void space_entry_release(uint64_t *entry)
+{
+    kc_phys_addr paddr = page_address(*entry & PAGE_ADDRESS_MASK, 1);
+
+    *entry = 0;
+
+    // every map shares the zero page, it is never given back
+    if (paddr == vm_state.zero_page)
+    {
+        return;
+    }
+
+    page_free(paddr);
+
+    if ((page_stack_get_ref(paddr) == 1) && !page_rmap_count(paddr))
+    {
+        page_free(paddr);
+    }
+}
+
+// unmap all of [base, base + size) in a map's window
+void page_map_release_range(kc_phys_addr map, void *base, size_t size)
+{
+    uint64_t flags = irq_lock();
+    bool current = map == mmu_get_map();
+    char *vaddr = base;
+    char *end = vaddr + size;
+
+    while (vaddr < end)
+    {
+        uint64_t *table = map_table_lookup(map, vaddr);
+        char *table_end = (char *)page_align(vaddr, 2);
+
+        for (; table && (vaddr < table_end) && (vaddr < end);
+                vaddr += page_size(1))
+        {
+            uint64_t *entry = &table[pte_index(vaddr, 1)];
+
+            if (*entry & PAGE_PR)
+            {
+                space_entry_release(entry);
+
+                if (current)
+                {
+                    mmu_invalidate(vaddr);
+                }
+            }
+        }
+
+        if (table)
+        {
+            frame_unmap(table);
+        }
+
+        vaddr = table_end;
+    }
+
+    irq_unlock(flags);
+}
+
+static void space_table_free(kc_phys_addr table, int level)
+{
+    uint64_t *entries = frame_map(table);
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        if (!(entries[i] & PAGE_PR))
+        {
+            continue;
+        }
+
+        if (level == 1)
+        {
+            space_entry_release(&entries[i]);
+        }
+        else
+        {
+            space_table_free(
+                    page_address(entries[i] & PAGE_ADDRESS_MASK, 1),
+                    level - 1);
+        }
+    }
+
+    frame_unmap(entries);
+    page_free(table);
+}
+
+// take down a map from page_map_create() and all that's mapped in its window
+void page_map_destroy(kc_phys_addr map)
+{
+    if (map == mmu_get_map())
+    {
+        kprintf("error: destroying the page map in use\n");
+        PANIC(GENERAL_PANIC);
+    }
+
+    uint64_t flags = irq_lock();
+    uint64_t *entries = frame_map(map);
+
+    for (size_t i = pte_index(VM_SPACE_BASE, PAGE_MAP_LEVELS);
+            i <= pte_index((VM_SPACE_LIMIT - 1), PAGE_MAP_LEVELS);
+            i++)
+    {
+        if (entries[i] & PAGE_PR)
+        {
+            space_table_free(
+                    page_address(entries[i] & PAGE_ADDRESS_MASK, 1),
+                    PAGE_MAP_LEVELS - 1);
+        }
+    }
+
+    frame_unmap(entries);
+    page_free(map);
+    irq_unlock(flags);
+}
+
+// map everything in [base, base + size) of one map's window at the same
+// place in another, read-only in both so the first write makes a copy
+size_t page_map_clone_range(
+        kc_phys_addr map,
+        kc_phys_addr target,
+        void *base,
+        size_t size)
+{
+    uint64_t flags = irq_lock();
+    bool current = map == mmu_get_map();
+    char *vaddr = base;
+    char *end = vaddr + size;
+    size_t count = 0;
+
+    while (vaddr < end)
+    {
+        uint64_t *from = map_table_lookup(map, vaddr);
+        uint64_t *to = from ? map_table_at(target, (uintptr_t)vaddr, 1) : NULL;
+        char *table_end = (char *)page_align(vaddr, 2);
+
+        for (; from && (vaddr < table_end) && (vaddr < end);
+                vaddr += page_size(1))
+        {
+            size_t i = pte_index(vaddr, 1);
+
+            if (!(from[i] & PAGE_PR))
+            {
+                continue;
+            }
+
+            from[i] &= ~(uint64_t)PAGE_WR;
+            to[i] = from[i];
+            page_inc_ref(page_address(from[i] & PAGE_ADDRESS_MASK, 1));
+            count++;
+
+            if (current)
+            {
+                mmu_invalidate(vaddr);
+            }
+        }
+
+        if (from)
+        {
+            frame_unmap(to);
+            frame_unmap(from);
+        }
+
+        vaddr = table_end;
+    }
+
+    irq_unlock(flags);
+    return count;
+}
+
+// an anonymous page mapped just once, in a region that belongs to object
+static void *single_mapping_in(kc_phys_addr page, struct vm_object *object)
+{
+    void *vaddr = page_get_movable(page);
+
+    if (!vaddr || (page_rmap_count(page) != 1))
+    {
+        return NULL;
+    }
+
+    struct vm_tree_key key = {(uintptr_t)vaddr, page_size(1)};
+    struct vm_tree_node *node = vmt_search_key(vm_get_tree(), &key);
+
+    return node && (node->object == object) ? vaddr : NULL;
+}
+
+// a swappable page is one that a single cache mapping would move with
+void *page_get_swappable(kc_phys_addr page)
+{
+    return single_mapping_in(page, &vm_state.global_cache);
+}
+
+// the heap and thread stacks are never merged, they'd fault on the shared
+// frame in places that can't take a fault
+void *page_get_mergeable(kc_phys_addr page)
+{
+    return single_mapping_in(page, &vm_state.global_mergeable);
+}
+
+// clear a bit the processor sets in a page's entry, returning whether it was
+static int clear_entry_bit(void *vaddr, uint64_t bit)
+{
+    uint64_t *table = table_lookup(vaddr);
+
+    if (!table)
+    {
+        return 0;
+    }
+
+    uint64_t *entry = &table[pte_index(vaddr, 1)];
+    int set = (*entry & (PAGE_PR|bit)) == (PAGE_PR|bit);
+
+    if (set)
+    {
+        *entry &= ~bit;
+        mmu_invalidate(vaddr);
+    }
+
+    frame_unmap(table);
+    return set;
+}
+
+// whether the page was touched since the last call
+int page_clear_accessed(void *vaddr)
+{
+    return clear_entry_bit(vaddr, PAGE_AC);
+}
+
+// whether the page was written since the last call
+int page_clear_dirty(void *vaddr)
+{
+    return clear_entry_bit(vaddr, PAGE_DT);
+}
+
+// unmap a page and leave a swap entry behind for the next fault to find
+void page_unmap_swapped(void *vaddr, uint64_t swap)
+{
+    uint64_t flags = irq_lock();
+    page_unmap(vaddr);
+
+    uint64_t *table = table_lookup(vaddr);
+
+    if (table)
+    {
+        table[pte_index(vaddr, 1)] = swap;
+        frame_unmap(table);
+    }
+
+    irq_unlock(flags);
+}
+
+// the swap entry a page was replaced with, 0 if there is none
+static uint64_t page_get_swapped(void *vaddr)
+{
+    uint64_t *table = table_lookup(vaddr);
+    uint64_t entry = table ? table[pte_index(vaddr, 1)] : 0;
+
+    if (table)
+    {
+        frame_unmap(table);
+    }
+
+    return page_swap_entry(entry) ? entry : 0;
+}
+
+struct page_remap
+{
+    kc_phys_addr page;
+    kc_phys_addr target;
+    uint64_t clear;
+};
+
+static void remap_one(void *vaddr, void *data)
+{
+    struct page_remap *remap = data;
+    uint64_t *table = table_lookup(vaddr);
+    uint64_t *pte = table ? &table[pte_index(vaddr, 1)] : NULL;
+
+    if (!pte || (page_address(*pte & PAGE_ADDRESS_MASK, 1) != remap->page))
+    {
+        kprintf("error: reverse map of %#lx is stale at %p\n",
+                remap->page,
+                vaddr);
+        PANIC(GENERAL_PANIC);
+    }
+
+    *pte = (*pte & ~(PAGE_ADDRESS_MASK | remap->clear)) | remap->target;
+    frame_unmap(table);
+    mmu_invalidate(vaddr);
+
+    // the reference moves along with the mapping
+    if (remap->target != remap->page)
+    {
+        page_inc_ref(remap->target);
+        page_dec_ref(remap->page);
+    }
 }
 
-void memory_init(void)
+// point every mapping of a frame at target instead, keeping its flags
+size_t page_remap_all(kc_phys_addr page, kc_phys_addr target)
 {
-    vm_init();
+    struct page_remap remap = {page, target, 0};
+    uint64_t flags = irq_lock();
+    size_t count = page_rmap_walk(page, remap_one, &remap);
+
+    page_rmap_move(page, target);
+    irq_unlock(flags);
+
+    return count;
 }
 
-void *page_map(phys_addr_t page, enum page_map_flags flags)
+// point every mapping of a frame at target read-only, target may be the
+// frame itself to only write protect it
+size_t page_share(kc_phys_addr page, kc_phys_addr target)
 {
-    void *vm_page = vm_alloc(4096, VM_ALLOC_TRANSLATE);
-    if (vm_page)
+    struct page_remap remap = {page, target, PAGE_WR};
+    bool moving = (target != page) && (target != vm_state.zero_page);
+    uint64_t flags = irq_lock();
+
+    // each mapping that moves may need a chain entry on target, there
+    // have to be enough of them before anything changes
+    while (moving && !page_rmap_ready(page_rmap_count(page) + 1))
     {
-        page_map_at(vm_page, page, flags);
+        irq_unlock(flags);
+
+        if (page_rmap_reserve(page_rmap_count(page) + 1) < 0)
+        {
+            return 0;
+        }
+
+        flags = irq_lock();
     }
-    return NULL;
+
+    size_t count = page_rmap_walk(page, remap_one, &remap);
+    void *vaddr;
+
+    while ((target != page) && (vaddr = page_rmap_first(page)))
+    {
+        page_rmap_remove(page, vaddr);
+
+        if (target != vm_state.zero_page)
+        {
+            page_rmap_add(target, vaddr);
+        }
+    }
+
+    irq_unlock(flags);
+    return count;
 }
 
-void page_unmap(void *vaddr)
+kc_phys_addr vm_get_zero_page(void)
 {
-    (void)vaddr;
+    return vm_state.zero_page;
 }
 
 struct heap_header
@@ -549,63 +2292,485 @@ void *memory_alloc(size_t size)
 
 void memory_free(void *block)
 {
-    // a little complicated to implement
-    //
-    // 1. find the vm_object that owns the block
-    //   a. if the vm_object is a heap, call heap_free()
-    //   b. if the vm_object is an anonymous vm_area, call vm_free().
-    //   c. if the object is any other kind issue a bug warning and do nothing
-    (void)block;
+    struct vm_tree_key key = {(uintptr_t)block, 1};
+    struct vm_tree_node *node = vmt_search_key(vm_get_tree(), &key);
+
+    if (node == &vm_state.statics[HEAP_VM_STATE].node)
+    {
+        heap_free(block);
+    }
+    else if (node && (node->object->type == ANONYMOUS_VM_OBJECT))
+    {
+        vm_free(block);
+    }
+    else
+    {
+        kprintf("warning: memory_free of %p which memory_alloc didn't "
+                "hand out\n", block);
+    }
 }
 
-void *vm_alloc_at(void *address, size_t size, enum vm_alloc_flags flags)
+// the object a region allocated with flags belongs to
+static struct vm_object *alloc_object(enum vm_alloc_flags flags)
 {
-    struct vm_tree_key key = {(uintptr_t)address, size};
-    struct vm_tree_node *node;
-    struct vm_object *object;
-
     switch (flags & VM_ALLOC_MECHANISM_MASK)
     {
         case VM_ALLOC_ANONYMOUS:
-            object = &vm_state.global_anonymous;
-            break;
+            // cache memory can be compressed away when memory runs out,
+            // and only regions that ask for it get their pages merged
+            switch (flags & VM_ALLOC_TYPE_MASK)
+            {
+                case VM_ALLOC_CACHE:
+                    return &vm_state.global_cache;
+                case VM_ALLOC_MERGEABLE:
+                    return &vm_state.global_mergeable;
+                default:
+                    return &vm_state.global_anonymous;
+            }
         case VM_ALLOC_DIRECT:
-            object = &vm_state.global_direct;
-            break;
+            return &vm_state.global_direct;
         case VM_ALLOC_TRANSLATE:
-            object = &vm_state.global_translate;
-            break;
+            return &vm_state.global_translate;
         default:
             return NULL;
     }
+}
+
+// put a region for object into the tree, with the lock held
+static struct vm_tree_node *region_insert(
+        void *address,
+        size_t size,
+        struct vm_object *object)
+{
+    struct vm_tree_key key = {(uintptr_t)address, size};
+    struct vm_tree_node *node;
 
-    if (!vmt_search_key(vm_get_tree(), &key) &&
-            (node = heap_alloc(sizeof(*node))))
+    if (vmt_search_key(vm_get_tree(), &key) ||
+            !(node = heap_alloc(sizeof(*node))))
     {
-        vmt_init_node(
-                vm_get_tree(),
-                node,
-                object,
-                address,
-                (char *)address + size);
+        return NULL;
+    }
+
+    vmt_init_node(
+            vm_get_tree(),
+            node,
+            object,
+            address,
+            (char *)address + size);
+
+    return node;
+}
+
+// take a region and everything mapped in it down, with the lock held
+static void region_remove(struct vm_tree_node *node)
+{
+    vm_release(node);
+    vmt_delete(vm_get_tree(), node);
+    heap_free(node);
+}
+
+// the address of a region that was just inserted, backed up front if it
+// asked for that. it runs with the lock released, as zeroing the frames
+// takes a while, and takes the region away again if memory runs out
+static void *region_finish(
+        struct vm_tree_node *node,
+        enum vm_alloc_flags flags)
+{
+    void *address = (void *)node->key.address;
+
+    // only anonymous memory has frames of its own to put in up front
+    if ((flags & VM_ALLOC_IMMEDIATE) &&
+            (node->object->type == ANONYMOUS_VM_OBJECT) &&
+            (vm_populate(node) < 0))
+    {
+        uint64_t irq = irq_lock();
+        region_remove(node);
+        irq_unlock(irq);
+        return NULL;
     }
-    
+
     return address;
 }
 
+void *vm_alloc_at(void *address, size_t size, enum vm_alloc_flags flags)
+{
+    struct vm_object *object = alloc_object(flags);
+
+    if (!object)
+    {
+        return NULL;
+    }
+
+    uint64_t irq = irq_lock();
+    struct vm_tree_node *node = region_insert(address, size, object);
+
+    irq_unlock(irq);
+    return node ? region_finish(node, flags) : NULL;
+}
+
+// a region anywhere in the allocation range, belonging to object
+static void *region_alloc(
+        size_t size,
+        enum vm_alloc_flags flags,
+        struct vm_object *object)
+{
+    size = page_count(size, 1) * page_size(1);
+
+    // anonymous and translated regions that could hold a large page get
+    // one to start on
+    enum vm_alloc_flags mechanism = flags & VM_ALLOC_MECHANISM_MASK;
+    size_t align = ((mechanism == VM_ALLOC_ANONYMOUS) ||
+            (mechanism == VM_ALLOC_TRANSLATE)) &&
+        (size >= page_size(2)) ? page_size(2) : page_size(1);
+
+    uint64_t irq = irq_lock();
+    void *address = vmt_find_gap(
+            vm_get_tree(),
+            vm_state.alloc_base,
+            vm_state.alloc_limit,
+            size,
+            align);
+    struct vm_tree_node *node = address ?
+        region_insert(address, size, object) : NULL;
+
+    irq_unlock(irq);
+    return node ? region_finish(node, flags) : NULL;
+}
+
 void *vm_alloc(size_t size, enum vm_alloc_flags flags)
 {
-    (void)flags;
-    // TODO implement a proper allocator here rather than this bump allocator.
-    char *address = vm_state.first_free;
+    struct vm_object *object = alloc_object(flags);
+
+    return object ? region_alloc(size, flags, object) : NULL;
+}
+
+// anonymous memory that faults by the policy the caller set in object,
+// which also counts the faults
+void *vm_alloc_policy(
+        size_t size,
+        enum vm_alloc_flags flags,
+        struct vm_policy_object *object)
+{
+    object->object = (struct vm_object){
+        ANONYMOUS_VM_OBJECT,
+        policy_page_handler
+    };
+    object->faults = 0;
+
+    return region_alloc(
+            size,
+            (flags & ~VM_ALLOC_MECHANISM_MASK)|VM_ALLOC_ANONYMOUS,
+            &object->object);
+}
+
+// take down every mapping in a region, an anonymous region's frames go
+// back to the allocator with it
+static void vm_release(struct vm_tree_node *node)
+{
+    bool anonymous = node->object->type == ANONYMOUS_VM_OBJECT;
+    char *vaddr = (char *)node->key.address;
+    char *end = vaddr + node->key.size;
+
+    while (vaddr < end)
+    {
+        uint64_t *table = table_lookup(vaddr);
+
+        if (!table && huge_split(vaddr))
+        {
+            table = table_lookup(vaddr);
+        }
+
+        // nothing was ever mapped in this 2MiB
+        if (!table)
+        {
+            vaddr = (char *)page_align(vaddr, 2);
+            continue;
+        }
+
+        uint64_t entry = table[pte_index(vaddr, 1)];
+        frame_unmap(table);
+
+        if (entry)
+        {
+            kc_phys_addr paddr = entry & PAGE_PR ?
+                page_address(entry & PAGE_ADDRESS_MASK, 1) : 0;
+
+            page_unmap(vaddr);
+
+            // a frame that no one maps anymore and has one reference left
+            // still holds the one it was allocated with. shared frames
+            // have more, and the zero page belongs to no region
+            if (anonymous && paddr && (paddr != vm_state.zero_page) &&
+                    (page_stack_get_ref(paddr) == 1) &&
+                    !page_rmap_count(paddr))
+            {
+                page_free(paddr);
+            }
+        }
+
+        vaddr += page_size(1);
+    }
+}
+
+void vm_free(void *block)
+{
+    struct vm_tree_key key = {(uintptr_t)block, 1};
+    uint64_t irq = irq_lock();
+    struct vm_tree_node *node = vmt_search_key(vm_get_tree(), &key);
 
-    if (address == vm_alloc_at(address, size, flags))
+    // only whole regions from vm_alloc(), or from vm_alloc_at() in the
+    // scratch slot, can be given back
+    if (!node ||
+            (node->key.address != (uintptr_t)block) ||
+            (!alloc_contains(node->key.address) &&
+             !scratch_contains(node->key.address)))
+    {
+        kprintf("warning: vm_free of %p which isn't an allocated region\n",
+                block);
+    }
+    else
     {
-        vm_state.first_free = address + size;
-        return address;
+        region_remove(node);
     }
 
-    return NULL;
+    irq_unlock(irq);
+}
+
+// how scattered the space vm_alloc() takes regions from is
+void vm_get_gap_stats(struct vm_tree_gap_stats *stats)
+{
+    uint64_t irq = irq_lock();
+
+    vmt_get_gap_stats(
+            vm_get_tree(),
+            vm_state.alloc_base,
+            vm_state.alloc_limit,
+            stats);
+
+    irq_unlock(irq);
+}
+
+// back the aligned 2MiB around address with a single large page if all
+// of it belongs to the region and nothing in it is mapped yet
+static bool huge_map(struct vm_tree_node *node, void *address)
+{
+    uintptr_t base = page_address(address, 2);
+
+    if ((base < node->key.address) ||
+            (base + page_size(2) > node->key.address + node->key.size))
+    {
+        return false;
+    }
+
+    uint64_t *table = table_at(base, 2);
+    bool empty = table && !(table[pte_index(base, 2)] & PAGE_PR);
+
+    if (table)
+    {
+        frame_unmap(table);
+    }
+
+    if (!empty)
+    {
+        return false;
+    }
+
+    // no compaction here, a fault just takes small pages instead
+    kc_phys_addr paddr = page_stack_alloc_order(9, PAGE_ALLOC_CONV);
+    page_stack_notify();
+
+    if (!paddr)
+    {
+        huge_state.fallbacks++;
+        return false;
+    }
+
+    for (int i = 0; i < 512; i++)
+    {
+        page_clear(paddr + i * page_size(1), 0);
+    }
+
+    page_map_at((void *)base, paddr, CONTENT_RWDATA|SIZE_2M);
+
+    return true;
+}
+
+// the settings a region's faults go by, its object's own or the global ones
+static const struct vm_fault_policy *node_policy(struct vm_tree_node *node)
+{
+    if (node->object->handler != policy_page_handler)
+    {
+        return &fault_policy;
+    }
+
+    return &((struct vm_policy_object *)node->object)->policy;
+}
+
+#define VM_POPULATE_BATCH 64
+
+// install frames for consecutive pages that share a table, with one walk
+// down to it for all of them
+static void map_table_run(uintptr_t vaddr, kc_phys_addr *pages, size_t count)
+{
+    uint64_t *table = table_at(vaddr, 1);
+
+    if (!table)
+    {
+        kprintf("error: %#lx is already covered by a larger page\n", vaddr);
+        PANIC(GENERAL_PANIC);
+    }
+
+    uint64_t flags = irq_lock();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        void *page = (void *)(vaddr + i * page_size(1));
+
+        // fresh frames take their single mapping in the descriptor, which
+        // can't fail
+        table[pte_index(page, 1)] = pages[i]|PAGE_NX|PAGE_WR|PAGE_PR;
+        page_rmap_add(pages[i], page);
+        page_inc_ref(pages[i]);
+    }
+
+    irq_unlock(flags);
+    frame_unmap(table);
+}
+
+// back all of an anonymous region before anything touches it, with 2MiB
+// pages where they fit and frames taken in bulk everywhere else. -1 if
+// memory ran out, with whatever was mapped by then left in place
+static int vm_populate(struct vm_tree_node *node)
+{
+    uintptr_t vaddr = node->key.address;
+    uintptr_t end = vaddr + node->key.size;
+    kc_phys_addr pages[VM_POPULATE_BATCH];
+
+    while (vaddr < end)
+    {
+        if (node_policy(node)->huge && !page_offset(vaddr, 2) &&
+                (node->object != &vm_state.global_cache) &&
+                (node->object != &vm_state.global_mergeable) &&
+                huge_map(node, (void *)vaddr))
+        {
+            vaddr += page_size(2);
+            continue;
+        }
+
+        uintptr_t limit = page_align(vaddr, 2) < end ?
+            page_align(vaddr, 2) : end;
+        size_t count = (limit - vaddr) / page_size(1);
+        size_t taken = page_alloc_bulk(
+                PAGE_ALLOC_CONV|PAGE_ALLOC_ZEROED,
+                count < VM_POPULATE_BATCH ? count : VM_POPULATE_BATCH,
+                pages);
+
+        if (!taken)
+        {
+            kprintf("warning: failed populating region at %#lx\n", vaddr);
+            return -1;
+        }
+
+        map_table_run(vaddr, pages, taken);
+        vaddr += taken * page_size(1);
+    }
+
+    return 0;
+}
+
+// a frame for an anonymous page, zeroed when it replaces the zero page
+static kc_phys_addr anonymous_alloc(void *address, kc_phys_addr shared)
+{
+    enum page_alloc_flags flags = PAGE_ALLOC_CONV|PAGE_ALLOC_MOVABLE|
+        (shared == vm_state.zero_page ? PAGE_ALLOC_ZEROED : 0);
+    kc_phys_addr paddr = page_alloc_colored(flags, address);
+
+    // push cold cache pages out to make room before giving up
+    if (!paddr && page_swap_reclaim(PAGE_SWAP_RECLAIM_BATCH))
+    {
+        paddr = page_alloc_colored(flags, address);
+    }
+
+    if (!paddr)
+    {
+        kprintf("got zero from page_alloc :|\n");
+        PANIC(OUT_OF_MEMORY);
+    }
+
+    return paddr;
+}
+
+// map the pages around a fault that was just handled. a read gets the
+// zero page over the aligned block it falls in, a write that picks up
+// where the last one left off gets fresh frames for the block after it.
+// only empty entries in the same table are filled, never swapped out ones
+static void fault_around(struct vm_tree_node *node, void *address, bool write)
+{
+    uintptr_t page = page_address(address, 1);
+    uintptr_t window = node_policy(node)->around * page_size(1);
+    uintptr_t base = page - page % (window ? window : 1);
+    uintptr_t *next = &fault_state.next[cpu_get_index()];
+    bool stream = page == *next;
+
+    if (write)
+    {
+        base = page + page_size(1);
+        *next = base;
+    }
+
+    if (!window || (write && !stream))
+    {
+        return;
+    }
+
+    uintptr_t limit = base + window;
+    uintptr_t end = node->key.address + node->key.size;
+
+    base = base > node->key.address ? base : node->key.address;
+    base = base > page_address(page, 2) ? base : page_address(page, 2);
+    limit = limit < end ? limit : end;
+    limit = limit < page_align(page, 2) ? limit : page_align(page, 2);
+
+    uint64_t flags = irq_lock();
+    uint64_t *table = table_lookup((void *)page);
+
+    for (uintptr_t vaddr = base; table && (vaddr < limit);
+            vaddr += page_size(1))
+    {
+        if (table[pte_index(vaddr, 1)])
+        {
+            continue;
+        }
+
+        kc_phys_addr paddr = !write ? vm_state.zero_page :
+            page_alloc_colored(
+                    PAGE_ALLOC_CONV|PAGE_ALLOC_MOVABLE|PAGE_ALLOC_ZEROED,
+                    (void *)vaddr);
+
+        // it's only ahead of time, the fault gets it if memory is short
+        if (!paddr)
+        {
+            break;
+        }
+
+        page_map_at(
+                (void *)vaddr,
+                paddr,
+                (write ? CONTENT_RWDATA : CONTENT_RODATA)|SIZE_4K);
+        fault_state.around_pages++;
+
+        if (write)
+        {
+            *next = vaddr + page_size(1);
+        }
+    }
+
+    if (table)
+    {
+        frame_unmap(table);
+    }
+
+    irq_unlock(flags);
 }
 
 int anonymous_page_handler(
@@ -613,46 +2778,125 @@ int anonymous_page_handler(
         uint32_t code,
         void *address)
 {
-    (void)node;
+    const struct vm_fault_policy *policy = node_policy(node);
+
+    huge_state.faults++;
 
     if (!(code & 1))
     {
-        // map the zero page read-only to the address
-        page_map_at(
-                address,
-                vm_state.zero_page,
-                CONTENT_RODATA|SIZE_4K);
+        uint64_t swap = page_get_swapped(address);
+
+        if (swap)
+        {
+            kc_phys_addr paddr = page_swap_in(swap);
+
+            if (!paddr)
+            {
+                kprintf("error: no memory to swap in %p\n", address);
+                PANIC(OUT_OF_MEMORY);
+            }
+
+            page_map_at(address, paddr, CONTENT_RWDATA|SIZE_4K);
+            return 0;
+        }
+    }
+
+    // swappable and mergeable memory stays in small pages so it can go out
+    // or be merged page by page, and address spaces are cloned page by page
+    if (policy->huge && !(code & 1) &&
+            (node->object != &vm_state.global_cache) &&
+            (node->object != &vm_state.global_mergeable) &&
+            !space_contains(address) &&
+            huge_map(node, address))
+    {
+        huge_state.huge_faults++;
+        return 0;
+    }
+
+    if (!(code & 1))
+    {
+        // a write would only fault again on the zero page, so it gets a
+        // frame of its own right away
+        if ((code & 2) && policy->write_first)
+        {
+            page_map_at(
+                    address,
+                    anonymous_alloc(address, vm_state.zero_page),
+                    CONTENT_RWDATA|SIZE_4K);
+            fault_state.write_faults++;
+        }
+        else
+        {
+            // map the zero page read-only to the address
+            page_map_at(
+                    address,
+                    vm_state.zero_page,
+                    CONTENT_RODATA|SIZE_4K);
+        }
+
+        fault_around(node, address, (code & 2) && policy->write_first);
+        return 0;
     }
 
     if ((code & 1) && (code & 2)) // page fault write violation on present page
     {
         mmu_invalidate(address);
-        kc_phys_addr paddr = page_alloc(PAGE_ALLOC_CONV);
 
-        if (!paddr)
+        // anything but the zero page is a merged or cloned page that
+        // needs a copy
+        kc_phys_addr shared = page_address(virt_to_phys(address), 1);
+
+        // unless the allocation and this mapping are all that's left of a
+        // cloned one, then it's just made writable again
+        if (space_contains(address) &&
+                (shared != vm_state.zero_page) &&
+                (page_stack_get_ref(shared) == 2))
         {
-            kprintf("got zero from page_alloc :|\n");
-            PANIC(OUT_OF_MEMORY);
+            page_map_at(address, shared, CONTENT_RWDATA|SIZE_4K);
+            mmu_invalidate(address);
+            return 0;
+        }
+        kc_phys_addr paddr = anonymous_alloc(address, shared);
+
+        if (shared != vm_state.zero_page)
+        {
+            memcpy(phys_to_virt(paddr), phys_to_virt(shared), page_size(1));
         }
+
+        // which drops the shared frame's reference along with the mapping
         page_map_at(
                 address,
-                page_alloc(PAGE_ALLOC_CONV),
+                paddr,
                 CONTENT_RWDATA|SIZE_4K);
-        // NULL out the whole page
-        // TODO: thread to clean dirty pages.
-        memset((void *)page_address(address, 1), 0, page_size(1));
+
+        if ((shared != vm_state.zero_page) && !space_contains(address))
+        {
+            page_merge_unshare(shared);
+        }
     }
 
     return 0;
 }
 
+// a fault in a region with a policy object, which counts it as well
+static int policy_page_handler(
+        struct vm_tree_node *node,
+        uint32_t code,
+        void *address)
+{
+    ((struct vm_policy_object *)node->object)->faults++;
+
+    return anonymous_page_handler(node, code, address);
+}
+
 void page_fault_handler(struct isr_context *context)
 {
     void *address;
     __asm__ volatile ("movq %%cr2, %0" : "=r"(address));
 
-    struct vm_tree_key key = {(uintptr_t)address, sizeof(uint64_t)};
-    struct vm_tree_node *node = vmt_search_key(vm_get_tree(), &key);
+    struct vm_tree *tree = space_contains(address) ?
+        address_space_get_tree(mmu_get_map()) : vm_get_tree();
+    struct vm_tree_node *node = tree ? vm_lookup(tree, address) : NULL;
 
     if (!node)
     {
@@ -0,0 +1,720 @@
+/* boot benchmarks and self-tests of the memory code
+ *
+ * they only run in a tree built with BENCHMARKS=1. page_map_benchmark()
+ * runs from vm_init(), before there are threads, and everything else is
+ * started as a thread of its own once the page frame allocator is done.
+ * the few internals they need memory.c hands out through memory.h.
+ */
+
+#include "memory_benchmark.h"
+#include "page_color.h"
+#include "page_stack.h"
+#include "vm_lookup.h"
+
+#include "cpu.h"
+#include "memory.h"
+#include "panic.h"
+#include "pit8253.h"
+#include "task.h"
+#include "timer.h"
+#include "cpu/mmu.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <lib/kstdio.h>
+
+#define PAGE_MAP_BENCHMARK_PAGES 64
+
+// time page_map_at() through temporary windows against the direct map
+void page_map_benchmark(void)
+{
+    kc_phys_addr zero_page = vm_get_zero_page();
+    char *vaddr = vm_alloc(
+            PAGE_MAP_BENCHMARK_PAGES * page_size(1),
+            VM_ALLOC_TRANSLATE);
+    uint64_t cycles[2] = {0, 0};
+
+    if (!vaddr)
+    {
+        return;
+    }
+
+    // the first pass builds the tables so neither timed pass allocates
+    for (int pass = -1; pass < 2; pass++)
+    {
+        page_direct_map_enable(pass != 0);
+        uint64_t begin = cpu_timestamp();
+
+        for (int i = 0; i < PAGE_MAP_BENCHMARK_PAGES; i++)
+        {
+            page_map_at(
+                    vaddr + i * page_size(1),
+                    zero_page,
+                    CONTENT_RODATA|SIZE_4K);
+        }
+
+        if (pass >= 0)
+        {
+            cycles[pass] = cpu_timestamp() - begin;
+        }
+
+        // the tables stay, every mapping and its reference goes
+        for (int i = 0; i < PAGE_MAP_BENCHMARK_PAGES; i++)
+        {
+            page_unmap(vaddr + i * page_size(1));
+        }
+    }
+
+    page_direct_map_enable(true);
+    vm_free(vaddr);
+
+    kprintf("page_map_at: %lu cycles per page through temporary windows, "
+            "%lu through the direct map\n",
+            cycles[0] / PAGE_MAP_BENCHMARK_PAGES,
+            cycles[1] / PAGE_MAP_BENCHMARK_PAGES);
+}
+
+#define PAGE_REF_STRESS_THREADS 4
+#define PAGE_REF_STRESS_ROUNDS 1024
+
+static struct page_ref_stress_state
+{
+    kc_phys_addr frame;
+    char *vaddr;
+    atomic_uint started;
+    atomic_uint finished;
+}
+stress_state;
+
+// map and drop one shared frame from several threads at once, its count
+// has to come back to the single reference it started with
+static void page_ref_stress_thread(void)
+{
+    unsigned id = atomic_fetch_add(&stress_state.started, 1);
+    char *vaddr = stress_state.vaddr + id * page_size(1);
+    uint64_t begin = cpu_timestamp();
+
+    for (int i = 0; i < PAGE_REF_STRESS_ROUNDS; i++)
+    {
+        page_map_at(vaddr, stress_state.frame, CONTENT_RODATA|SIZE_4K);
+
+        if (!(i % 64))
+        {
+            task_yield();
+        }
+
+        page_unmap(vaddr);
+    }
+
+    kprintf("page reference stress thread %u: %lu cycles per map\n",
+            id,
+            (cpu_timestamp() - begin) / PAGE_REF_STRESS_ROUNDS);
+
+    if (atomic_fetch_add(&stress_state.finished, 1) + 1 ==
+            PAGE_REF_STRESS_THREADS)
+    {
+        int refs = page_stack_get_ref(stress_state.frame);
+
+        if (refs != 1)
+        {
+            kprintf("error: page reference stress left %d references\n",
+                    refs);
+            PANIC(GENERAL_PANIC);
+        }
+
+        page_free(stress_state.frame);
+        kprintf("page reference stress passed\n");
+    }
+
+    task_exit();
+}
+
+void page_ref_stress_init(void)
+{
+    stress_state.frame = page_alloc(PAGE_ALLOC_CONV);
+    stress_state.vaddr = vm_alloc(
+            PAGE_REF_STRESS_THREADS * page_size(1),
+            VM_ALLOC_TRANSLATE);
+
+    if (!stress_state.frame || !stress_state.vaddr)
+    {
+        kprintf("warning: skipping page reference stress\n");
+        return;
+    }
+
+    for (int i = 0; i < PAGE_REF_STRESS_THREADS; i++)
+    {
+        task_append_thread(page_ref_stress_thread);
+    }
+}
+
+#define PAGE_COLOR_BENCHMARK_PAGES 512
+#define PAGE_COLOR_BENCHMARK_PASSES 8
+
+static uint64_t color_benchmark_run(unsigned char *buffer, bool colored)
+{
+    // the global color mode stays as it is, other threads allocate too
+    for (size_t i = 0; i < PAGE_COLOR_BENCHMARK_PAGES; i++)
+    {
+        unsigned char *page = buffer + i * page_size(1);
+        kc_phys_addr paddr = page_alloc_color(PAGE_ALLOC_CONV, page, colored);
+
+        if (!paddr)
+        {
+            kprintf("error: failed allocating for the color benchmark\n");
+            PANIC(OUT_OF_MEMORY);
+        }
+
+        page_map_at(page, paddr, CONTENT_RWDATA|SIZE_4K);
+        mmu_invalidate(page);
+    }
+
+    // one pass to fault everything into the tlb and caches first
+    volatile unsigned char *lines = buffer;
+    uint64_t begin = 0;
+
+    for (int pass = -1; pass < PAGE_COLOR_BENCHMARK_PASSES; pass++)
+    {
+        if (!pass)
+        {
+            begin = cpu_timestamp();
+        }
+
+        for (size_t offset = 0;
+                offset < PAGE_COLOR_BENCHMARK_PAGES * page_size(1);
+                offset += 64)
+        {
+            lines[offset];
+        }
+    }
+
+    uint64_t cycles = cpu_timestamp() - begin;
+
+    for (size_t i = 0; i < PAGE_COLOR_BENCHMARK_PAGES; i++)
+    {
+        unsigned char *page = buffer + i * page_size(1);
+        kc_phys_addr paddr = virt_to_phys(page);
+
+        // the mapping's reference goes with it, the allocation's is left
+        page_map_at(page, vm_get_zero_page(), CONTENT_RODATA|SIZE_4K);
+        page_free(paddr);
+    }
+
+    return cycles / PAGE_COLOR_BENCHMARK_PASSES;
+}
+
+// walk a buffer larger than most mid level caches with and without
+// colored frames behind it
+void page_color_benchmark(void)
+{
+    unsigned char *buffer = vm_alloc(
+            PAGE_COLOR_BENCHMARK_PAGES * page_size(1),
+            VM_ALLOC_TRANSLATE);
+
+    if (buffer && (page_color_count() > 1))
+    {
+        uint64_t plain = color_benchmark_run(buffer, false);
+        uint64_t colored = color_benchmark_run(buffer, true);
+
+        kprintf("page color benchmark: %lu cycles per pass over %zuKiB "
+                "uncolored, %lu colored\n",
+                plain,
+                PAGE_COLOR_BENCHMARK_PAGES * page_size(1) >> 10,
+                colored);
+    }
+
+    if (buffer)
+    {
+        vm_free(buffer);
+    }
+
+    task_exit();
+}
+
+#define PAGE_RMAP_BENCHMARK_MAX 64
+
+// map one frame at more and more addresses and time taking them all away
+void page_rmap_benchmark(void)
+{
+    char *buffer = vm_alloc(
+            PAGE_RMAP_BENCHMARK_MAX * page_size(1),
+            VM_ALLOC_TRANSLATE);
+    kc_phys_addr frame = page_alloc(PAGE_ALLOC_CONV);
+    size_t count_max = PAGE_RMAP_BENCHMARK_MAX;
+
+    if (!buffer || !frame)
+    {
+        kprintf("warning: skipping reverse map benchmark\n");
+        count_max = 0;
+    }
+
+    for (size_t count = 1; count <= count_max; count *= 4)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            page_map_at(
+                    buffer + i * page_size(1),
+                    frame,
+                    CONTENT_RODATA|SIZE_4K);
+        }
+
+        uint64_t begin = cpu_timestamp();
+        size_t unmapped = page_unmap_all(frame);
+        uint64_t cycles = cpu_timestamp() - begin;
+
+        if ((unmapped != count) || (page_stack_get_ref(frame) != 1))
+        {
+            kprintf("error: unmapped %zu of %zu mappings, %d references "
+                    "left\n",
+                    unmapped,
+                    count,
+                    page_stack_get_ref(frame));
+            PANIC(GENERAL_PANIC);
+        }
+
+        kprintf("reverse map: unmapping %zu mappings took %lu cycles, "
+                "%lu each\n",
+                count,
+                cycles,
+                cycles / count);
+        task_yield();
+    }
+
+    if (frame)
+    {
+        page_free(frame);
+    }
+
+    if (buffer)
+    {
+        vm_free(buffer);
+    }
+
+    task_exit();
+}
+
+#define PAGE_HUGE_BENCHMARK_SIZE (4 * page_size(2))
+#define PAGE_HUGE_BENCHMARK_PASSES 8
+
+struct huge_benchmark_result
+{
+    size_t faults;
+    uint64_t touch;
+    uint64_t walk;
+};
+
+// the region has its own setting for large pages, the global one stays
+static void huge_benchmark_run(bool huge, struct huge_benchmark_result *result)
+{
+    struct vm_policy_object object;
+
+    vm_get_fault_policy(&object.policy);
+    object.policy.huge = huge;
+
+    char *buffer = vm_alloc_policy(PAGE_HUGE_BENCHMARK_SIZE, 0, &object);
+
+    if (!buffer)
+    {
+        *result = (struct huge_benchmark_result){0};
+        return;
+    }
+
+    // first touch, everything the fault handler does
+    uint64_t begin = cpu_timestamp();
+
+    for (size_t offset = 0;
+            offset < PAGE_HUGE_BENCHMARK_SIZE;
+            offset += page_size(1))
+    {
+        buffer[offset] = 1;
+    }
+
+    result->touch = cpu_timestamp() - begin;
+    result->faults = object.faults;
+
+    // one line per page, so the translations are what doesn't fit
+    volatile char *lines = buffer;
+    begin = cpu_timestamp();
+
+    for (int pass = 0; pass < PAGE_HUGE_BENCHMARK_PASSES; pass++)
+    {
+        for (size_t offset = 0;
+                offset < PAGE_HUGE_BENCHMARK_SIZE;
+                offset += page_size(1))
+        {
+            lines[offset + (pass & 63) * 64];
+        }
+    }
+
+    result->walk = (cpu_timestamp() - begin) / PAGE_HUGE_BENCHMARK_PASSES;
+
+    // releasing splits the huge pages again on the way out
+    vm_free(buffer);
+}
+
+// fault in and walk an anonymous range with and without 2MiB pages
+void page_huge_benchmark(void)
+{
+    struct huge_benchmark_result small;
+    struct huge_benchmark_result large;
+
+    huge_benchmark_run(false, &small);
+    huge_benchmark_run(true, &large);
+
+    if (small.faults && large.faults)
+    {
+        kprintf("huge page benchmark over %zuMiB: %zu faults in %lu cycles "
+                "and %lu cycles per walk with 4KiB pages, %zu faults in "
+                "%lu cycles and %lu cycles per walk with 2MiB pages\n",
+                PAGE_HUGE_BENCHMARK_SIZE >> 20,
+                small.faults,
+                small.touch,
+                small.walk,
+                large.faults,
+                large.touch,
+                large.walk);
+        vm_fault_report();
+        vm_lookup_report();
+    }
+
+    task_exit();
+}
+
+#define VM_FAULT_BENCHMARK_SIZE (4 * page_size(2))
+
+struct fault_benchmark_result
+{
+    size_t faults;
+    uint64_t nanoseconds;
+};
+
+static void fault_benchmark_run(
+        bool write,
+        bool write_first,
+        size_t around,
+        enum vm_alloc_flags flags,
+        struct fault_benchmark_result *result)
+{
+    // the region's own settings, 2MiB pages would take the faults away
+    // from what's measured here
+    struct vm_policy_object object = {.policy = {false, write_first, around}};
+
+    // populating up front is part of the cost for an immediate region
+    uint64_t begin = pit8253_timer_source.nanoseconds_elapsed();
+    volatile char *buffer = vm_alloc_policy(
+            VM_FAULT_BENCHMARK_SIZE,
+            flags,
+            &object);
+
+    for (size_t offset = 0;
+            buffer && (offset < VM_FAULT_BENCHMARK_SIZE);
+            offset += page_size(1))
+    {
+        if (write)
+        {
+            buffer[offset] = 1;
+        }
+        else
+        {
+            buffer[offset];
+        }
+    }
+
+    result->nanoseconds = pit8253_timer_source.nanoseconds_elapsed() - begin;
+    result->faults = object.faults;
+
+    if (buffer)
+    {
+        vm_free((void *)buffer);
+    }
+}
+
+static void fault_benchmark_report(
+        const char *name,
+        struct fault_benchmark_result *result)
+{
+    kprintf("fault benchmark, %s: %zu faults, %luns per MiB\n",
+            name,
+            result->faults,
+            result->nanoseconds / (VM_FAULT_BENCHMARK_SIZE >> 20));
+}
+
+// first touch of an anonymous range one page after the other, the way it
+// was, with each of write-first faults and fault-around, and populated
+void vm_fault_benchmark(void)
+{
+    struct fault_benchmark_result result;
+
+    fault_benchmark_run(true, false, 0, 0, &result);
+    fault_benchmark_report("writes through the zero page", &result);
+    fault_benchmark_run(true, true, 0, 0, &result);
+    fault_benchmark_report("writes", &result);
+    fault_benchmark_run(true, true, VM_FAULT_AROUND_PAGES, 0, &result);
+    fault_benchmark_report("writes with fault-around", &result);
+    fault_benchmark_run(false, true, 0, 0, &result);
+    fault_benchmark_report("reads", &result);
+    fault_benchmark_run(false, true, VM_FAULT_AROUND_PAGES, 0, &result);
+    fault_benchmark_report("reads with fault-around", &result);
+    fault_benchmark_run(true, true, 0, VM_ALLOC_IMMEDIATE, &result);
+    fault_benchmark_report("writes to a populated region", &result);
+
+    vm_fault_report();
+
+    task_exit();
+}
+
+#define PAGE_RANGE_BENCHMARK_SIZE (1ULL << 30)
+
+// map the first 1GiB of physical memory read-only page by page, then in a
+// single walk with small pages and with the largest ones that fit
+static void page_range_benchmark_run(char *vaddr)
+{
+    uint64_t map[3];
+    uint64_t unmap[3];
+
+    // the zero page stands in for the page by page mappings as it isn't
+    // counted or reverse mapped either
+    kc_phys_addr zero_page = vm_get_zero_page();
+    uint64_t begin = cpu_timestamp();
+
+    for (size_t offset = 0;
+            offset < PAGE_RANGE_BENCHMARK_SIZE;
+            offset += page_size(1))
+    {
+        page_map_at(vaddr + offset, zero_page, CONTENT_RODATA|SIZE_4K);
+    }
+
+    map[0] = cpu_timestamp() - begin;
+    begin = cpu_timestamp();
+
+    for (size_t offset = 0;
+            offset < PAGE_RANGE_BENCHMARK_SIZE;
+            offset += page_size(1))
+    {
+        page_unmap(vaddr + offset);
+    }
+
+    unmap[0] = cpu_timestamp() - begin;
+
+    // page_unmap() leaves the tables behind
+    page_unmap_range(vaddr, PAGE_RANGE_BENCHMARK_SIZE);
+
+    for (int run = 1; run < 3; run++)
+    {
+        begin = cpu_timestamp();
+        page_map_range(
+                vaddr,
+                0,
+                PAGE_RANGE_BENCHMARK_SIZE,
+                CONTENT_RODATA|(run == 1 ? SIZE_4K : 0));
+        map[run] = cpu_timestamp() - begin;
+
+        begin = cpu_timestamp();
+        page_unmap_range(vaddr, PAGE_RANGE_BENCHMARK_SIZE);
+        unmap[run] = cpu_timestamp() - begin;
+    }
+
+    kprintf("range mapping 1GiB: %lu cycles page by page, %lu in one walk, "
+            "%lu in %s pages\n",
+            map[0],
+            map[1],
+            map[2],
+            page_direct_map_huge() ? "1GiB" : "2MiB");
+    kprintf("range unmapping 1GiB: %lu cycles page by page, %lu in one "
+            "walk, %lu in large pages\n",
+            unmap[0],
+            unmap[1],
+            unmap[2]);
+}
+
+void page_range_benchmark(void)
+{
+    // the allocation range under the kernel image is too small for an
+    // aligned 1GiB, the scratch slot has room
+    char *vaddr = vm_alloc_at(
+            (void *)VM_SCRATCH_BASE,
+            PAGE_RANGE_BENCHMARK_SIZE,
+            VM_ALLOC_TRANSLATE);
+
+    if (vaddr)
+    {
+        page_range_benchmark_run(vaddr);
+        vm_free(vaddr);
+    }
+    else
+    {
+        kprintf("warning: skipping range mapping benchmark\n");
+    }
+
+    task_exit();
+}
+
+#define VM_CHURN_BENCHMARK_SLOTS 64
+#define VM_CHURN_BENCHMARK_OPS 16384
+#define VM_CHURN_BENCHMARK_PAGES 64
+
+// allocate and free regions of random sizes in random order, then see how
+// fast that went and how scattered the free space was left
+void vm_churn_benchmark(void)
+{
+    void *regions[VM_CHURN_BENCHMARK_SLOTS] = {NULL};
+    uint64_t seed = cpu_timestamp() | 1;
+    size_t failed = 0;
+
+    uint64_t begin = pit8253_timer_source.nanoseconds_elapsed();
+    uint64_t cycles = cpu_timestamp();
+
+    for (size_t i = 0; i < VM_CHURN_BENCHMARK_OPS; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        void **slot = &regions[seed % VM_CHURN_BENCHMARK_SLOTS];
+
+        if (*slot)
+        {
+            vm_free(*slot);
+            *slot = NULL;
+        }
+        else
+        {
+            size_t pages = 1 + (seed >> 32) % VM_CHURN_BENCHMARK_PAGES;
+
+            if (!(*slot = vm_alloc(pages * page_size(1), VM_ALLOC_ANONYMOUS)))
+            {
+                failed++;
+            }
+        }
+    }
+
+    cycles = cpu_timestamp() - cycles;
+    uint64_t elapsed = pit8253_timer_source.nanoseconds_elapsed() - begin;
+
+    struct vm_tree_gap_stats stats;
+    vm_get_gap_stats(&stats);
+
+    kprintf("vm churn benchmark: %u operations, %lu cycles each, %lu per "
+            "second, %zu failed\n",
+            VM_CHURN_BENCHMARK_OPS,
+            cycles / VM_CHURN_BENCHMARK_OPS,
+            elapsed ? VM_CHURN_BENCHMARK_OPS * TIMER_NANOSECOND / elapsed : 0,
+            failed);
+    kprintf("vm churn benchmark: %zuKiB free in %zu holes, the largest "
+            "%zuKiB, %zu%% fragmented\n",
+            stats.free >> 10,
+            stats.holes,
+            stats.largest >> 10,
+            stats.free ? 100 - stats.largest * 100 / stats.free : 0);
+
+    for (size_t i = 0; i < VM_CHURN_BENCHMARK_SLOTS; i++)
+    {
+        if (regions[i])
+        {
+            vm_free(regions[i]);
+        }
+    }
+
+    task_exit();
+}
+
+#define VM_TREE_BENCHMARK_BASE 0x100000000ULL
+// coprime to every region count, for visiting them in a scattered order
+#define VM_TREE_BENCHMARK_INSERT_STRIDE 7919
+#define VM_TREE_BENCHMARK_DELETE_STRIDE 104729
+
+static const size_t vm_tree_benchmark_counts[] = {100, 10000, 1000000};
+
+// time the region index on a tree of its own, one page regions with a
+// page between each
+void vm_tree_benchmark(void)
+{
+    uint64_t seed = cpu_timestamp() | 1;
+
+    for (size_t c = 0;
+            c < sizeof(vm_tree_benchmark_counts) / sizeof(size_t);
+            c++)
+    {
+        size_t count = vm_tree_benchmark_counts[c];
+        size_t size = count * sizeof(struct vm_tree_node);
+        struct kcc_memory_stats memory;
+        struct vm_tree_node *nodes = NULL;
+
+        page_get_stats(&memory);
+
+        // the index needs some memory of its own on top of the nodes
+        if (memory.free_pages > 2 * page_count(size, 1))
+        {
+            nodes = vm_alloc(size, VM_ALLOC_ANONYMOUS);
+        }
+
+        if (!nodes)
+        {
+            kprintf("warning: skipping vm tree benchmark of %zu regions\n",
+                    count);
+            continue;
+        }
+
+        struct vm_tree tree = {0};
+        uint64_t insert = cpu_timestamp();
+
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t n = i * VM_TREE_BENCHMARK_INSERT_STRIDE % count;
+            char *base = (char *)VM_TREE_BENCHMARK_BASE + 2 * n * page_size(1);
+
+            vmt_init_node(&tree, &nodes[n], NULL, base, base + page_size(1));
+        }
+
+        insert = cpu_timestamp() - insert;
+        uint64_t lookup = cpu_timestamp();
+
+        for (size_t i = 0; i < count; i++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+
+            size_t n = seed % count;
+            struct vm_tree_key key = {
+                VM_TREE_BENCHMARK_BASE + 2 * n * page_size(1) +
+                    (seed >> 52),
+                1
+            };
+
+            if (vmt_search_key(&tree, &key) != &nodes[n])
+            {
+                kprintf("error: vm tree lookup of %#lx missed\n",
+                        key.address);
+                PANIC(GENERAL_PANIC);
+            }
+        }
+
+        lookup = cpu_timestamp() - lookup;
+        uint64_t delete = cpu_timestamp();
+
+        for (size_t i = 0; i < count; i++)
+        {
+            vmt_delete(
+                    &tree,
+                    &nodes[i * VM_TREE_BENCHMARK_DELETE_STRIDE % count]);
+        }
+
+        delete = cpu_timestamp() - delete;
+
+        kprintf("vm tree benchmark, %s of %zu regions: %lu cycles per "
+                "insert, %lu per lookup, %lu per delete\n",
+                vmt_get_index_name(),
+                count,
+                insert / count,
+                lookup / count,
+                delete / count);
+
+        vm_free(nodes);
+        task_yield();
+    }
+
+    task_exit();
+}
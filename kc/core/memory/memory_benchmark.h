@@ -0,0 +1,11 @@
+#pragma once
+
+void page_map_benchmark(void);
+void page_ref_stress_init(void);
+void page_color_benchmark(void);
+void page_rmap_benchmark(void);
+void page_huge_benchmark(void);
+void vm_churn_benchmark(void);
+void vm_tree_benchmark(void);
+void vm_fault_benchmark(void);
+void page_range_benchmark(void);
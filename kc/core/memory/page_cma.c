@@ -0,0 +1,256 @@
+/* contiguous memory area
+ *
+ * a physically contiguous stretch of conventional memory is set aside at
+ * boot for buffers that devices need in one piece. while nobody needs it
+ * for that it backs movable allocations, anonymous pages that the reverse
+ * map can find every mapping of. a contiguous allocation migrates
+ * whatever is lent out of its window first.
+ *
+ * idle frames keep the allocated bit with no references, like frames in
+ * a magazine, so they can never end up on the page stacks.
+ */
+
+#include "page_cma.h"
+#include "page_stack.h"
+
+#include "cpu/irq.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_CMA_SIZE (16ULL << 20)
+#define PAGE_CMA_ALIGN (2ULL << 20)
+#define PAGE_CMA_LIMIT (1ULL << 32)
+#define PAGE_CMA_PAGES ((PAGE_CMA_SIZE + PAGE_CMA_ALIGN) / page_size(1))
+
+enum page_cma_use
+{
+    PAGE_CMA_IDLE,
+    PAGE_CMA_LENT,
+    PAGE_CMA_DMA
+};
+
+static struct page_cma_state
+{
+    kc_phys_addr base;
+    size_t count;
+    size_t cursor;
+    uint8_t uses[PAGE_CMA_PAGES];
+    struct page_cma_stats stats;
+}
+cma_state;
+
+void page_cma_reserve(struct memory_range *first, struct memory_range *last)
+{
+    // take the area off the top of the highest range that fits below 4GiB
+    for (struct memory_range *current = last; current-- > first;)
+    {
+        kc_phys_addr limit = current->base + current->size;
+
+        if ((current->type != AVAILABLE_MEMORY) ||
+                (limit > PAGE_CMA_LIMIT) ||
+                (current->size < PAGE_CMA_SIZE + PAGE_CMA_ALIGN))
+        {
+            continue;
+        }
+
+        kc_phys_addr base = (limit - PAGE_CMA_SIZE) & ~(PAGE_CMA_ALIGN - 1);
+
+        current->size = base - current->base;
+        page_stack_add_range(base, limit - base, SYSTEM_MEMORY);
+
+        cma_state.base = base;
+        cma_state.count = (limit - base) / page_size(1);
+        cma_state.stats.total_pages = cma_state.count;
+
+        // added as taken, drop the reference to make every frame idle
+        for (size_t i = 0; i < cma_state.count; i++)
+        {
+            page_stack_dec_ref(base + i * page_size(1));
+        }
+
+        kprintf("contiguous memory area at %#lx, %zuKiB\n",
+                base,
+                (limit - base) >> 10);
+        return;
+    }
+
+    kprintf("warning: no room for a contiguous memory area\n");
+}
+
+int page_cma_contains(kc_phys_addr page)
+{
+    return (page >= cma_state.base) &&
+        (page < cma_state.base + cma_state.count * page_size(1));
+}
+
+kc_phys_addr page_cma_alloc_movable(void)
+{
+    kc_phys_addr page = 0;
+    uint64_t flags = irq_lock();
+
+    for (size_t n = 0; n < cma_state.count; n++)
+    {
+        size_t i = (cma_state.cursor + n) % cma_state.count;
+
+        if (cma_state.uses[i] == PAGE_CMA_IDLE)
+        {
+            cma_state.uses[i] = PAGE_CMA_LENT;
+            cma_state.stats.lent_pages++;
+            cma_state.cursor = i + 1;
+
+            page = cma_state.base + i * page_size(1);
+            page_stack_set_allocated(page);
+            break;
+        }
+    }
+
+    irq_unlock(flags);
+
+    return page;
+}
+
+void page_cma_free(kc_phys_addr page)
+{
+    if (!page_cma_contains(page) || page_stack_dec_ref(page) != 0)
+    {
+        return;
+    }
+
+    uint64_t flags = irq_lock();
+    size_t i = (page - cma_state.base) / page_size(1);
+
+    // frames of a contiguous buffer go idle with page_cma_release
+    if (cma_state.uses[i] == PAGE_CMA_LENT)
+    {
+        cma_state.uses[i] = PAGE_CMA_IDLE;
+        cma_state.stats.lent_pages--;
+    }
+
+    irq_unlock(flags);
+}
+
+// the first window below max_phys that no other contiguous buffer uses
+static size_t cma_window(size_t count, kc_phys_addr max_phys, size_t start)
+{
+    for (size_t first = start; first + count <= cma_state.count; first++)
+    {
+        if (cma_state.base + (first + count) * page_size(1) > max_phys)
+        {
+            break;
+        }
+
+        size_t i = first;
+
+        while ((i < first + count) && (cma_state.uses[i] != PAGE_CMA_DMA))
+        {
+            i++;
+        }
+
+        if (i == first + count)
+        {
+            return first;
+        }
+
+        first = i;
+    }
+
+    return cma_state.count;
+}
+
+kc_phys_addr page_cma_alloc(size_t count, kc_phys_addr max_phys)
+{
+    if (!count || (count > cma_state.count))
+    {
+        return 0;
+    }
+
+    uint64_t flags = irq_lock();
+
+    for (size_t first = cma_window(count, max_phys, 0);
+            first < cma_state.count;
+            first = cma_window(count, max_phys, first + 1))
+    {
+        size_t i = first;
+
+        // move what was lent out of the window, pages that can't move
+        // (pinned or mapped outside anonymous memory) rule it out
+        for (; i < first + count; i++)
+        {
+            kc_phys_addr page = cma_state.base + i * page_size(1);
+
+            if (cma_state.uses[i] == PAGE_CMA_LENT)
+            {
+                if (!page_migrate(page, page_get_movable(page)))
+                {
+                    break;
+                }
+
+                cma_state.stats.migrated++;
+            }
+
+            // freeing the old frame should have made it idle
+            if (cma_state.uses[i] != PAGE_CMA_IDLE)
+            {
+                break;
+            }
+        }
+
+        if (i < first + count)
+        {
+            continue;
+        }
+
+        for (i = first; i < first + count; i++)
+        {
+            cma_state.uses[i] = PAGE_CMA_DMA;
+            page_stack_set_allocated(cma_state.base + i * page_size(1));
+        }
+
+        cma_state.stats.dma_pages += count;
+        irq_unlock(flags);
+
+        return cma_state.base + first * page_size(1);
+    }
+
+    irq_unlock(flags);
+
+    return 0;
+}
+
+void page_cma_release(kc_phys_addr base, size_t count)
+{
+    if (!page_cma_contains(base) ||
+            !page_cma_contains(base + (count - 1) * page_size(1)))
+    {
+        return;
+    }
+
+    uint64_t flags = irq_lock();
+
+    for (size_t i = (base - cma_state.base) / page_size(1); count--; i++)
+    {
+        if (cma_state.uses[i] == PAGE_CMA_DMA)
+        {
+            page_stack_dec_ref(cma_state.base + i * page_size(1));
+            cma_state.uses[i] = PAGE_CMA_IDLE;
+            cma_state.stats.dma_pages--;
+        }
+    }
+
+    irq_unlock(flags);
+}
+
+void page_cma_get_stats(struct page_cma_stats *stats)
+{
+    *stats = cma_state.stats;
+}
+
+void page_cma_report(void)
+{
+    kprintf("contiguous memory area: %zu pages, %zu lent, %zu dma, "
+            "%lu migrated\n",
+            cma_state.stats.total_pages,
+            cma_state.stats.lent_pages,
+            cma_state.stats.dma_pages,
+            cma_state.stats.migrated);
+}
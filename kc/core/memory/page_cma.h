@@ -0,0 +1,23 @@
+#pragma once
+
+#include "memory.h"
+
+struct page_cma_stats
+{
+    size_t total_pages;
+    size_t lent_pages;
+    size_t dma_pages;
+    uint64_t migrated;
+};
+
+void page_cma_reserve(struct memory_range *first, struct memory_range *last);
+
+int page_cma_contains(kc_phys_addr page);
+kc_phys_addr page_cma_alloc_movable(void);
+void page_cma_free(kc_phys_addr page);
+
+kc_phys_addr page_cma_alloc(size_t count, kc_phys_addr max_phys);
+void page_cma_release(kc_phys_addr base, size_t count);
+
+void page_cma_get_stats(struct page_cma_stats *stats);
+void page_cma_report(void);
@@ -0,0 +1,122 @@
+/* page colors
+ *
+ * a frame's color is the group of last level cache sets it maps to, the
+ * cache's way size divided by the page size tells how many there are.
+ * with coloring on, the page for a virtual address is taken from the
+ * color of its virtual page number, so consecutive pages of a buffer
+ * rotate through the colors instead of landing in the same sets.
+ */
+
+#include "page_color.h"
+
+#include "cpu.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_COLOR_MAX 256
+
+#define CPUID_CACHE_LEAF 4
+#define CPUID_AMD_CACHE_LEAF 0x8000001d
+
+static struct page_color_state
+{
+    unsigned count;
+    bool enabled;
+}
+color_state = {1, false};
+
+// the way size of the highest level cache a cache properties leaf lists
+static size_t cache_way_size(uint32_t leaf)
+{
+    size_t way_size = 0;
+    unsigned level = 0;
+
+    for (uint32_t subleaf = 0; subleaf < 16; subleaf++)
+    {
+        uint32_t registers[4];
+        cpu_cpuid(leaf, subleaf, registers);
+
+        // type 0 ends the list, 2 is an instruction cache
+        unsigned type = registers[0] & 0x1f;
+        unsigned current = (registers[0] >> 5) & 0x7;
+
+        if (!type)
+        {
+            break;
+        }
+
+        if ((type == 2) || (current < level))
+        {
+            continue;
+        }
+
+        size_t line = (registers[1] & 0xfff) + 1;
+        size_t partitions = ((registers[1] >> 12) & 0x3ff) + 1;
+        size_t sets = (size_t)registers[2] + 1;
+
+        level = current;
+        way_size = line * partitions * sets;
+    }
+
+    return way_size;
+}
+
+void page_color_init(void)
+{
+    uint32_t registers[4];
+    size_t way_size = 0;
+
+    cpu_cpuid(0, 0, registers);
+
+    if (registers[0] >= CPUID_CACHE_LEAF)
+    {
+        way_size = cache_way_size(CPUID_CACHE_LEAF);
+    }
+
+    cpu_cpuid(0x80000000, 0, registers);
+
+    if (!way_size && (registers[0] >= CPUID_AMD_CACHE_LEAF))
+    {
+        way_size = cache_way_size(CPUID_AMD_CACHE_LEAF);
+    }
+
+    color_state.count = way_size / page_size(1);
+
+    if (!color_state.count)
+    {
+        color_state.count = 1;
+    }
+    else if (color_state.count > PAGE_COLOR_MAX)
+    {
+        color_state.count = PAGE_COLOR_MAX;
+    }
+
+    kprintf("page colors: %u from a %zuKiB cache way\n",
+            color_state.count,
+            way_size >> 10);
+}
+
+unsigned page_color_count(void)
+{
+    return color_state.count;
+}
+
+unsigned page_color_of(kc_phys_addr page)
+{
+    return (page / page_size(1)) % color_state.count;
+}
+
+unsigned page_color_for(void *vaddr)
+{
+    return ((uintptr_t)vaddr / page_size(1)) % color_state.count;
+}
+
+bool page_color_enabled(void)
+{
+    return color_state.enabled && (color_state.count > 1);
+}
+
+void page_color_enable(bool enable)
+{
+    color_state.enabled = enable;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+
+void page_color_init(void);
+
+unsigned page_color_count(void);
+unsigned page_color_of(kc_phys_addr page);
+unsigned page_color_for(void *vaddr);
+
+bool page_color_enabled(void);
+void page_color_enable(bool enable);
@@ -0,0 +1,316 @@
+/* memory compaction
+ *
+ * a block that can't be allocated even though enough memory is free is
+ * put together by moving anonymous pages out of the way. compaction
+ * scans a window of a zone's aligned blocks, the next window each time,
+ * for the one that needs the fewest pages moved and has nothing in it
+ * that can't move. it takes the free parts
+ * of that block off the lists first, so the copies land somewhere else.
+ * then it migrates the rest and gives the whole block back.
+ *
+ * it runs when a block allocation fails, and from a thread that keeps
+ * the conventional zone from fragmenting while the system is idle.
+ */
+
+#include "page_compact.h"
+#include "page_magazine.h"
+#include "page_stack.h"
+
+#include "task.h"
+#include "timer.h"
+
+#include <lib/kstdio.h>
+
+#include <stdatomic.h>
+
+#define PAGE_COMPACT_INTERVAL (TIMER_NANOSECOND * 5)
+#define PAGE_COMPACT_THRESHOLD 500
+#define PAGE_COMPACT_SCAN_BLOCKS 256
+
+static struct page_compact_state
+{
+    kc_phys_addr blocks[1UL << PAGE_COMPACT_ORDER_MAX];
+    // where the next scan of each zone picks up
+    kc_phys_addr cursor[PAGE_ALLOC_HIGH + 1];
+    atomic_bool compacting;
+    uint64_t compactions;
+    uint64_t migrated;
+    uint64_t failed;
+    uint64_t reported;
+}
+compact_state;
+
+static void page_compact_thread(void);
+
+void page_compact_init(void)
+{
+    task_append_thread(page_compact_thread);
+}
+
+/* the fragmentation index of an order
+ *
+ * -1 when a block of the order is free. otherwise, in thousandths, how
+ * much of the failure is down to fragmentation: towards 0 there isn't
+ * enough memory, towards 1000 there is but only in smaller pieces.
+ */
+int page_compact_index(enum page_alloc_flags zone, unsigned order)
+{
+    size_t counts[PAGE_ORDER_MAX + 1];
+    size_t blocks = 0;
+    size_t pages = 0;
+
+    page_stack_get_free_blocks(zone, counts);
+
+    for (unsigned current = 0; current <= PAGE_ORDER_MAX; current++)
+    {
+        if (counts[current] && (current >= order))
+        {
+            return -1;
+        }
+
+        blocks += counts[current];
+        pages += counts[current] << current;
+    }
+
+    if (!blocks)
+    {
+        return 0;
+    }
+
+    return 1000 - (1000 + pages * 1000 / (1UL << order)) / blocks;
+}
+
+void page_compact_report(enum page_alloc_flags zone, const char *when)
+{
+    kprintf("zone %d fragmentation %s:", zone, when);
+
+    for (unsigned order = 0; order <= PAGE_COMPACT_ORDER_MAX; order++)
+    {
+        kprintf(" %d", page_compact_index(zone, order));
+    }
+
+    kprintf("\n");
+}
+
+// how many pages of a block have to move, or -1 if it can't be freed up
+// by moving fewer than limit
+static long block_cost(kc_phys_addr base, unsigned order, long limit)
+{
+    long cost = 0;
+
+    for (size_t i = 0; (i < (1UL << order)) && (cost < limit); i++)
+    {
+        kc_phys_addr page = base + i * page_size(1);
+
+        if (!page_stack_get_present(page))
+        {
+            return -1;
+        }
+
+        if (page_stack_get_ref(page) < 0)
+        {
+            continue;
+        }
+
+        if (!page_get_movable(page))
+        {
+            return -1;
+        }
+
+        cost++;
+    }
+
+    return cost < limit ? cost : -1;
+}
+
+static bool compact_zone(unsigned order, enum page_alloc_flags zone)
+{
+    kc_phys_addr block_size = page_size(1) << order;
+    kc_phys_addr first = zone == PAGE_ALLOC_LOW ? block_size : 0x100000;
+    kc_phys_addr last = zone == PAGE_ALLOC_HIGH ?
+        page_stack_get_end() : 1ULL << 32;
+    kc_phys_addr best = 0;
+    long best_cost = -1;
+
+    if (zone == PAGE_ALLOC_LOW)
+    {
+        last = 0x100000;
+    }
+    else if (zone == PAGE_ALLOC_HIGH)
+    {
+        first = 1ULL << 32;
+    }
+
+    if (last > page_stack_get_end())
+    {
+        last = page_stack_get_end();
+    }
+
+    first = (first + block_size - 1) & ~(block_size - 1);
+
+    if (first + block_size > last)
+    {
+        return false;
+    }
+
+    // cached frames look allocated and would rule their block out
+    page_magazine_shrink(zone, PAGE_WATERMARK_MIN);
+
+    // look at a bounded number of blocks per call, carrying on where the
+    // last call stopped, instead of the whole zone every time
+    kc_phys_addr base = compact_state.cursor[zone] & ~(block_size - 1);
+    size_t blocks = (last - first) / block_size;
+
+    if (blocks > PAGE_COMPACT_SCAN_BLOCKS)
+    {
+        blocks = PAGE_COMPACT_SCAN_BLOCKS;
+    }
+
+    for (size_t scanned = 0; scanned < blocks; scanned++)
+    {
+        if ((base < first) || (base + block_size > last))
+        {
+            base = first;
+        }
+
+        long cost = block_cost(
+                base,
+                order,
+                best_cost < 0 ? (1L << order) + 1 : best_cost);
+
+        if (cost > 0)
+        {
+            best = base;
+            best_cost = cost;
+        }
+
+        base += block_size;
+    }
+
+    compact_state.cursor[zone] = base;
+
+    if (best_cost < 0)
+    {
+        return false;
+    }
+
+    size_t count = page_stack_isolate(best, order, compact_state.blocks);
+    bool moved = true;
+
+    for (size_t i = 0; i < (1UL << order); i++)
+    {
+        kc_phys_addr page = best + i * page_size(1);
+        void *owner = page_get_movable(page);
+
+        if (owner && !page_migrate(page, owner))
+        {
+            moved = false;
+            break;
+        }
+
+        compact_state.migrated += owner != NULL;
+    }
+
+    // with everything else gone the isolated pieces merge back into one
+    for (size_t i = 0; i < count; i++)
+    {
+        page_stack_free(compact_state.blocks[i]);
+    }
+
+    page_stack_notify();
+
+    return moved;
+}
+
+// on demand compactions report as they go, the thread's only count
+static bool compact(unsigned order, enum page_alloc_flags type, bool verbose)
+{
+    bool compacted = false;
+
+    if (!order || (order > PAGE_COMPACT_ORDER_MAX))
+    {
+        return false;
+    }
+
+    // migrating allocates, which mustn't end up compacting again, and only
+    // one thread compacts at a time
+    if (atomic_exchange(&compact_state.compacting, true))
+    {
+        return false;
+    }
+
+    for (enum page_alloc_flags zone = PAGE_ALLOC_HIGH;
+            !compacted && (zone >= PAGE_ALLOC_LOW);
+            zone--)
+    {
+        if ((type != PAGE_ALLOC_ANY) && (type != zone))
+        {
+            continue;
+        }
+
+        if (verbose)
+        {
+            page_compact_report(zone, "before");
+        }
+
+        compacted = compact_zone(order, zone);
+
+        if (verbose)
+        {
+            page_compact_report(zone, "after");
+        }
+    }
+
+    if (compacted)
+    {
+        compact_state.compactions++;
+    }
+    else
+    {
+        compact_state.failed++;
+    }
+
+    if (verbose)
+    {
+        kprintf("compaction for order %u %s, %lu pages migrated in total\n",
+                order,
+                compacted ? "succeeded" : "failed",
+                compact_state.migrated);
+    }
+
+    atomic_store(&compact_state.compacting, false);
+
+    return compacted;
+}
+
+bool page_compact(unsigned order, enum page_alloc_flags type)
+{
+    return compact(order, type, true);
+}
+
+static void page_compact_thread(void)
+{
+    while (true)
+    {
+        task_sleep(PAGE_COMPACT_INTERVAL);
+
+        // only bother when there is memory, just not in large enough pieces
+        if (page_compact_index(PAGE_ALLOC_CONV, PAGE_COMPACT_ORDER_MAX) >
+                PAGE_COMPACT_THRESHOLD)
+        {
+            compact(PAGE_COMPACT_ORDER_MAX, PAGE_ALLOC_CONV, false);
+        }
+
+        // a line per block put together, failed attempts only count
+        if (compact_state.reported != compact_state.compactions)
+        {
+            compact_state.reported = compact_state.compactions;
+            page_compact_report(PAGE_ALLOC_CONV, "now");
+            kprintf("compaction: %lu blocks put together, %lu attempts "
+                    "failed, %lu pages migrated\n",
+                    compact_state.compactions,
+                    compact_state.failed,
+                    compact_state.migrated);
+        }
+    }
+}
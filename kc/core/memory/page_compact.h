@@ -0,0 +1,14 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+
+// the largest block compaction will try to put together, 2MiB
+#define PAGE_COMPACT_ORDER_MAX 9
+
+void page_compact_init(void);
+
+bool page_compact(unsigned order, enum page_alloc_flags type);
+int page_compact_index(enum page_alloc_flags zone, unsigned order);
+void page_compact_report(enum page_alloc_flags zone, const char *when);
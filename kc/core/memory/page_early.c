@@ -1,8 +1,23 @@
 #include "page_early.h"
+#include "page_cma.h"
+#include "page_stack.h"
 #include "panic.h"
+#include "task.h"
+#include "cpu.h"
+#include "cpu/irq.h"
 
 #include <lib/kstdio.h>
 
+#include <stdbool.h>
+
+// how much available memory is handed to the page stacks before the
+// scheduler starts, the rest is added by a thread afterward
+#define PAGE_EARLY_BOOT_SIZE (64ULL << 20)
+#define PAGE_EARLY_CHUNK_SIZE (16ULL << 20)
+
+// pages the reclaim passes look at between letting interrupts in
+#define PAGE_RECLAIM_BATCH 256
+
 static struct page_early_state
 {
     struct memory_range *first;
@@ -11,6 +26,23 @@ static struct page_early_state
 }
 early_state;
 
+static struct page_deferred_state
+{
+    struct memory_range *first;
+    struct memory_range *last;
+}
+deferred_state;
+
+static struct page_reclaim_state
+{
+    struct memory_range *first;
+    struct memory_range *last;
+}
+reclaim_state;
+
+static void page_deferred_thread(void);
+static void page_reclaim_thread(void);
+
 void page_early_init(void)
 {
     kprintf("initializing early page frame allocator\n");
@@ -33,49 +65,246 @@ void page_early_init(void)
 	*/
 }
 
+// hand up to limit bytes from the bottom of a range to the page stacks
+static size_t early_add(struct memory_range *range, size_t limit)
+{
+    size_t size = range->size < limit ? range->size : limit;
+
+    // descriptors may need memory of their own, and the early allocator
+    // takes it from the top of the range, so only size it up afterward
+    page_stack_prepare_range(range->base, size);
+
+    size = range->size < size ? range->size : size;
+    size = page_stack_add_range(range->base, size, range->type);
+
+    range->base += size;
+    range->size -= size;
+
+    return size;
+}
+
 void page_early_final(void)
 {
     if (early_state.first)
     {
         kprintf("finalizing early page allocator\n");
-        for (struct memory_range *current = early_state.first; 
+        uint64_t begin = cpu_timestamp();
+        size_t budget = PAGE_EARLY_BOOT_SIZE;
+        size_t deferred = 0;
+
+        page_cma_reserve(early_state.first, early_state.last);
+
+        for (struct memory_range *current = early_state.first;
                 current < early_state.last;
                 current++)
         {
-            while (current->type != RESERVED_MEMORY && current->size >= page_size(1))
+            switch (current->type)
             {
-                current->size -= page_size(1);
-
-                enum memory_range_type type = current->type;
-                kc_phys_addr page = current->base + current->size;
-                // all pages are gonna be set allocated first
-                // to initialize the tracking structure at the other side
-                // and make setting the page free as simple as 
-                // calling page_free();
-                page_set_allocated(page);
-
-                switch (type)
-                {
-                    case SYSTEM_MEMORY:
-                        page_set_present(page);
-                        break;
-                    case AVAILABLE_MEMORY:
-                        page_set_present(page);
-                        page_free(page);
-                        break;
-                    case FIRMWARE_MEMORY:
-                    case MMIO_MEMORY:
-                        break;
-                    default:
-                        break;
-                }
+                case SYSTEM_MEMORY:
+                    // leave the range as it is for the reclaim pass
+                    page_stack_add_range(
+                            current->base,
+                            current->size,
+                            current->type);
+                    break;
+                case AVAILABLE_MEMORY:
+                    budget -= early_add(current, budget);
+                    deferred += current->size;
+                    break;
+                case FIRMWARE_MEMORY:
+                case MMIO_MEMORY:
+                    break;
+                default:
+                    break;
             }
         }
 
+        kprintf("page frame allocator ready in %lu cycles, %zuMiB deferred\n",
+                cpu_timestamp() - begin,
+                deferred >> 20);
+
+        if (deferred)
+        {
+            deferred_state.first = early_state.first;
+            deferred_state.last = early_state.last;
+            task_append_thread(page_deferred_thread);
+        }
+        else
+        {
+            page_stack_report();
+        }
+
+        reclaim_state.first = early_state.first;
+        reclaim_state.last = early_state.last;
+        task_append_thread(page_reclaim_thread);
+
         early_state = (struct page_early_state){NULL, NULL, NULL};
     }
 }
 
+static void page_deferred_thread(void)
+{
+    uint64_t begin = cpu_timestamp();
+    size_t total = 0;
+
+    for (struct memory_range *current = deferred_state.first;
+            current < deferred_state.last;
+            current++)
+    {
+        while ((current->type == AVAILABLE_MEMORY) &&
+                (current->size >= page_size(1)))
+        {
+            uint64_t flags = irq_lock();
+            size_t size = early_add(current, PAGE_EARLY_CHUNK_SIZE);
+            irq_unlock(flags);
+
+            if (!size)
+            {
+                break;
+            }
+
+            total += size;
+            task_yield();
+        }
+    }
+
+    kprintf("deferred page frame initialization added %zuMiB in %lu cycles\n",
+            total >> 20,
+            cpu_timestamp() - begin);
+    page_stack_report();
+
+    deferred_state = (struct page_deferred_state){NULL, NULL};
+    task_exit();
+}
+
+static bool reclaim_candidate(kc_phys_addr paddr)
+{
+    for (struct memory_range *current = reclaim_state.first;
+            current < reclaim_state.last;
+            current++)
+    {
+        if ((current->type == SYSTEM_MEMORY) &&
+                (paddr >= current->base) &&
+                (paddr - current->base < current->size))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void reclaim_mark(kc_phys_addr paddr)
+{
+    // a page without references can't take one, so set it back to one
+    if (reclaim_candidate(paddr) && !page_stack_get_ref(paddr))
+    {
+        page_stack_set_allocated(paddr);
+    }
+}
+
+/* return loader memory that nothing uses anymore
+ *
+ * everything the loader allocated is system memory: the shim and kernel
+ * images, the firmware memory map copy, page tables and the boot data
+ * buffer. once the kernel runs on its own threads the only parts of it
+ * still in use are reachable from the kernel half of the page tables,
+ * so every system page drops its reference, the walk gives one back to
+ * each page that is a table or mapped, and the rest goes to the stacks.
+ */
+static void page_reclaim_thread(void)
+{
+    uint64_t begin = cpu_timestamp();
+    size_t system = 0;
+    size_t reclaimed = 0;
+    size_t scanned = 0;
+    uint64_t flags = irq_lock();
+
+    for (struct memory_range *current = reclaim_state.first;
+            current < reclaim_state.last;
+            current++)
+    {
+        if (current->type != SYSTEM_MEMORY)
+        {
+            continue;
+        }
+
+        for (size_t offset = 0; offset < current->size; offset += page_size(1))
+        {
+            // let interrupts in between batches, nothing but this thread
+            // touches the loader's pages until the walk
+            if (!(++scanned % PAGE_RECLAIM_BATCH))
+            {
+                irq_unlock(flags);
+                flags = irq_lock();
+            }
+
+            if (page_stack_get_ref(current->base + offset) == 1)
+            {
+                page_stack_dec_ref(current->base + offset);
+            }
+        }
+    }
+
+    irq_unlock(flags);
+
+    // the walk sees the tables as a whole, so it runs in one go
+    flags = irq_lock();
+    page_walk_kernel(reclaim_mark);
+    irq_unlock(flags);
+
+    flags = irq_lock();
+
+    for (struct memory_range *current = reclaim_state.first;
+            current < reclaim_state.last;
+            current++)
+    {
+        if (current->type != SYSTEM_MEMORY)
+        {
+            continue;
+        }
+
+        for (size_t offset = 0; offset < current->size; offset += page_size(1))
+        {
+            kc_phys_addr paddr = current->base + offset;
+
+            // a page left without references can't take one anymore, so
+            // it stays reclaimable across the unlocked gaps
+            if (!(++scanned % PAGE_RECLAIM_BATCH))
+            {
+                irq_unlock(flags);
+                flags = irq_lock();
+            }
+
+            if (!page_stack_get_present(paddr))
+            {
+                continue;
+            }
+
+            system++;
+
+            if (!page_stack_get_ref(paddr))
+            {
+                page_stack_release(paddr);
+                reclaimed++;
+            }
+        }
+    }
+
+    irq_unlock(flags);
+    page_stack_notify();
+
+    kprintf("boot memory reclaim freed %zu of %zu system pages "
+            "(%zuKiB) in %lu cycles\n",
+            reclaimed,
+            system,
+            reclaimed * page_size(1) >> 10,
+            cpu_timestamp() - begin);
+
+    reclaim_state = (struct page_reclaim_state){NULL, NULL};
+    task_exit();
+}
+
 kc_phys_addr page_early_alloc(enum page_alloc_flags type)
 {
     // TODO: support low/conv/high allocations in early_alloc.
@@ -104,4 +333,3 @@ kc_phys_addr page_early_alloc(enum page_alloc_flags type)
     kprintf("error: early allocator has run out of memory\n");
     PANIC(OUT_OF_MEMORY);
 }
-
@@ -0,0 +1,222 @@
+/* per-cpu page frame magazines
+ *
+ * each cpu keeps a small array of free frames per zone in front of the
+ * global page stacks. allocations and frees only touch the cpu's own
+ * magazine until it runs empty or full, at which point a batch of frames
+ * is moved to or from the page stacks at once.
+ *
+ * frames sitting in a magazine stay allocated as far as the page stacks
+ * are concerned, with no references.
+ */
+
+#include "page_magazine.h"
+#include "page_stack.h"
+
+#include "cpu.h"
+#include "cpu/irq.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_MAGAZINE_ZONES 3
+#define PAGE_MAGAZINE_SIZE 64
+#define PAGE_MAGAZINE_BATCH (PAGE_MAGAZINE_SIZE / 2)
+
+struct page_magazine
+{
+    unsigned count;
+    kc_phys_addr pages[PAGE_MAGAZINE_SIZE];
+};
+
+static struct page_magazine_cpu
+{
+    struct page_magazine zones[PAGE_MAGAZINE_ZONES];
+    struct page_magazine_stats stats;
+}
+__attribute__((aligned(64)))
+magazine_state[CPU_COUNT_MAX];
+
+static unsigned magazine_refill(
+        struct page_magazine *magazine,
+        enum page_alloc_flags type)
+{
+    size_t count = page_stack_alloc_bulk(
+            type,
+            PAGE_MAGAZINE_BATCH - magazine->count,
+            &magazine->pages[magazine->count]);
+
+    // magazine frames hold no references
+    for (size_t i = 0; i < count; i++)
+    {
+        page_stack_dec_ref(magazine->pages[magazine->count++]);
+    }
+
+    return magazine->count;
+}
+
+static void magazine_drain(struct page_magazine *magazine)
+{
+    while (magazine->count > PAGE_MAGAZINE_BATCH)
+    {
+        page_stack_release(magazine->pages[--magazine->count]);
+    }
+}
+
+kc_phys_addr page_magazine_alloc(enum page_alloc_flags type)
+{
+    int zone_index;
+    int zone_last;
+
+    if ((type < PAGE_ALLOC_LOW) || (type > PAGE_ALLOC_ANY))
+    {
+        return 0;
+    }
+
+    // same high-to-low order as the page stacks for any allocations
+    if (type == PAGE_ALLOC_ANY)
+    {
+        zone_index = PAGE_ALLOC_HIGH;
+        zone_last = PAGE_ALLOC_LOW;
+    }
+    else
+    {
+        zone_index = type;
+        zone_last = type;
+    }
+
+    kc_phys_addr page = 0;
+    uint64_t flags = irq_lock();
+    struct page_magazine_cpu *cpu = &magazine_state[cpu_get_index()];
+
+    for (; !page && zone_last <= zone_index; zone_index--)
+    {
+        struct page_magazine *magazine = &cpu->zones[zone_index - 1];
+
+        if (magazine->count)
+        {
+            cpu->stats.hits++;
+        }
+        else if (magazine_refill(magazine, zone_index))
+        {
+            cpu->stats.misses++;
+        }
+        else
+        {
+            continue;
+        }
+
+        page = magazine->pages[--magazine->count];
+        page_stack_set_allocated(page);
+    }
+
+    irq_unlock(flags);
+
+    return page;
+}
+
+void page_magazine_free(kc_phys_addr page)
+{
+    // freeing a page only makes sense for present physical pages
+    if (!page_stack_get_present(page))
+    {
+        return;
+    }
+
+    int refs = page_stack_dec_ref(page);
+
+    // a frame without a reference left to drop is free already, maybe in
+    // a magazine, and caching it again would hand it out twice
+    if (refs < 0)
+    {
+        kprintf("warning: freeing page %#lx which is already free\n", page);
+        return;
+    }
+
+    if (refs != 0)
+    {
+        return;
+    }
+
+    enum page_alloc_flags type = page_stack_get_type(page);
+
+    // only single frames are cached, blocks go straight back
+    if (page_stack_get_order(page) ||
+            (type < PAGE_ALLOC_LOW) ||
+            (type > PAGE_ALLOC_HIGH))
+    {
+        page_stack_release(page);
+        return;
+    }
+
+    uint64_t flags = irq_lock();
+    struct page_magazine_cpu *cpu = &magazine_state[cpu_get_index()];
+    struct page_magazine *magazine = &cpu->zones[type - 1];
+
+    if (magazine->count == PAGE_MAGAZINE_SIZE)
+    {
+        magazine_drain(magazine);
+        cpu->stats.drains++;
+    }
+
+    magazine->pages[magazine->count++] = page;
+    cpu->stats.frees++;
+
+    irq_unlock(flags);
+}
+
+int page_magazine_shrink(enum page_alloc_flags zone, enum page_watermark level)
+{
+    // only give cached frames back once a zone is nearly out
+    if ((level != PAGE_WATERMARK_MIN) ||
+            (zone < PAGE_ALLOC_LOW) ||
+            (zone > PAGE_ALLOC_HIGH))
+    {
+        return 0;
+    }
+
+    uint64_t flags = irq_lock();
+
+    for (unsigned cpu = 0; cpu < CPU_COUNT_MAX; cpu++)
+    {
+        struct page_magazine *magazine = &magazine_state[cpu].zones[zone - 1];
+
+        while (magazine->count)
+        {
+            page_stack_release(magazine->pages[--magazine->count]);
+        }
+    }
+
+    irq_unlock(flags);
+
+    return 0;
+}
+
+void page_magazine_get_stats(unsigned cpu, struct page_magazine_stats *stats)
+{
+    if (cpu < CPU_COUNT_MAX)
+    {
+        *stats = magazine_state[cpu].stats;
+    }
+}
+
+void page_magazine_report(void)
+{
+    for (unsigned cpu = 0; cpu < CPU_COUNT_MAX; cpu++)
+    {
+        struct page_magazine_stats *stats = &magazine_state[cpu].stats;
+        uint64_t total = stats->hits + stats->misses;
+
+        if (!total)
+        {
+            continue;
+        }
+
+        kprintf("cpu %u page magazines: %lu hits %lu misses (%lu%%) "
+                "%lu frees %lu drains\n",
+                cpu,
+                stats->hits,
+                stats->misses,
+                stats->hits * 100 / total,
+                stats->frees,
+                stats->drains);
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "memory.h"
+
+struct page_magazine_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t frees;
+    uint64_t drains;
+};
+
+kc_phys_addr page_magazine_alloc(enum page_alloc_flags type);
+void page_magazine_free(kc_phys_addr page);
+int page_magazine_shrink(enum page_alloc_flags zone, enum page_watermark level);
+
+void page_magazine_get_stats(unsigned cpu, struct page_magazine_stats *stats);
+void page_magazine_report(void);
@@ -0,0 +1,269 @@
+/* same page merging
+ *
+ * a thread walks the frames looking for pages of regions allocated with
+ * VM_ALLOC_MERGEABLE that weren't written since its last pass over them,
+ * and folds identical ones into a single read-only frame. pages of
+ * nothing but zeroes go to the zero page, the rest to frames kept in a
+ * table indexed by content hash. a write to a merged page takes the
+ * anonymous handler's copy-on-write path, and the table lets a frame go
+ * once nothing maps it anymore. other memory, the heap and thread stacks
+ * among it, is never merged.
+ *
+ * the table is direct mapped and lossy: a bucket holds one shared frame
+ * or one candidate from the current pass, a page that collides with
+ * something else is just passed over. a shared frame carries an extra
+ * reference for the table, which also keeps it from looking movable.
+ */
+
+#include "page_merge.h"
+#include "page_rmap.h"
+#include "page_stack.h"
+
+#include "task.h"
+#include "timer.h"
+#include "cpu/irq.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_MERGE_SLOTS 1024
+#define PAGE_MERGE_BATCH 1024
+#define PAGE_MERGE_INTERVAL TIMER_NANOSECOND
+
+struct page_merge_slot
+{
+    uint64_t hash;
+    kc_phys_addr page;
+    uint32_t pass;
+    bool shared;
+};
+
+static struct page_merge_state
+{
+    struct page_merge_slot slots[PAGE_MERGE_SLOTS];
+    kc_phys_addr hand;
+    uint32_t pass;
+    uint64_t reported;
+    struct page_merge_stats stats;
+}
+merge_state = {.pass = 1};
+
+static void page_merge_thread(void);
+
+void page_merge_init(void)
+{
+    task_append_thread(page_merge_thread);
+}
+
+static uint64_t merge_hash(kc_phys_addr page, bool *zero)
+{
+    const uint64_t *words = phys_to_virt(page);
+    uint64_t hash = 0;
+    uint64_t any = 0;
+
+    for (size_t i = 0; i < page_size(1) / sizeof(*words); i++)
+    {
+        any |= words[i];
+        hash = (hash ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+
+    *zero = !any;
+    return hash;
+}
+
+static struct page_merge_slot *merge_slot(uint64_t hash)
+{
+    return &merge_state.slots[(hash >> 32) % PAGE_MERGE_SLOTS];
+}
+
+static bool merge_same(kc_phys_addr page, kc_phys_addr other)
+{
+    return !memcmp(phys_to_virt(page), phys_to_virt(other), page_size(1));
+}
+
+// the shared frame a page's content is kept in, NULL if it isn't one
+static struct page_merge_slot *merge_find(kc_phys_addr page)
+{
+    bool zero;
+    struct page_merge_slot *slot = merge_slot(merge_hash(page, &zero));
+
+    return slot->shared && (slot->page == page) ? slot : NULL;
+}
+
+bool page_merge_contains(kc_phys_addr page)
+{
+    uint64_t flags = irq_lock();
+    bool found = merge_find(page) != NULL;
+    irq_unlock(flags);
+
+    return found;
+}
+
+static void merge_prune(struct page_merge_slot *slot)
+{
+    // the table's two references are all that's left
+    page_dec_ref(slot->page);
+    page_free(slot->page);
+
+    *slot = (struct page_merge_slot){0, 0, 0, false};
+    merge_state.stats.pruned++;
+    merge_state.stats.shared_frames--;
+}
+
+// a write broke away from a shared frame, it may not be needed anymore
+void page_merge_unshare(kc_phys_addr page)
+{
+    uint64_t flags = irq_lock();
+    struct page_merge_slot *slot = merge_find(page);
+
+    if (slot)
+    {
+        merge_state.stats.unshared++;
+
+        if (!page_rmap_count(page))
+        {
+            merge_prune(slot);
+        }
+    }
+
+    irq_unlock(flags);
+}
+
+// fold one page into a shared frame if it's stable and has a twin
+static void merge_page(kc_phys_addr page)
+{
+    void *vaddr = page_get_mergeable(page);
+
+    // written since the last pass, try again on the next one
+    if (!vaddr || page_clear_dirty(vaddr))
+    {
+        return;
+    }
+
+    merge_state.stats.scanned++;
+
+    bool zero;
+    uint64_t hash = merge_hash(page, &zero);
+    struct page_merge_slot *slot = merge_slot(hash);
+
+    if (zero)
+    {
+        page_share(page, vm_get_zero_page());
+        page_free(page);
+        merge_state.stats.zero_merged++;
+        return;
+    }
+
+    if (slot->shared)
+    {
+        if ((slot->hash != hash) || !merge_same(slot->page, page))
+        {
+            return;
+        }
+    }
+    else if ((slot->pass == merge_state.pass) &&
+            (slot->hash == hash) &&
+            (slot->page != page) &&
+            page_get_mergeable(slot->page) &&
+            merge_same(slot->page, page))
+    {
+        // the first twin becomes the shared frame
+        page_share(slot->page, slot->page);
+        page_inc_ref(slot->page);
+        slot->shared = true;
+        merge_state.stats.shared_frames++;
+    }
+    else
+    {
+        *slot = (struct page_merge_slot){hash, page, merge_state.pass, false};
+        return;
+    }
+
+    // short of reverse mappings for the shared frame, the page stays
+    if (!page_share(page, slot->page))
+    {
+        return;
+    }
+
+    page_free(page);
+    merge_state.stats.merged++;
+}
+
+static void merge_pass_end(void)
+{
+    // candidates only count within a pass, shared frames live on until
+    // their last mapping is gone
+    for (size_t i = 0; i < PAGE_MERGE_SLOTS; i++)
+    {
+        struct page_merge_slot *slot = &merge_state.slots[i];
+
+        if (slot->shared && !page_rmap_count(slot->page))
+        {
+            merge_prune(slot);
+        }
+    }
+
+    merge_state.pass++;
+
+    if (merge_state.reported !=
+            merge_state.stats.merged + merge_state.stats.zero_merged)
+    {
+        merge_state.reported =
+            merge_state.stats.merged + merge_state.stats.zero_merged;
+        page_merge_report();
+    }
+}
+
+static void page_merge_thread(void)
+{
+    while (true)
+    {
+        task_sleep(PAGE_MERGE_INTERVAL);
+
+        for (size_t i = 0; i < PAGE_MERGE_BATCH; i++)
+        {
+            uint64_t flags = irq_lock();
+            kc_phys_addr page = merge_state.hand;
+            kc_phys_addr end = page_stack_get_end();
+
+            merge_page(page);
+
+            merge_state.hand = page + page_size(1);
+
+            if (merge_state.hand >= end)
+            {
+                merge_state.hand = 0;
+                merge_pass_end();
+            }
+
+            irq_unlock(flags);
+        }
+    }
+}
+
+void page_merge_get_stats(struct page_merge_stats *stats)
+{
+    uint64_t flags = irq_lock();
+    *stats = merge_state.stats;
+    irq_unlock(flags);
+}
+
+void page_merge_report(void)
+{
+    struct page_merge_stats stats;
+    page_merge_get_stats(&stats);
+
+    // every merge frees a frame, every copy on write takes one back.
+    // writes to the zero page look the same as first touches, so pages
+    // merged into it stay counted once they're written again
+    uint64_t saved = stats.merged + stats.pruned - stats.unshared;
+
+    kprintf("page merging: %lu scanned, %lu into the zero page, "
+            "%lu into %zu shared frames, %lu unshared, %luKiB saved\n",
+            stats.scanned,
+            stats.zero_merged,
+            stats.merged,
+            stats.shared_frames,
+            stats.unshared,
+            (stats.zero_merged + saved) * page_size(1) >> 10);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+
+struct page_merge_stats
+{
+    uint64_t scanned;
+    uint64_t zero_merged;
+    uint64_t merged;
+    uint64_t unshared;
+    uint64_t pruned;
+    size_t shared_frames;
+};
+
+void page_merge_init(void);
+
+bool page_merge_contains(kc_phys_addr page);
+void page_merge_unshare(kc_phys_addr page);
+
+void page_merge_get_stats(struct page_merge_stats *stats);
+void page_merge_report(void);
@@ -0,0 +1,387 @@
+/* memory nodes
+ *
+ * nodes come from the memory and processor affinity entries of the ACPI
+ * SRAT, with distances between them from the SLIT. without an SRAT all of
+ * memory is node 0.
+ *
+ * every node gets a fallback order of all nodes sorted by distance,
+ * nearest (itself) first, that the page stacks walk when allocating.
+ */
+
+#include "page_node.h"
+
+#include "acpi.h"
+#include "cpu.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_NODE_RANGES 64
+#define PAGE_NODE_CPUS 256
+
+#define SRAT_PROCESSOR_AFFINITY 0
+#define SRAT_MEMORY_AFFINITY 1
+#define SRAT_X2APIC_AFFINITY 2
+
+#define SRAT_ENABLED 1
+
+#define SLIT_LOCAL_DISTANCE 10
+#define SLIT_REMOTE_DISTANCE 20
+
+struct acpi_srat
+{
+    struct acpi_header header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} __attribute__((packed));
+
+struct acpi_srat_entry
+{
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed));
+
+struct acpi_srat_processor
+{
+    struct acpi_srat_entry entry;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_memory
+{
+    struct acpi_srat_entry entry;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic
+{
+    struct acpi_srat_entry entry;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} __attribute__((packed));
+
+struct acpi_slit
+{
+    struct acpi_header header;
+    uint64_t count;
+    uint8_t distances[];
+} __attribute__((packed));
+
+struct page_node_range
+{
+    kc_phys_addr base;
+    kc_phys_addr limit;
+    unsigned node;
+};
+
+static struct page_node_state
+{
+    unsigned count;
+    uint32_t domains[PAGE_NODE_MAX];
+    uint8_t distances[PAGE_NODE_MAX][PAGE_NODE_MAX];
+    unsigned fallback[PAGE_NODE_MAX][PAGE_NODE_MAX];
+    size_t range_count;
+    struct page_node_range ranges[PAGE_NODE_RANGES];
+    uint8_t cpus[PAGE_NODE_CPUS];
+    // the node of each cpu index plus one once it has been looked up
+    uint8_t cpu_nodes[CPU_COUNT_MAX];
+    uint64_t local[PAGE_NODE_MAX];
+    uint64_t remote[PAGE_NODE_MAX];
+}
+node_state = {
+    1,
+    {0},
+    {{SLIT_LOCAL_DISTANCE}},
+    {{0}},
+    0,
+    {{0}},
+    {0},
+    {0},
+    {0},
+    {0}
+};
+
+static unsigned node_for_domain(uint32_t domain)
+{
+    for (unsigned node = 0; node < node_state.count; node++)
+    {
+        if (node_state.domains[node] == domain)
+        {
+            return node;
+        }
+    }
+
+    if (node_state.count == PAGE_NODE_MAX)
+    {
+        kprintf("warning: too many memory nodes, using node 0 for domain %u\n",
+                domain);
+        return 0;
+    }
+
+    node_state.domains[node_state.count] = domain;
+    return node_state.count++;
+}
+
+static void srat_parse(struct acpi_srat *srat)
+{
+    unsigned char *current = (unsigned char *)(srat + 1);
+    unsigned char *end = (unsigned char *)srat + srat->header.length;
+
+    // the first domain found is node 0 instead of the default one
+    node_state.count = 0;
+
+    while (current < end)
+    {
+        struct acpi_srat_entry *entry = (struct acpi_srat_entry *)current;
+
+        if (entry->length < sizeof(*entry))
+        {
+            break;
+        }
+
+        switch (entry->type)
+        {
+            case SRAT_PROCESSOR_AFFINITY:
+            {
+                struct acpi_srat_processor *cpu = (void *)entry;
+                uint32_t domain = cpu->domain_low |
+                    cpu->domain_high[0] << 8 |
+                    cpu->domain_high[1] << 16 |
+                    cpu->domain_high[2] << 24;
+
+                if (cpu->flags & SRAT_ENABLED)
+                {
+                    node_state.cpus[cpu->apic_id] = node_for_domain(domain);
+                }
+                break;
+            }
+            case SRAT_X2APIC_AFFINITY:
+            {
+                struct acpi_srat_x2apic *cpu = (void *)entry;
+
+                if ((cpu->flags & SRAT_ENABLED) &&
+                        (cpu->x2apic_id < PAGE_NODE_CPUS))
+                {
+                    node_state.cpus[cpu->x2apic_id] =
+                        node_for_domain(cpu->domain);
+                }
+                break;
+            }
+            case SRAT_MEMORY_AFFINITY:
+            {
+                struct acpi_srat_memory *memory = (void *)entry;
+
+                if (!(memory->flags & SRAT_ENABLED) || !memory->length)
+                {
+                    break;
+                }
+
+                if (node_state.range_count == PAGE_NODE_RANGES)
+                {
+                    kprintf("warning: too many SRAT memory ranges\n");
+                    break;
+                }
+
+                node_state.ranges[node_state.range_count++] =
+                    (struct page_node_range)
+                    {
+                        memory->base,
+                        memory->base + memory->length,
+                        node_for_domain(memory->domain)
+                    };
+                break;
+            }
+            default:
+                break;
+        }
+
+        current += entry->length;
+    }
+
+    if (!node_state.count)
+    {
+        node_state.count = 1;
+    }
+}
+
+static void slit_parse(struct acpi_slit *slit)
+{
+    for (unsigned from = 0; from < node_state.count; from++)
+    {
+        for (unsigned to = 0; to < node_state.count; to++)
+        {
+            uint32_t from_domain = node_state.domains[from];
+            uint32_t to_domain = node_state.domains[to];
+
+            if (slit && (from_domain < slit->count) && (to_domain < slit->count))
+            {
+                node_state.distances[from][to] =
+                    slit->distances[from_domain * slit->count + to_domain];
+            }
+            else
+            {
+                node_state.distances[from][to] = (from == to) ?
+                    SLIT_LOCAL_DISTANCE : SLIT_REMOTE_DISTANCE;
+            }
+        }
+    }
+}
+
+static void fallback_init(void)
+{
+    for (unsigned node = 0; node < node_state.count; node++)
+    {
+        unsigned *order = node_state.fallback[node];
+
+        // insertion sort by distance, ties keep node order
+        for (unsigned i = 0; i < node_state.count; i++)
+        {
+            unsigned j = i;
+
+            while (j && (node_state.distances[node][order[j - 1]] >
+                        node_state.distances[node][i]))
+            {
+                order[j] = order[j - 1];
+                j--;
+            }
+
+            order[j] = i;
+        }
+    }
+}
+
+void page_node_init(void)
+{
+    struct acpi_srat *srat = acpi_find_table("SRAT");
+
+    if (srat)
+    {
+        struct acpi_slit *slit = acpi_find_table("SLIT");
+
+        srat_parse(srat);
+        slit_parse(slit);
+        acpi_release_table(slit);
+        acpi_release_table(srat);
+    }
+    else
+    {
+        slit_parse(NULL);
+    }
+
+    fallback_init();
+
+    // cpus that allocated before the SRAT was read looked up node 0
+    for (unsigned cpu = 0; cpu < CPU_COUNT_MAX; cpu++)
+    {
+        node_state.cpu_nodes[cpu] = 0;
+    }
+
+    kprintf("memory nodes: %u, %zu SRAT memory ranges, cpu %u on node %u\n",
+            node_state.count,
+            node_state.range_count,
+            cpu_get_index(),
+            page_node_current());
+}
+
+unsigned page_node_count(void)
+{
+    return node_state.count;
+}
+
+unsigned page_node_current(void)
+{
+    unsigned cpu = cpu_get_index();
+
+    // the apic id takes a cpuid, so each cpu only asks for it once
+    if (!node_state.cpu_nodes[cpu])
+    {
+        uint32_t apic_id = cpu_get_apic_id();
+
+        node_state.cpu_nodes[cpu] = 1 +
+            (apic_id < PAGE_NODE_CPUS ? node_state.cpus[apic_id] : 0);
+    }
+
+    return node_state.cpu_nodes[cpu] - 1;
+}
+
+unsigned page_node_of(kc_phys_addr page, kc_phys_addr *limit)
+{
+    kc_phys_addr next = -1ULL;
+
+    for (size_t i = 0; i < node_state.range_count; i++)
+    {
+        struct page_node_range *range = &node_state.ranges[i];
+
+        if ((page >= range->base) && (page < range->limit))
+        {
+            if (limit)
+            {
+                *limit = range->limit;
+            }
+
+            return range->node;
+        }
+
+        if ((range->base > page) && (range->base < next))
+        {
+            next = range->base;
+        }
+    }
+
+    // memory the SRAT doesn't cover belongs to node 0
+    if (limit)
+    {
+        *limit = next;
+    }
+
+    return 0;
+}
+
+unsigned const *page_node_fallback(unsigned node)
+{
+    return node_state.fallback[node < node_state.count ? node : 0];
+}
+
+void page_node_count_alloc(unsigned node, size_t count)
+{
+    if (node == page_node_current())
+    {
+        node_state.local[node] += count;
+    }
+    else
+    {
+        node_state.remote[node] += count;
+    }
+}
+
+void page_node_report(void)
+{
+    for (unsigned node = 0; node < node_state.count; node++)
+    {
+        kprintf("node %u: %lu local %lu remote allocations, distances",
+                node,
+                node_state.local[node],
+                node_state.remote[node]);
+
+        for (unsigned to = 0; to < node_state.count; to++)
+        {
+            kprintf(" %hhu", node_state.distances[node][to]);
+        }
+
+        kprintf("\n");
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "memory.h"
+
+// the most memory nodes the page frame allocator keeps lists for
+#define PAGE_NODE_MAX 8
+
+void page_node_init(void);
+
+unsigned page_node_count(void);
+unsigned page_node_current(void);
+unsigned page_node_of(kc_phys_addr page, kc_phys_addr *limit);
+unsigned const *page_node_fallback(unsigned node);
+
+void page_node_count_alloc(unsigned node, size_t count);
+void page_node_report(void);
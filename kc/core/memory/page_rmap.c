@@ -0,0 +1,251 @@
+/* reverse mappings
+ *
+ * every frame mapped through page_map_at() remembers where. an allocated
+ * page's descriptor has room for one word, which holds the virtual
+ * address itself, tagged in its low bit, while there is a single
+ * mapping, and the head of a chain on the heap once there are more.
+ * most frames are only ever mapped once, so the chain is the rare case.
+ *
+ * all of it is kept under the allocator lock, so a walk sees a frame's
+ * mappings as they were at one point in time. chain entries come from a
+ * small pool that page_rmap_reserve() fills before the lock is taken, as
+ * the heap can't be grown under it.
+ */
+
+#include "page_rmap.h"
+#include "page_stack.h"
+
+#include "panic.h"
+#include "cpu/irq.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_RMAP_SINGLE 1
+#define PAGE_RMAP_POOL_MAX 64
+
+struct page_rmap_entry
+{
+    void *vaddr;
+    struct page_rmap_entry *next;
+};
+
+#define rmap_entry(r) ((struct page_rmap_entry *)(r))
+#define rmap_single(r) ((void *)((r) & ~(uintptr_t)PAGE_RMAP_SINGLE))
+
+static struct page_rmap_state
+{
+    struct page_rmap_entry *pool;
+    size_t pooled;
+}
+rmap_state;
+
+// take an entry from the pool, which the caller made sure has enough
+static struct page_rmap_entry *rmap_entry_alloc(
+        void *vaddr,
+        struct page_rmap_entry *next)
+{
+    struct page_rmap_entry *entry = rmap_state.pool;
+
+    rmap_state.pool = entry->next;
+    rmap_state.pooled--;
+
+    entry->vaddr = vaddr;
+    entry->next = next;
+    return entry;
+}
+
+static void rmap_entry_free(struct page_rmap_entry *entry)
+{
+    if (rmap_state.pooled >= PAGE_RMAP_POOL_MAX)
+    {
+        heap_free(entry);
+        return;
+    }
+
+    entry->next = rmap_state.pool;
+    rmap_state.pool = entry;
+    rmap_state.pooled++;
+}
+
+// fill the pool up to count entries, without the lock held
+int page_rmap_reserve(size_t count)
+{
+    while (!page_rmap_ready(count))
+    {
+        struct page_rmap_entry *entry = heap_alloc(sizeof(*entry));
+
+        if (!entry)
+        {
+            kprintf("warning: no memory for reverse mappings\n");
+            return -1;
+        }
+
+        uint64_t flags = irq_lock();
+        entry->next = rmap_state.pool;
+        rmap_state.pool = entry;
+        rmap_state.pooled++;
+        irq_unlock(flags);
+    }
+
+    return 0;
+}
+
+// whether the pool holds count entries, it only shrinks under the lock
+bool page_rmap_ready(size_t count)
+{
+    uint64_t flags = irq_lock();
+    bool ready = rmap_state.pooled >= count;
+
+    irq_unlock(flags);
+    return ready;
+}
+
+// -1 if a chain entry is needed and the pool is empty, nothing changes then
+int page_rmap_add(kc_phys_addr page, void *vaddr)
+{
+    // frames without a descriptor, like device memory, aren't tracked
+    if (page_stack_get_ref(page) < 0)
+    {
+        return 0;
+    }
+
+    uint64_t flags = irq_lock();
+    uintptr_t rmap = page_stack_get_rmap(page);
+
+    if (!rmap)
+    {
+        rmap = (uintptr_t)vaddr | PAGE_RMAP_SINGLE;
+    }
+    else
+    {
+        if (rmap_state.pooled < ((rmap & PAGE_RMAP_SINGLE) ? 2 : 1))
+        {
+            irq_unlock(flags);
+            return -1;
+        }
+
+        if (rmap & PAGE_RMAP_SINGLE)
+        {
+            rmap = (uintptr_t)rmap_entry_alloc(rmap_single(rmap), NULL);
+        }
+
+        rmap = (uintptr_t)rmap_entry_alloc(vaddr, rmap_entry(rmap));
+    }
+
+    page_stack_set_rmap(page, rmap);
+    irq_unlock(flags);
+
+    return 0;
+}
+
+void page_rmap_remove(kc_phys_addr page, void *vaddr)
+{
+    uint64_t flags = irq_lock();
+    uintptr_t rmap = page_stack_get_rmap(page);
+
+    if (rmap & PAGE_RMAP_SINGLE)
+    {
+        if (rmap_single(rmap) == vaddr)
+        {
+            page_stack_set_rmap(page, 0);
+        }
+    }
+    else if (rmap)
+    {
+        struct page_rmap_entry *first = rmap_entry(rmap);
+        struct page_rmap_entry **link = &first;
+
+        while (*link && ((*link)->vaddr != vaddr))
+        {
+            link = &(*link)->next;
+        }
+
+        if (*link)
+        {
+            struct page_rmap_entry *entry = *link;
+            *link = entry->next;
+            rmap_entry_free(entry);
+        }
+
+        rmap = (uintptr_t)first;
+
+        // back to a single mapping, which fits in the descriptor again
+        if (first && !first->next)
+        {
+            rmap = (uintptr_t)first->vaddr | PAGE_RMAP_SINGLE;
+            rmap_entry_free(first);
+        }
+
+        page_stack_set_rmap(page, rmap);
+    }
+
+    irq_unlock(flags);
+}
+
+// hand all of page's mappings to target, which must not have any
+void page_rmap_move(kc_phys_addr page, kc_phys_addr target)
+{
+    uint64_t flags = irq_lock();
+
+    if (page_stack_get_rmap(target))
+    {
+        kprintf("error: moving reverse mappings onto mapped frame %#lx\n",
+                target);
+        PANIC(GENERAL_PANIC);
+    }
+
+    page_stack_set_rmap(target, page_stack_get_rmap(page));
+    page_stack_set_rmap(page, 0);
+    irq_unlock(flags);
+}
+
+size_t page_rmap_count(kc_phys_addr page)
+{
+    return page_rmap_walk(page, NULL, NULL);
+}
+
+void *page_rmap_first(kc_phys_addr page)
+{
+    uint64_t flags = irq_lock();
+    uintptr_t rmap = page_stack_get_rmap(page);
+    void *vaddr = rmap & PAGE_RMAP_SINGLE ? rmap_single(rmap) :
+        rmap ? rmap_entry(rmap)->vaddr : NULL;
+
+    irq_unlock(flags);
+    return vaddr;
+}
+
+// func may change the page tables but not the reverse map itself
+size_t page_rmap_walk(kc_phys_addr page, page_rmap_func func, void *data)
+{
+    uint64_t flags = irq_lock();
+    uintptr_t rmap = page_stack_get_rmap(page);
+    size_t count = 0;
+
+    if (rmap & PAGE_RMAP_SINGLE)
+    {
+        if (func)
+        {
+            func(rmap_single(rmap), data);
+        }
+
+        count = 1;
+    }
+    else
+    {
+        for (struct page_rmap_entry *entry = rmap_entry(rmap);
+                entry;
+                entry = entry->next)
+        {
+            if (func)
+            {
+                func(entry->vaddr, data);
+            }
+
+            count++;
+        }
+    }
+
+    irq_unlock(flags);
+    return count;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+
+// called for every virtual address a frame is mapped at
+typedef void (*page_rmap_func)(void *vaddr, void *data);
+
+int page_rmap_reserve(size_t count);
+bool page_rmap_ready(size_t count);
+int page_rmap_add(kc_phys_addr page, void *vaddr);
+void page_rmap_remove(kc_phys_addr page, void *vaddr);
+void page_rmap_move(kc_phys_addr page, kc_phys_addr target);
+
+size_t page_rmap_count(kc_phys_addr page);
+void *page_rmap_first(kc_phys_addr page);
+size_t page_rmap_walk(kc_phys_addr page, page_rmap_func func, void *data);
@@ -1,19 +1,62 @@
 #include "page_stack.h"
+#include "page_cma.h"
+#include "page_color.h"
+#include "page_node.h"
+#include "panic.h"
 #include "vm_tree.h"
 #include "vm_object.h"
 
+#include "cpu/irq.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
 #include <kc.h>
+#include <kernel/entry.h>
+#include <lib/kstdio.h>
 
 #define PAGE_STACK_CACHE_SIZE (1ULL << 32)
+#define PAGE_STACK_ZONES 3
 #define page_stack_index(x) (x / page_size(1))
-#define page_stack_address(x) (x * page_size(1))
+#define page_stack_address(x) ((kc_phys_addr)(x) * page_size(1))
+#define page_stack_limit() (PAGE_STACK_CACHE_SIZE / sizeof(struct page))
+
+// the min watermark is 1/256th of a zone, low and high are 5/4 and 3/2 of it
+#define PAGE_WATERMARK_SHIFT 8
+#define PAGE_WATERMARK_FLOOR 16
+
+// how far down the single page list a colored allocation looks
+#define PAGE_COLOR_SCAN 16
+
+// descriptors are only backed for 128MiB sections with memory in them
+#define PAGE_SECTION_SHIFT 15
+#define PAGE_SECTION_PAGES (1UL << PAGE_SECTION_SHIFT)
+#define PAGE_SECTION_COUNT ((page_stack_limit() >> PAGE_SECTION_SHIFT) + 1)
+#define PAGE_SECTION_WORDS ((PAGE_SECTION_COUNT + 63) / 64)
+#define page_section(x) ((x) >> PAGE_SECTION_SHIFT)
+
+// the descriptor state word, references are taken and dropped on it with
+// compare-and-swap so mapping never needs the allocator lock
+#define PAGE_STATE_PRESENT (1U << 0) // a physical page is at this location
+#define PAGE_STATE_ALLOCATED (1U << 1) // this physical page has been taken
+#define PAGE_STATE_BUDDY (1U << 2) // this page heads a free block on a list
+#define PAGE_STATE_ORDER_SHIFT 3 // the order of the block this page heads
+#define PAGE_STATE_NODE_SHIFT 8 // the memory node this page belongs to
+#define PAGE_STATE_REFS_SHIFT 11 // the number of references this page has
+#define PAGE_STATE_REFS_MAX (-1U >> PAGE_STATE_REFS_SHIFT)
+#define PAGE_STATE_KEEP (PAGE_STATE_PRESENT | (7U << PAGE_STATE_NODE_SHIFT))
+
+#define page_state_order(s) (((s) >> PAGE_STATE_ORDER_SHIFT) & 0x1f)
+#define page_state_node(s) (((s) >> PAGE_STATE_NODE_SHIFT) & 0x7)
+#define page_state_refs(s) ((s) >> PAGE_STATE_REFS_SHIFT)
 
 struct page
 {
-    uint32_t present: 1; // a physical page is at this location
-    uint32_t allocated: 1; // this physical page has been taken
-    int32_t next_refs; // allocated = 0: the index of the next page in the list
-                       // allocated = 1: the number of references this page has
+    _Atomic uint32_t state;
+    int32_t next; // allocated = 0: the index of the next page in the list
+                  // allocated = 1: the low half of the reverse map
+    int32_t prev; // allocated = 0: the index of the previous page in the list
+                  // allocated = 1: the high half of the reverse map
 };
 
 static struct page_stack_state
@@ -21,25 +64,74 @@ static struct page_stack_state
     struct vm_tree_node node;
     struct vm_object object;
     struct page *stack;
-    int32_t free_count[3];
-    int32_t total_count[3];
-    int32_t first_free[3];
+    int32_t free_count[PAGE_STACK_ZONES];
+    int32_t total_count[PAGE_STACK_ZONES];
+    int32_t first_free[PAGE_NODE_MAX][PAGE_STACK_ZONES][PAGE_ORDER_MAX + 1];
+    int32_t watermarks[PAGE_STACK_ZONES][PAGE_WATERMARK_OK];
+    enum page_watermark levels[PAGE_STACK_ZONES];
+    unsigned pending;
+    struct page_watermark_callback_list *callbacks;
+    uint64_t sections[PAGE_SECTION_WORDS];
+    size_t section_count;
+    unsigned long end;
 }
 stack_state = {
     {0},
-    {ANONYMOUS_VM_OBJECT, anonymous_page_handler},
+    {NULL_VM_OBJECT, NULL},
     NULL,
     {0,0,0},
     {0,0,0},
-    {-1,-1,-1}
+    {{{0}}},
+    {{0}},
+    {PAGE_WATERMARK_MIN, PAGE_WATERMARK_MIN, PAGE_WATERMARK_MIN},
+    0,
+    NULL,
+    {0},
+    0,
+    0
 };
 
 static enum page_alloc_flags stack_type(kc_phys_addr page);
-static void stack_push(kc_phys_addr page);
-static kc_phys_addr stack_pop(enum page_alloc_flags type);
+static void watermark_update(int zone);
+static void stack_push(kc_phys_addr page, unsigned order);
+static void page_claim(struct page *page, unsigned order);
+static bool page_unclaim(kc_phys_addr page, unsigned *order);
+static void list_remove(int zone, unsigned order, int32_t index);
+static kc_phys_addr node_take(
+        unsigned node,
+        int zone,
+        int32_t index,
+        unsigned order);
+static kc_phys_addr node_pop(unsigned node, int zone, unsigned order);
+static kc_phys_addr node_pop_color(unsigned node, int zone, unsigned color);
+static kc_phys_addr stack_pop(
+        enum page_alloc_flags type,
+        unsigned order,
+        int color);
+
+static int section_present(unsigned long section)
+{
+    if (section >= PAGE_SECTION_COUNT)
+    {
+        return 0;
+    }
+
+    return (stack_state.sections[section / 64] >> (section % 64)) & 1;
+}
+
+// the descriptor for a physical page, or NULL if its section has none
+static struct page *stack_page(unsigned long index)
+{
+    if (!section_present(page_section(index)))
+    {
+        return NULL;
+    }
+
+    return &stack_state.stack[index];
+}
 
 void page_stack_init(void)
-{   
+{
     vmt_init_node(
             vm_get_tree(),
             &stack_state.node,
@@ -48,18 +140,514 @@ void page_stack_init(void)
             &kc_image_base);
 
     stack_state.stack = (struct page *)stack_state.node.key.address;
+
+    for (int node = 0; node < PAGE_NODE_MAX; node++)
+    {
+        for (int zone = 0; zone < PAGE_STACK_ZONES; zone++)
+        {
+            for (int order = 0; order <= PAGE_ORDER_MAX; order++)
+            {
+                stack_state.first_free[node][zone][order] = -1;
+            }
+        }
+    }
+}
+
+void page_stack_prepare_range(kc_phys_addr base, size_t size)
+{
+    if (!size)
+    {
+        return;
+    }
+
+    unsigned long first = page_section(page_stack_index(base));
+    unsigned long last = page_section(page_stack_index(base + size - 1));
+
+    for (unsigned long section = first; section <= last; section++)
+    {
+        if (section >= PAGE_SECTION_COUNT)
+        {
+            kprintf("warning: memory at %#lx is beyond descriptor space\n",
+                    base);
+            break;
+        }
+
+        if (section_present(section))
+        {
+            continue;
+        }
+
+        // without backing the section stays absent, and adding the range
+        // stops where its descriptors would be
+        if (!page_populate(
+                    &stack_state.stack[section << PAGE_SECTION_SHIFT],
+                    PAGE_SECTION_PAGES * sizeof(struct page),
+                    CONTENT_RWDATA))
+        {
+            break;
+        }
+
+        stack_state.sections[section / 64] |= 1ULL << (section % 64);
+        stack_state.section_count++;
+    }
+}
+
+size_t page_stack_add_range(
+        kc_phys_addr base,
+        size_t size,
+        enum memory_range_type type)
+{
+    unsigned long index = page_stack_index(base);
+    unsigned long end = page_stack_index(base + size);
+
+    // page zero never goes on a list, a zero address means failure
+    if (!index && end)
+    {
+        index++;
+    }
+
+    if (index >= end)
+    {
+        return page_stack_address(end) - base;
+    }
+
+    page_stack_prepare_range(
+            page_stack_address(index),
+            page_stack_address(end - index));
+
+    unsigned long first = index;
+    unsigned long node_end = 0;
+    unsigned node = 0;
+
+    // initialize the descriptors in one tight pass
+    for (; index < end; index++)
+    {
+        struct page *page = stack_page(index);
+
+        if (!page)
+        {
+            break;
+        }
+
+        if (index >= node_end)
+        {
+            kc_phys_addr limit;
+            node = page_node_of(page_stack_address(index), &limit);
+            node_end = page_stack_index(limit);
+        }
+
+        uint32_t state = PAGE_STATE_PRESENT | node << PAGE_STATE_NODE_SHIFT;
+
+        if (type != AVAILABLE_MEMORY)
+        {
+            state |= PAGE_STATE_ALLOCATED | 1U << PAGE_STATE_REFS_SHIFT;
+        }
+
+        atomic_store_explicit(&page->state, state, memory_order_relaxed);
+        page->next = -1;
+        page->prev = -1;
+    }
+
+    end = index;
+    index = first;
+
+    if (end > stack_state.end)
+    {
+        stack_state.end = end;
+    }
+
+    while (index < end)
+    {
+        enum page_alloc_flags zone = stack_type(page_stack_address(index));
+        unsigned order = PAGE_ORDER_MAX;
+        kc_phys_addr limit;
+
+        page_node_of(page_stack_address(index), &limit);
+        node_end = page_stack_index(limit);
+
+        // the largest aligned block that fits and stays in one zone and node
+        while (order &&
+                ((index & ((1UL << order) - 1)) ||
+                 (index + (1UL << order) > end) ||
+                 (index + (1UL << order) > node_end) ||
+                 (stack_type(page_stack_address(index + (1UL << order) - 1))
+                  != zone)))
+        {
+            order--;
+        }
+
+        stack_state.total_count[zone - 1] += 1 << order;
+        watermark_update(zone - 1);
+
+        if (type == AVAILABLE_MEMORY)
+        {
+            stack_push(page_stack_address(index), order);
+        }
+
+        index += 1UL << order;
+    }
+
+    return page_stack_address(end) - base;
+}
+
+void page_stack_report(void)
+{
+    size_t memory_size = 0;
+
+    for (int zone = 0; zone < PAGE_STACK_ZONES; zone++)
+    {
+        memory_size += page_stack_address(stack_state.total_count[zone]);
+    }
+
+    size_t overhead = stack_state.section_count *
+        PAGE_SECTION_PAGES * sizeof(struct page);
+
+    kprintf("page descriptors: %zu sections, %zuKiB for %zuMiB of memory "
+            "(%zu.%02zu%%)\n",
+            stack_state.section_count,
+            overhead >> 10,
+            memory_size >> 20,
+            memory_size ? overhead * 100 / memory_size : 0,
+            memory_size ? overhead * 10000 / memory_size % 100 : 0);
+
+    for (int zone = 0; zone < PAGE_STACK_ZONES; zone++)
+    {
+        kprintf("zone %d: %d/%d pages free, watermarks %d/%d/%d\n",
+                zone + 1,
+                stack_state.free_count[zone],
+                stack_state.total_count[zone],
+                stack_state.watermarks[zone][PAGE_WATERMARK_MIN],
+                stack_state.watermarks[zone][PAGE_WATERMARK_LOW],
+                stack_state.watermarks[zone][PAGE_WATERMARK_HIGH]);
+    }
+
+    page_node_report();
+    page_cma_report();
+}
+
+void page_stack_get_stats(struct kcc_memory_stats *stats)
+{
+    stats->total_pages = 0;
+    stats->free_pages = 0;
+
+    for (int zone = 0; zone < PAGE_STACK_ZONES; zone++)
+    {
+        struct kcc_memory_zone_stats *zone_stats = &stats->zones[zone];
+
+        zone_stats->total_pages = stack_state.total_count[zone];
+        zone_stats->free_pages = stack_state.free_count[zone];
+        zone_stats->min_pages =
+            stack_state.watermarks[zone][PAGE_WATERMARK_MIN];
+        zone_stats->low_pages =
+            stack_state.watermarks[zone][PAGE_WATERMARK_LOW];
+        zone_stats->high_pages =
+            stack_state.watermarks[zone][PAGE_WATERMARK_HIGH];
+
+        stats->total_pages += zone_stats->total_pages;
+        stats->free_pages += zone_stats->free_pages;
+    }
+}
+
+int page_stack_append_watermark_callback(page_watermark_callback func)
+{
+    struct page_watermark_callback_list *item = heap_alloc(sizeof(*item));
+
+    if (!item)
+    {
+        return -1;
+    }
+
+    item->func = func;
+    item->next = stack_state.callbacks;
+    stack_state.callbacks = item;
+
+    return 0;
+}
+
+static void watermark_update(int zone)
+{
+    int32_t total = stack_state.total_count[zone];
+    int32_t min = total >> PAGE_WATERMARK_SHIFT;
+    int32_t free = stack_state.free_count[zone];
+
+    if (!total)
+    {
+        return;
+    }
+
+    if (min < PAGE_WATERMARK_FLOOR)
+    {
+        min = PAGE_WATERMARK_FLOOR;
+    }
+
+    stack_state.watermarks[zone][PAGE_WATERMARK_MIN] = min;
+    stack_state.watermarks[zone][PAGE_WATERMARK_LOW] = min + min / 4;
+    stack_state.watermarks[zone][PAGE_WATERMARK_HIGH] = min + min / 2;
+
+    enum page_watermark level = PAGE_WATERMARK_MIN;
+
+    while ((level < PAGE_WATERMARK_OK) &&
+            (free >= stack_state.watermarks[zone][level]))
+    {
+        level++;
+    }
+
+    // callbacks are run later from outside the allocator
+    if (level != stack_state.levels[zone])
+    {
+        stack_state.levels[zone] = level;
+        stack_state.pending |= 1U << zone;
+    }
+}
+
+void page_stack_notify(void)
+{
+    static bool notifying = false;
+
+    // callbacks that free memory may cross watermarks themselves
+    if (notifying || !stack_state.pending)
+    {
+        return;
+    }
+
+    notifying = true;
+
+    while (stack_state.pending)
+    {
+        int zone = __builtin_ctz(stack_state.pending);
+        stack_state.pending &= ~(1U << zone);
+
+        for (struct page_watermark_callback_list *l = stack_state.callbacks;
+                l;
+                l = l->next)
+        {
+            l->func(zone + 1, stack_state.levels[zone]);
+        }
+    }
+
+    notifying = false;
+}
+
+void page_stack_pressure(enum page_alloc_flags type)
+{
+    // tell everyone a zone is out of memory, whatever its counts say
+    for (int zone = 0; zone < PAGE_STACK_ZONES; zone++)
+    {
+        if ((type == PAGE_ALLOC_ANY) || ((int)type == zone + 1))
+        {
+            stack_state.levels[zone] = PAGE_WATERMARK_MIN;
+            stack_state.pending |= 1U << zone;
+        }
+    }
+
+    page_stack_notify();
 }
 
 kc_phys_addr page_stack_alloc(enum page_alloc_flags type)
 {
-    kc_phys_addr page = stack_pop(type);
-    if (page)
+    uint64_t flags = irq_lock();
+    kc_phys_addr page = stack_pop(type, 0, -1);
+    irq_unlock(flags);
+
+    return page;
+}
+
+kc_phys_addr page_stack_alloc_order(unsigned order, enum page_alloc_flags type)
+{
+    if (order > PAGE_ORDER_MAX)
     {
-        page_stack_inc_ref(page);
+        return 0;
     }
+
+    uint64_t flags = irq_lock();
+    kc_phys_addr page = stack_pop(type, order, -1);
+    irq_unlock(flags);
+
     return page;
 }
 
+kc_phys_addr page_stack_alloc_color(enum page_alloc_flags type, unsigned color)
+{
+    uint64_t flags = irq_lock();
+    kc_phys_addr page = stack_pop(type, 0, color);
+    irq_unlock(flags);
+
+    return page;
+}
+
+size_t page_stack_alloc_bulk(
+        enum page_alloc_flags type,
+        size_t count,
+        kc_phys_addr *pages)
+{
+    int pop_stack_index = -1;
+    int pop_stack_last = -1;
+    size_t taken = 0;
+
+    if ((type < PAGE_ALLOC_LOW) || (type > PAGE_ALLOC_ANY))
+    {
+        return 0;
+    }
+
+    if (type == PAGE_ALLOC_ANY)
+    {
+        pop_stack_index = PAGE_ALLOC_HIGH;
+        pop_stack_last = PAGE_ALLOC_LOW;
+    }
+    else
+    {
+        pop_stack_index = type;
+        pop_stack_last = type;
+    }
+
+    unsigned const *fallback = page_node_fallback(page_node_current());
+    uint64_t flags = irq_lock();
+
+    // preferred zone first, then the nearest node with it
+    for (int zone_index = pop_stack_index;
+            (taken < count) && (pop_stack_last <= zone_index);
+            --zone_index)
+    {
+        for (unsigned n = 0; (taken < count) && (n < page_node_count()); n++)
+        {
+            unsigned node = fallback[n];
+            int zone = zone_index - 1;
+            int32_t index = stack_state.first_free[node][zone][0];
+            size_t first = taken;
+
+            // take a whole chain off the single page list in one pass
+            while ((taken < count) && (index >= 0))
+            {
+                struct page *page = &stack_state.stack[index];
+                int32_t next = page->next;
+
+                page_claim(page, 0);
+
+                pages[taken++] = page_stack_address(index);
+                index = next;
+            }
+
+            page_node_count_alloc(node, taken - first);
+
+            stack_state.first_free[node][zone][0] = index;
+
+            if (index >= 0)
+            {
+                stack_state.stack[index].prev = -1;
+            }
+
+            stack_state.free_count[zone] -= taken - first;
+            watermark_update(zone);
+
+            // split larger blocks for whatever the list couldn't cover
+            while (taken < count)
+            {
+                kc_phys_addr page = node_pop(node, zone, 0);
+
+                if (!page)
+                {
+                    break;
+                }
+
+                pages[taken++] = page;
+            }
+        }
+    }
+
+    irq_unlock(flags);
+
+    return taken;
+}
+
+kc_phys_addr page_stack_get_end(void)
+{
+    return page_stack_address(stack_state.end);
+}
+
+void page_stack_get_free_blocks(
+        enum page_alloc_flags zone,
+        size_t counts[PAGE_ORDER_MAX + 1])
+{
+    uint64_t flags = irq_lock();
+
+    for (int order = 0; order <= PAGE_ORDER_MAX; order++)
+    {
+        counts[order] = 0;
+
+        for (unsigned node = 0; node < page_node_count(); node++)
+        {
+            for (int32_t index = stack_state.first_free[node][zone - 1][order];
+                    index >= 0;
+                    index = stack_state.stack[index].next)
+            {
+                counts[order]++;
+            }
+        }
+    }
+
+    irq_unlock(flags);
+}
+
+size_t page_stack_isolate(
+        kc_phys_addr base,
+        unsigned order,
+        kc_phys_addr *blocks)
+{
+    unsigned long index = page_stack_index(base);
+    unsigned long end = index + (1UL << order);
+    size_t count = 0;
+    uint64_t flags = irq_lock();
+
+    // take every free block in the range off its list as if allocated
+    while (index < end)
+    {
+        struct page *page = stack_page(index);
+        uint32_t state = page ? atomic_load(&page->state) : 0;
+
+        if (!(state & PAGE_STATE_BUDDY) || (state & PAGE_STATE_ALLOCATED))
+        {
+            index++;
+            continue;
+        }
+
+        unsigned block_order = page_state_order(state);
+        int zone = stack_type(page_stack_address(index)) - 1;
+
+        list_remove(zone, block_order, index);
+        blocks[count++] = node_take(
+                page_state_node(state),
+                zone,
+                index,
+                block_order);
+        index += 1UL << block_order;
+    }
+
+    irq_unlock(flags);
+
+    return count;
+}
+
+// like page_stack_free() for every page, with the ones that reach zero
+// going back to the buddy lists under a single lock
+void page_stack_free_bulk(size_t count, kc_phys_addr *pages)
+{
+    uint64_t flags = irq_lock();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned order;
+
+        if (page_stack_get_present(pages[i]) &&
+                (page_stack_dec_ref(pages[i]) == 0) &&
+                page_unclaim(pages[i], &order))
+        {
+            stack_push(pages[i], order);
+        }
+    }
+
+    irq_unlock(flags);
+}
+
 void page_stack_free(kc_phys_addr page)
 {
 
@@ -75,65 +663,278 @@ void page_stack_free(kc_phys_addr page)
     // only actually free the page if it has no more references
     if (referents == 0)
     {
-        page_stack_set_free(page);
-        stack_push(page);
+        page_stack_release(page);
+    }
+}
+
+void page_stack_free_order(kc_phys_addr page, unsigned order)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+    uint32_t state = descriptor ? atomic_load(&descriptor->state) : 0;
+
+    // the caller must give back the block it was given
+    if ((state & PAGE_STATE_PRESENT) &&
+            (state & PAGE_STATE_ALLOCATED) &&
+            (page_state_order(state) != order))
+    {
+        kprintf("warning: freeing order %u block %#lx as order %u\n",
+                page_state_order(state), page, order);
+        return;
+    }
+
+    page_stack_free(page);
+}
+
+// turn an allocated block into single allocated pages, the first keeps
+// its references and every other page starts out with one
+void page_stack_split(kc_phys_addr page)
+{
+    unsigned long index = page_stack_index(page);
+    struct page *descriptor = stack_page(index);
+
+    if (!descriptor)
+    {
+        return;
+    }
+
+    uint64_t flags = irq_lock();
+    uint32_t state = atomic_load(&descriptor->state);
+    unsigned order = page_state_order(state);
+
+    if (state & PAGE_STATE_ALLOCATED)
+    {
+        for (unsigned long i = 1; i < (1UL << order); i++)
+        {
+            page_claim(&stack_state.stack[index + i], 0);
+        }
+
+        atomic_fetch_and(
+                &descriptor->state,
+                ~(0x1fU << PAGE_STATE_ORDER_SHIFT));
+    }
+
+    irq_unlock(flags);
+}
+
+// last-ref -> free, which fails if anyone took a reference meanwhile
+static bool page_unclaim(kc_phys_addr page, unsigned *order)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (!descriptor)
+    {
+        return false;
+    }
+
+    uint32_t state = atomic_load(&descriptor->state);
+
+    do
+    {
+        if (!(state & PAGE_STATE_ALLOCATED) || page_state_refs(state))
+        {
+            return false;
+        }
+    }
+    while (!atomic_compare_exchange_weak(
+                &descriptor->state,
+                &state,
+                state & PAGE_STATE_KEEP));
+
+    *order = page_state_order(state);
+    return true;
+}
+
+void page_stack_release(kc_phys_addr page)
+{
+    unsigned order;
+
+    // give the unreferenced block back to the buddy lists
+    if (page_unclaim(page, &order))
+    {
+        uint64_t flags = irq_lock();
+        stack_push(page, order);
+        irq_unlock(flags);
     }
 }
 
+enum page_alloc_flags page_stack_get_type(kc_phys_addr page)
+{
+    return stack_type(page);
+}
+
+unsigned page_stack_get_order(kc_phys_addr page)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+    return descriptor ? page_state_order(atomic_load(&descriptor->state)) : 0;
+}
+
 int page_stack_get_present(kc_phys_addr page)
 {
-    unsigned index = page_stack_index(page);
-    return stack_state.stack[index].present;
+    struct page *descriptor = stack_page(page_stack_index(page));
+    return descriptor ?
+        atomic_load(&descriptor->state) & PAGE_STATE_PRESENT : 0;
 }
 
 void page_stack_set_present(kc_phys_addr page)
 {
-    unsigned index = page_stack_index(page);
-    stack_state.stack[index].present = 1;
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (descriptor)
+    {
+        atomic_fetch_or(&descriptor->state, PAGE_STATE_PRESENT);
+    }
 }
 
 void page_stack_set_allocated(kc_phys_addr page)
 {
-    unsigned index = page_stack_index(page);
-    stack_state.stack[index].allocated = 1;
-    stack_state.stack[index].next_refs = 1;
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (descriptor)
+    {
+        uint32_t state = atomic_load(&descriptor->state);
+
+        while (!atomic_compare_exchange_weak(
+                    &descriptor->state,
+                    &state,
+                    (state & PAGE_STATE_KEEP) |
+                    PAGE_STATE_ALLOCATED |
+                    1U << PAGE_STATE_REFS_SHIFT));
+
+        descriptor->next = 0;
+        descriptor->prev = 0;
+    }
 }
 
 void page_stack_set_free(kc_phys_addr page)
 {
-    unsigned index = page_stack_index(page);
-    stack_state.stack[index].allocated = 0;
-    stack_state.stack[index].next_refs = -1;
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (descriptor)
+    {
+        atomic_fetch_and(&descriptor->state, PAGE_STATE_KEEP);
+        descriptor->next = -1;
+        descriptor->prev = -1;
+    }
 }
 
-int page_stack_inc_ref(kc_phys_addr page)
+// the one virtual address an allocated page is mapped at, if it's movable
+void page_stack_set_rmap(kc_phys_addr page, uintptr_t rmap)
 {
-    unsigned index = page_stack_index(page);
-    // taking a reference only makes sense for an allocated page
-    // and a page that's actually physical
-    if (stack_state.stack[index].allocated)
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (descriptor &&
+            (atomic_load(&descriptor->state) & PAGE_STATE_ALLOCATED))
     {
-        return ++stack_state.stack[index].next_refs;
+        descriptor->next = (int32_t)rmap;
+        descriptor->prev = (int32_t)(rmap >> 32);
+    }
+}
+
+uintptr_t page_stack_get_rmap(kc_phys_addr page)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (!descriptor ||
+            !(atomic_load(&descriptor->state) & PAGE_STATE_ALLOCATED))
+    {
+        return 0;
+    }
+
+    return (uintptr_t)(uint32_t)descriptor->next |
+        (uintptr_t)(uint32_t)descriptor->prev << 32;
+}
+
+int page_stack_get_ref(kc_phys_addr page)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+    uint32_t state = descriptor ? atomic_load(&descriptor->state) : 0;
+
+    if (state & PAGE_STATE_ALLOCATED)
+    {
+        return page_state_refs(state);
     }
 
     return -1;
 }
 
+int page_stack_inc_ref(kc_phys_addr page)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (!descriptor)
+    {
+        return -1;
+    }
+
+    uint32_t state = atomic_load(&descriptor->state);
+    uint32_t refs;
+
+    do
+    {
+        refs = page_state_refs(state);
+
+        // taking a reference only makes sense for an allocated page that
+        // someone still holds, a page at zero is on its way out
+        if (!(state & PAGE_STATE_ALLOCATED) || !refs)
+        {
+            return -1;
+        }
+
+        // a saturated count stays put, the page just never gets freed
+        if (refs == PAGE_STATE_REFS_MAX)
+        {
+            return refs;
+        }
+    }
+    while (!atomic_compare_exchange_weak(
+                &descriptor->state,
+                &state,
+                state + (1U << PAGE_STATE_REFS_SHIFT)));
+
+    return refs + 1;
+}
+
 int page_stack_dec_ref(kc_phys_addr page)
-{   
-    unsigned index = page_stack_index(page);
-    // releasing a reference only makes sense for an allocated page
-    if (stack_state.stack[index].allocated)
+{
+    struct page *descriptor = stack_page(page_stack_index(page));
+
+    if (!descriptor)
     {
-        // releasing a reference only makes sense if the refcount is > 0
-        if (stack_state.stack[index].next_refs > 0)
+        return -1;
+    }
+
+    uint32_t state = atomic_load(&descriptor->state);
+    uint32_t refs;
+
+    do
+    {
+        refs = page_state_refs(state);
+
+        // releasing a reference only makes sense for an allocated page
+        if (!(state & PAGE_STATE_ALLOCATED))
+        {
+            return -1;
+        }
+
+        // and only if there is one to release, a page at zero was freed
+        // already
+        if (!refs)
         {
-            stack_state.stack[index].next_refs--;
+            return -1;
+        }
+
+        // a saturated count stays put
+        if (refs == PAGE_STATE_REFS_MAX)
+        {
+            return refs;
         }
-        return stack_state.stack[index].next_refs;
     }
+    while (!atomic_compare_exchange_weak(
+                &descriptor->state,
+                &state,
+                state - (1U << PAGE_STATE_REFS_SHIFT)));
 
-    return -1;
+    return refs - 1;
 }
 
 static enum page_alloc_flags stack_type(kc_phys_addr page)
@@ -155,12 +956,108 @@ static enum page_alloc_flags stack_type(kc_phys_addr page)
     {
         return PAGE_ALLOC_LOW;
     }
-    
+
     // all other pages are conventional memory
     return PAGE_ALLOC_CONV;
 }
 
-static void stack_push(kc_phys_addr page)
+// free -> allocated, a page taken off a list can't have been allocated.
+// a block starts with the single reference its allocation holds and every
+// mapping adds one, so page_free() of the last mapping and of the
+// allocation brings it back to the lists
+static void page_claim(struct page *page, unsigned order)
+{
+    uint32_t state = atomic_load(&page->state);
+
+    if ((state & PAGE_STATE_ALLOCATED) ||
+            !atomic_compare_exchange_strong(
+                &page->state,
+                &state,
+                (state & PAGE_STATE_KEEP) |
+                PAGE_STATE_ALLOCATED |
+                order << PAGE_STATE_ORDER_SHIFT |
+                1U << PAGE_STATE_REFS_SHIFT))
+    {
+        kprintf("error: free page %#lx is already allocated\n",
+                page_stack_address(page - stack_state.stack));
+        PANIC(GENERAL_PANIC);
+    }
+
+    page->next = 0;
+    page->prev = 0;
+}
+
+static void list_insert(int zone, unsigned order, int32_t index)
+{
+    struct page *page = &stack_state.stack[index];
+    uint32_t state = atomic_load(&page->state);
+    unsigned node = page_state_node(state);
+    int32_t next = stack_state.first_free[node][zone][order];
+
+    atomic_store(
+            &page->state,
+            (state & PAGE_STATE_KEEP) |
+            PAGE_STATE_BUDDY |
+            order << PAGE_STATE_ORDER_SHIFT);
+    page->next = next;
+    page->prev = -1;
+
+    if (next >= 0)
+    {
+        stack_state.stack[next].prev = index;
+    }
+
+    stack_state.first_free[node][zone][order] = index;
+}
+
+static void list_remove(int zone, unsigned order, int32_t index)
+{
+    struct page *page = &stack_state.stack[index];
+    unsigned node = page_state_node(atomic_load(&page->state));
+
+    if (page->prev >= 0)
+    {
+        stack_state.stack[page->prev].next = page->next;
+    }
+    else
+    {
+        stack_state.first_free[node][zone][order] = page->next;
+    }
+
+    if (page->next >= 0)
+    {
+        stack_state.stack[page->next].prev = page->prev;
+    }
+
+    atomic_fetch_and(&page->state, ~PAGE_STATE_BUDDY);
+    page->next = -1;
+    page->prev = -1;
+}
+
+// a buddy can only be merged if it heads a free block of the same order
+// in the same zone and node
+static int buddy_is_free(
+        unsigned long index,
+        unsigned order,
+        enum page_alloc_flags type,
+        unsigned node)
+{
+    kc_phys_addr page = page_stack_address(index);
+
+    if (stack_type(page) != type)
+    {
+        return 0;
+    }
+
+    uint32_t state = atomic_load(&stack_state.stack[index].state);
+
+    return !(state & PAGE_STATE_ALLOCATED) &&
+        (state & PAGE_STATE_BUDDY) &&
+        (page_state_order(state) == order) &&
+        (page_state_node(state) == node);
+}
+
+static void stack_push(kc_phys_addr page, unsigned order)
 {
     enum page_alloc_flags type = stack_type(page);
 
@@ -170,19 +1067,149 @@ static void stack_push(kc_phys_addr page)
         return;
     }
 
-    unsigned index = page_stack_index(page);
-    stack_state.stack[index].next_refs = stack_state.first_free[type - 1];
-    stack_state.first_free[type - 1] = index;
-    stack_state.free_count[type - 1]++;
+    unsigned long index = page_stack_index(page);
+
+    // page zero never goes on a list, a zero address means failure
+    if (!index)
+    {
+        return;
+    }
+
+    int zone = type - 1;
+    unsigned node = page_state_node(atomic_load(&stack_state.stack[index].state));
+    stack_state.free_count[zone] += 1 << order;
+    watermark_update(zone);
+
+    // coalesce with the buddy block for as long as it is also free
+    while (order < PAGE_ORDER_MAX)
+    {
+        unsigned long buddy = index ^ (1UL << order);
+
+        if (!buddy_is_free(buddy, order, type, node))
+        {
+            break;
+        }
+
+        list_remove(zone, order, buddy);
+        index &= ~(1UL << order);
+        order++;
+    }
+
+    list_insert(zone, order, index);
+}
+
+// hand out a block that is already off its list
+static kc_phys_addr node_take(
+        unsigned node,
+        int zone,
+        int32_t index,
+        unsigned order)
+{
+    page_claim(&stack_state.stack[index], order);
+    stack_state.free_count[zone] -= 1 << order;
+    watermark_update(zone);
+    page_node_count_alloc(node, 1);
+
+    return page_stack_address(index);
+}
+
+// take a block of the given order from one node's zone, splitting if needed
+static kc_phys_addr node_pop(unsigned node, int zone, unsigned order)
+{
+    // find the smallest free block that satisfies the order
+    for (unsigned current = order; current <= PAGE_ORDER_MAX; current++)
+    {
+        int32_t index = stack_state.first_free[node][zone][current];
+
+        if (index < 0)
+        {
+            continue;
+        }
+
+        list_remove(zone, current, index);
+
+        // split the block and give back the upper halves
+        while (current > order)
+        {
+            current--;
+            list_insert(zone, current, index + (1 << current));
+        }
+
+        return node_take(node, zone, index, order);
+    }
+
+    return 0;
+}
+
+// a free page of the given color, either off the single page list or
+// split out of the first larger block that has one
+static kc_phys_addr node_pop_color(unsigned node, int zone, unsigned color)
+{
+    unsigned colors = page_color_count();
+    int32_t index = stack_state.first_free[node][zone][0];
+
+    for (int n = 0; (index >= 0) && (n < PAGE_COLOR_SCAN); n++)
+    {
+        if ((unsigned)index % colors == color)
+        {
+            list_remove(zone, 0, index);
+            return node_take(node, zone, index, 0);
+        }
+
+        index = stack_state.stack[index].next;
+    }
+
+    for (unsigned order = 1; order <= PAGE_ORDER_MAX; order++)
+    {
+        int32_t block = stack_state.first_free[node][zone][order];
+
+        if (block < 0)
+        {
+            continue;
+        }
+
+        unsigned long target = block +
+            (color + colors - (unsigned)block % colors) % colors;
+
+        if (target >= block + (1UL << order))
+        {
+            continue;
+        }
+
+        list_remove(zone, order, block);
+
+        // give back every half that doesn't hold the target
+        while (order--)
+        {
+            unsigned long half = 1UL << order;
+
+            if (target >= block + half)
+            {
+                list_insert(zone, order, block);
+                block += half;
+            }
+            else
+            {
+                list_insert(zone, order, block + half);
+            }
+        }
+
+        return node_take(node, zone, block, 0);
+    }
+
+    return 0;
 }
 
-static kc_phys_addr stack_pop(enum page_alloc_flags type)
-{   
+static kc_phys_addr stack_pop(
+        enum page_alloc_flags type,
+        unsigned order,
+        int color)
+{
     int pop_stack_index = -1;
     int pop_stack_last = -1;
 
     // pops only make sense for pages with a stack type
-    if ((type < PAGE_ALLOC_LOW) || (type > PAGE_ALLOC_HIGH))
+    if ((type < PAGE_ALLOC_LOW) || (type > PAGE_ALLOC_ANY))
     {
         return 0;
     }
@@ -199,19 +1226,25 @@ static kc_phys_addr stack_pop(enum page_alloc_flags type)
         pop_stack_last = type;
     }
 
-    for (; pop_stack_last <= pop_stack_index; --pop_stack_index)
+    unsigned const *fallback = page_node_fallback(page_node_current());
+
+    // preferred zone first, then the nearest node with it
+    for (int zone_index = pop_stack_index;
+            pop_stack_last <= zone_index;
+            --zone_index)
     {
-        if (stack_state.first_free[pop_stack_index - 1] > 0)
+        for (unsigned n = 0; n < page_node_count(); n++)
         {
-            unsigned index = stack_state.first_free[pop_stack_index-1];
-            stack_state.first_free[pop_stack_index-1] = 
-                stack_state.stack[index].next_refs;
-            page_stack_set_allocated(page_stack_address(index));
-            stack_state.free_count[pop_stack_index - 1]--;
-            return page_stack_address(index);
+            kc_phys_addr page = color < 0 ?
+                node_pop(fallback[n], zone_index - 1, order) :
+                node_pop_color(fallback[n], zone_index - 1, color);
+
+            if (page)
+            {
+                return page;
+            }
         }
     }
 
     return 0;
 }
-
@@ -3,9 +3,42 @@
 #include "memory.h"
 
 void page_stack_init(void);
+void page_stack_prepare_range(kc_phys_addr base, size_t size);
+size_t page_stack_add_range(
+        kc_phys_addr base,
+        size_t size,
+        enum memory_range_type type);
+void page_stack_report(void);
+
+void page_stack_get_stats(struct kcc_memory_stats *stats);
+int page_stack_append_watermark_callback(page_watermark_callback func);
+void page_stack_notify(void);
+void page_stack_pressure(enum page_alloc_flags type);
 
 kc_phys_addr page_stack_alloc(enum page_alloc_flags type);
+kc_phys_addr page_stack_alloc_order(unsigned order, enum page_alloc_flags type);
+kc_phys_addr page_stack_alloc_color(enum page_alloc_flags type, unsigned color);
+size_t page_stack_alloc_bulk(
+        enum page_alloc_flags type,
+        size_t count,
+        kc_phys_addr *pages);
+kc_phys_addr page_stack_get_end(void);
+void page_stack_get_free_blocks(
+        enum page_alloc_flags zone,
+        size_t counts[PAGE_ORDER_MAX + 1]);
+size_t page_stack_isolate(
+        kc_phys_addr base,
+        unsigned order,
+        kc_phys_addr *blocks);
+
 void page_stack_free(kc_phys_addr page);
+void page_stack_free_bulk(size_t count, kc_phys_addr *pages);
+void page_stack_free_order(kc_phys_addr page, unsigned order);
+void page_stack_split(kc_phys_addr page);
+void page_stack_release(kc_phys_addr page);
+
+enum page_alloc_flags page_stack_get_type(kc_phys_addr page);
+unsigned page_stack_get_order(kc_phys_addr page);
 
 int page_stack_get_present(kc_phys_addr page);
 void page_stack_set_present(kc_phys_addr page);
@@ -13,6 +46,10 @@ void page_stack_set_present(kc_phys_addr page);
 void page_stack_set_allocated(kc_phys_addr page);
 void page_stack_set_free(kc_phys_addr page);
 
+void page_stack_set_rmap(kc_phys_addr page, uintptr_t rmap);
+uintptr_t page_stack_get_rmap(kc_phys_addr page);
+
+int page_stack_get_ref(kc_phys_addr page);
 int page_stack_inc_ref(kc_phys_addr page);
 int page_stack_dec_ref(kc_phys_addr page);
 
@@ -0,0 +1,549 @@
+/* compressed swap
+ *
+ * when memory runs short, cold anonymous pages are compressed into a pool
+ * of frames and their table entries point at the compressed copy instead.
+ * the next fault on one of them decompresses it into a fresh frame.
+ *
+ * a clock hand sweeps the frames and gives every page a second chance:
+ * a page whose accessed bit is set has it cleared and is passed over,
+ * one that wasn't touched since the last sweep goes out. only memory
+ * allocated as cache is swapped, nothing the fault path itself needs.
+ *
+ * the pool is a list of frames cut into 64 byte chunks and filled front
+ * to back. the first chunk counts the live ones, and a frame is freed
+ * when that count drops to zero. pages that don't shrink to three
+ * quarters of their size stay in memory.
+ */
+
+#include "page_swap.h"
+#include "page_stack.h"
+
+#include "panic.h"
+#include "task.h"
+#include "timer.h"
+#include "cpu.h"
+#include "cpu/irq.h"
+
+#include <lib/kstdio.h>
+
+#define PAGE_SWAP_CHUNK 64
+#define PAGE_SWAP_CHUNKS 64
+#define PAGE_SWAP_LIMIT (page_size(1) / 4 * 3)
+#define PAGE_SWAP_INTERVAL TIMER_NANOSECOND
+
+#define PAGE_SWAP_HASH_BITS 12
+#define PAGE_SWAP_WINDOW 8192
+#define PAGE_SWAP_SCAN_BATCH 256
+
+struct page_swap_pool
+{
+    uint32_t used;
+};
+
+static struct page_swap_state
+{
+    kc_phys_addr open;
+    unsigned top;
+    kc_phys_addr reserve;
+    kc_phys_addr hand;
+    bool pressure;
+    uint16_t hash[1U << PAGE_SWAP_HASH_BITS];
+    uint8_t buffer[PAGE_SWAP_LIMIT];
+    struct page_swap_stats stats;
+}
+swap_state;
+
+static void page_swap_thread(void);
+static void page_swap_benchmark(void);
+static int page_swap_pressure(
+        enum page_alloc_flags zone,
+        enum page_watermark level);
+
+void page_swap_init(void)
+{
+    // the pool needs a frame of its own to get going when memory is gone
+    swap_state.reserve = page_alloc(PAGE_ALLOC_CONV);
+    page_append_watermark_callback(page_swap_pressure);
+    task_append_thread(page_swap_thread);
+
+    if (KC_BENCHMARKS)
+    {
+        task_append_thread(page_swap_benchmark);
+    }
+}
+
+/* a small lzf style compressor
+ *
+ * a control byte below 32 starts that many plus one literals. anything
+ * else is a match: the top three bits are its length minus two, seven
+ * meaning the next byte adds to it, and the low five bits and the byte
+ * after that are the distance back minus one.
+ */
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+    return (v * 2654435761U) >> (32 - PAGE_SWAP_HASH_BITS);
+}
+
+static size_t lz_literals(
+        const uint8_t *in,
+        size_t count,
+        uint8_t *out,
+        size_t op,
+        size_t out_len)
+{
+    while (count)
+    {
+        size_t run = count < 32 ? count : 32;
+
+        if (op + run + 1 > out_len)
+        {
+            return 0;
+        }
+
+        out[op++] = run - 1;
+        memcpy(out + op, in, run);
+        op += run;
+        in += run;
+        count -= run;
+    }
+
+    return op;
+}
+
+static size_t lz_compress(
+        const uint8_t *in,
+        size_t in_len,
+        uint8_t *out,
+        size_t out_len)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    size_t literal = 0;
+
+    memset(swap_state.hash, 0xff, sizeof(swap_state.hash));
+
+    while (ip + 2 < in_len)
+    {
+        uint32_t h = lz_hash(in + ip);
+        size_t ref = swap_state.hash[h];
+        swap_state.hash[h] = ip;
+
+        if ((ref == 0xffff) ||
+                (ip - ref > PAGE_SWAP_WINDOW) ||
+                (in[ref] != in[ip]) ||
+                (in[ref + 1] != in[ip + 1]) ||
+                (in[ref + 2] != in[ip + 2]))
+        {
+            ip++;
+            continue;
+        }
+
+        size_t max = in_len - ip < 264 ? in_len - ip : 264;
+        size_t length = 3;
+
+        while ((length < max) && (in[ref + length] == in[ip + length]))
+        {
+            length++;
+        }
+
+        op = lz_literals(in + literal, ip - literal, out, op, out_len);
+
+        if (!op && (ip != literal))
+        {
+            return 0;
+        }
+
+        if (op + 3 > out_len)
+        {
+            return 0;
+        }
+
+        size_t offset = ip - ref - 1;
+
+        if (length - 2 < 7)
+        {
+            out[op++] = (length - 2) << 5 | offset >> 8;
+        }
+        else
+        {
+            out[op++] = 7 << 5 | offset >> 8;
+            out[op++] = length - 2 - 7;
+        }
+
+        out[op++] = offset;
+        ip += length;
+        literal = ip;
+    }
+
+    if (literal < in_len)
+    {
+        op = lz_literals(in + literal, in_len - literal, out, op, out_len);
+    }
+
+    return op;
+}
+
+static size_t lz_decompress(
+        const uint8_t *in,
+        size_t in_len,
+        uint8_t *out,
+        size_t out_len)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < in_len)
+    {
+        unsigned control = in[ip++];
+
+        if (control < 32)
+        {
+            size_t run = control + 1;
+
+            if ((ip + run > in_len) || (op + run > out_len))
+            {
+                return 0;
+            }
+
+            memcpy(out + op, in + ip, run);
+            ip += run;
+            op += run;
+            continue;
+        }
+
+        size_t length = control >> 5;
+
+        if ((length == 7) && (ip < in_len))
+        {
+            length += in[ip++];
+        }
+
+        if (ip >= in_len)
+        {
+            return 0;
+        }
+
+        size_t offset = ((control & 0x1f) << 8 | in[ip++]) + 1;
+        length += 2;
+
+        if ((offset > op) || (op + length > out_len))
+        {
+            return 0;
+        }
+
+        // byte by byte, a match may overlap what it produces
+        for (size_t i = 0; i < length; i++, op++)
+        {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return op;
+}
+
+static struct page_swap_pool *pool_header(kc_phys_addr frame)
+{
+    return phys_to_virt(frame);
+}
+
+static void pool_put(kc_phys_addr frame, size_t chunks)
+{
+    struct page_swap_pool *pool = pool_header(frame);
+    pool->used -= chunks;
+
+    if (!pool->used && (frame != swap_state.open))
+    {
+        page_free(frame);
+        swap_state.stats.pool_frames--;
+    }
+}
+
+static uint64_t pool_store(const void *page)
+{
+    size_t length = lz_compress(
+            page,
+            page_size(1),
+            swap_state.buffer,
+            PAGE_SWAP_LIMIT);
+
+    if (!length)
+    {
+        swap_state.stats.incompressible++;
+        return 0;
+    }
+
+    size_t chunks = (length + sizeof(uint16_t) + PAGE_SWAP_CHUNK - 1) /
+        PAGE_SWAP_CHUNK;
+
+    if (!swap_state.open || (swap_state.top + chunks > PAGE_SWAP_CHUNKS))
+    {
+        kc_phys_addr frame = page_alloc(PAGE_ALLOC_CONV);
+
+        if (!frame)
+        {
+            frame = swap_state.reserve;
+            swap_state.reserve = 0;
+        }
+
+        if (!frame)
+        {
+            return 0;
+        }
+
+        kc_phys_addr previous = swap_state.open;
+        swap_state.open = frame;
+        swap_state.top = 1;
+        pool_header(frame)->used = 0;
+        swap_state.stats.pool_frames++;
+
+        // the old frame may already have emptied while it was open
+        if (previous)
+        {
+            pool_put(previous, 0);
+        }
+    }
+
+    uint8_t *object = (uint8_t *)pool_header(swap_state.open) +
+        swap_state.top * PAGE_SWAP_CHUNK;
+    uint64_t entry = swap_state.open |
+        (uint64_t)swap_state.top << PAGE_SWAP_CHUNK_SHIFT |
+        PAGE_SWAP_ENTRY;
+
+    object[0] = length;
+    object[1] = length >> 8;
+    memcpy(object + 2, swap_state.buffer, length);
+
+    pool_header(swap_state.open)->used += chunks;
+    swap_state.top += chunks;
+    swap_state.stats.stored_pages++;
+    swap_state.stats.stored_bytes += length;
+
+    return entry;
+}
+
+// the compressed object an entry points at, and how long it is
+static uint8_t *pool_object(uint64_t entry, size_t *length)
+{
+    kc_phys_addr frame = page_address(entry & PAGE_ADDRESS_MASK, 1);
+    unsigned chunk = (entry >> PAGE_SWAP_CHUNK_SHIFT) & PAGE_SWAP_CHUNK_MASK;
+    uint8_t *object = (uint8_t *)pool_header(frame) + chunk * PAGE_SWAP_CHUNK;
+
+    *length = object[0] | object[1] << 8;
+    return object;
+}
+
+static void pool_drop(uint64_t entry)
+{
+    size_t length;
+    pool_object(entry, &length);
+
+    swap_state.stats.stored_pages--;
+    swap_state.stats.stored_bytes -= length;
+    pool_put(
+            page_address(entry & PAGE_ADDRESS_MASK, 1),
+            (length + sizeof(uint16_t) + PAGE_SWAP_CHUNK - 1) /
+            PAGE_SWAP_CHUNK);
+}
+
+// push up to count cold pages out to the pool, returning how many went
+size_t page_swap_reclaim(size_t count)
+{
+    uint64_t flags = irq_lock();
+    kc_phys_addr end = page_stack_get_end();
+    size_t swapped = 0;
+
+    // twice around at most, the first pass may only clear accessed bits
+    for (size_t scanned = 0;
+            (swapped < count) && (scanned < 2 * end / page_size(1));
+            scanned++)
+    {
+        // let interrupts in between batches instead of holding them off
+        // for a walk over all of memory
+        if (scanned && !(scanned % PAGE_SWAP_SCAN_BATCH))
+        {
+            irq_unlock(flags);
+            flags = irq_lock();
+        }
+
+        kc_phys_addr page = swap_state.hand;
+        swap_state.hand = page + page_size(1) < end ? page + page_size(1) : 0;
+
+        void *vaddr = page_get_swappable(page);
+
+        if (!vaddr || page_clear_accessed(vaddr))
+        {
+            continue;
+        }
+
+        uint64_t entry = pool_store(phys_to_virt(page));
+
+        if (!entry)
+        {
+            continue;
+        }
+
+        // the mapping's reference goes with the entry, then the allocation's
+        page_unmap_swapped(vaddr, entry);
+        page_free(page);
+        swap_state.stats.swapped_out++;
+        swapped++;
+
+        if (!swap_state.reserve)
+        {
+            swap_state.reserve = page_alloc(PAGE_ALLOC_CONV);
+        }
+    }
+
+    irq_unlock(flags);
+    return swapped;
+}
+
+// decompress a swapped out page into a fresh frame and let the entry go
+kc_phys_addr page_swap_in(uint64_t entry)
+{
+    uint64_t begin = cpu_timestamp();
+    kc_phys_addr page = page_alloc(PAGE_ALLOC_CONV|PAGE_ALLOC_MOVABLE);
+
+    if (!page && page_swap_reclaim(PAGE_SWAP_RECLAIM_BATCH))
+    {
+        page = page_alloc(PAGE_ALLOC_CONV|PAGE_ALLOC_MOVABLE);
+    }
+
+    if (!page)
+    {
+        return 0;
+    }
+
+    uint64_t flags = irq_lock();
+    size_t length;
+    uint8_t *object = pool_object(entry, &length);
+
+    if (lz_decompress(object + 2, length, phys_to_virt(page), page_size(1)) !=
+            (size_t)page_size(1))
+    {
+        kprintf("error: swap entry %#lx is corrupt\n", entry);
+        PANIC(GENERAL_PANIC);
+    }
+
+    pool_drop(entry);
+    swap_state.stats.swapped_in++;
+    swap_state.stats.fault_cycles += cpu_timestamp() - begin;
+    irq_unlock(flags);
+
+    return page;
+}
+
+void page_swap_discard(uint64_t entry)
+{
+    uint64_t flags = irq_lock();
+    pool_drop(entry);
+    irq_unlock(flags);
+}
+
+static int page_swap_pressure(
+        enum page_alloc_flags zone,
+        enum page_watermark level)
+{
+    // callbacks run inside the allocator, so only flag the pressure and
+    // let the thread compress ahead of need. an allocation that fails
+    // outright still reclaims for itself before giving up
+    if ((zone == PAGE_ALLOC_CONV) && (level <= PAGE_WATERMARK_LOW))
+    {
+        swap_state.pressure = true;
+    }
+
+    return 0;
+}
+
+static void page_swap_thread(void)
+{
+    while (true)
+    {
+        task_sleep(PAGE_SWAP_INTERVAL);
+
+        if (swap_state.pressure)
+        {
+            swap_state.pressure = false;
+            page_swap_reclaim(PAGE_SWAP_RECLAIM_BATCH);
+        }
+    }
+}
+
+void page_swap_get_stats(struct page_swap_stats *stats)
+{
+    uint64_t flags = irq_lock();
+    *stats = swap_state.stats;
+    irq_unlock(flags);
+}
+
+void page_swap_report(void)
+{
+    struct page_swap_stats stats;
+    page_swap_get_stats(&stats);
+
+    size_t ratio = stats.pool_frames ?
+        stats.stored_pages * 100 / stats.pool_frames : 0;
+
+    kprintf("swap: %zu pages in %zu pool frames, ratio %zu.%02zu, "
+            "%zu bytes compressed\n",
+            stats.stored_pages,
+            stats.pool_frames,
+            ratio / 100,
+            ratio % 100,
+            stats.stored_bytes);
+    kprintf("swap: %lu out, %lu in at %lu cycles each, "
+            "%lu incompressible\n",
+            stats.swapped_out,
+            stats.swapped_in,
+            stats.swapped_in ? stats.fault_cycles / stats.swapped_in : 0,
+            stats.incompressible);
+}
+
+#define PAGE_SWAP_BENCHMARK_PAGES 256
+
+static uint64_t swap_benchmark_word(uint64_t *buffer, size_t i)
+{
+    uint64_t value = i % 7 ? (uintptr_t)&buffer[i] : 0;
+    return i % 61 ? value : value * 2654435761U;
+}
+
+// swap out a buffer that looks like ordinary kernel data and fault it
+// back in, checking every page survived the round trip
+static void page_swap_benchmark(void)
+{
+    uint64_t *buffer = vm_alloc(
+            PAGE_SWAP_BENCHMARK_PAGES * page_size(1),
+            VM_ALLOC_CACHE|VM_ALLOC_ANONYMOUS);
+    size_t words = PAGE_SWAP_BENCHMARK_PAGES * page_size(1) / sizeof(*buffer);
+
+    if (buffer)
+    {
+        // small counters and pointers, zero padding, some noise
+        for (size_t i = 0; i < words; i++)
+        {
+            buffer[i] = swap_benchmark_word(buffer, i);
+        }
+
+        size_t swapped = page_swap_reclaim(PAGE_SWAP_BENCHMARK_PAGES);
+        page_swap_report();
+
+        for (size_t i = 0; i < words; i++)
+        {
+            if (buffer[i] != swap_benchmark_word(buffer, i))
+            {
+                kprintf("error: swapped page at %p came back wrong\n",
+                        &buffer[i]);
+                PANIC(GENERAL_PANIC);
+            }
+        }
+
+        kprintf("swap benchmark: %zu of %zu pages went out and came back\n",
+                swapped,
+                PAGE_SWAP_BENCHMARK_PAGES);
+        page_swap_report();
+        vm_free(buffer);
+    }
+
+    task_exit();
+}
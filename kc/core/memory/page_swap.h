@@ -0,0 +1,37 @@
+#pragma once
+
+#include "memory.h"
+
+#include <stdbool.h>
+
+// a table entry that isn't present but holds a compressed page, the pool
+// frame is in the address bits and the chunk it starts at below them
+#define PAGE_SWAP_ENTRY (1ULL << 9)
+#define PAGE_SWAP_CHUNK_SHIFT 1
+#define PAGE_SWAP_CHUNK_MASK 0x3f
+
+// how many pages a failed allocation pushes out before trying again
+#define PAGE_SWAP_RECLAIM_BATCH 64
+
+#define page_swap_entry(e) \
+    (!((e) & PAGE_PR) && ((e) & PAGE_SWAP_ENTRY))
+
+struct page_swap_stats
+{
+    size_t stored_pages;
+    size_t pool_frames;
+    size_t stored_bytes;
+    uint64_t swapped_out;
+    uint64_t swapped_in;
+    uint64_t incompressible;
+    uint64_t fault_cycles;
+};
+
+void page_swap_init(void);
+
+size_t page_swap_reclaim(size_t count);
+kc_phys_addr page_swap_in(uint64_t entry);
+void page_swap_discard(uint64_t entry);
+
+void page_swap_get_stats(struct page_swap_stats *stats);
+void page_swap_report(void);
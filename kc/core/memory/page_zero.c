@@ -0,0 +1,165 @@
+/* pre-zeroed page frame pool
+ *
+ * a low priority thread keeps a pool of conventional frames that have
+ * already been cleared with non-temporal stores, so that zeroed
+ * allocations (mostly anonymous faults) don't have to clear a page
+ * while the faulting thread waits. when the pool is empty the frame is
+ * cleared synchronously instead.
+ *
+ * frames in the pool hold the single reference they were allocated with
+ * and hand it over to whoever takes them.
+ */
+
+#include "page_zero.h"
+
+#include "task.h"
+#include "timer.h"
+#include "cpu/irq.h"
+
+#include <stdbool.h>
+
+#include <lib/kstdio.h>
+
+#define PAGE_ZERO_POOL_SIZE 256
+#define PAGE_ZERO_INTERVAL (TIMER_NANOSECOND / 10)
+
+static struct page_zero_state
+{
+    bool paused;
+    size_t count;
+    kc_phys_addr pages[PAGE_ZERO_POOL_SIZE];
+    struct page_zero_stats stats;
+}
+zero_state;
+
+static void page_zero_thread(void);
+static int page_zero_shrink(
+        enum page_alloc_flags zone,
+        enum page_watermark level);
+
+void page_zero_init(void)
+{
+    page_append_watermark_callback(page_zero_shrink);
+    task_append_thread(page_zero_thread);
+}
+
+static int page_zero_shrink(
+        enum page_alloc_flags zone,
+        enum page_watermark level)
+{
+    if (zone != PAGE_ALLOC_CONV)
+    {
+        return 0;
+    }
+
+    // stop filling the pool when memory gets low and only resume
+    // once the zone is comfortably above its watermarks again
+    if (level <= PAGE_WATERMARK_LOW)
+    {
+        uint64_t flags = irq_lock();
+
+        zero_state.paused = true;
+
+        while (zero_state.count)
+        {
+            page_free(zero_state.pages[--zero_state.count]);
+        }
+
+        irq_unlock(flags);
+    }
+    else if (level == PAGE_WATERMARK_OK)
+    {
+        zero_state.paused = false;
+    }
+
+    return 0;
+}
+
+kc_phys_addr page_zero_alloc(enum page_alloc_flags type)
+{
+    kc_phys_addr page = 0;
+
+    // the pool only holds conventional memory
+    if ((type == PAGE_ALLOC_CONV) || (type == PAGE_ALLOC_ANY))
+    {
+        uint64_t flags = irq_lock();
+
+        if (zero_state.count)
+        {
+            page = zero_state.pages[--zero_state.count];
+            zero_state.stats.hits++;
+        }
+        else
+        {
+            zero_state.stats.misses++;
+        }
+
+        irq_unlock(flags);
+    }
+
+    if (!page && (page = page_alloc(type)))
+    {
+        page_clear(page, 0);
+    }
+
+    return page;
+}
+
+static void page_zero_thread(void)
+{
+    while (true)
+    {
+        while (!zero_state.paused && (zero_state.count < PAGE_ZERO_POOL_SIZE))
+        {
+            kc_phys_addr page = page_alloc(PAGE_ALLOC_CONV);
+
+            if (!page)
+            {
+                break;
+            }
+
+            // streaming stores keep the cleared page out of the caches
+            page_clear(page, 1);
+
+            uint64_t flags = irq_lock();
+
+            if (zero_state.count < PAGE_ZERO_POOL_SIZE)
+            {
+                zero_state.pages[zero_state.count++] = page;
+                zero_state.stats.zeroed++;
+                page = 0;
+            }
+
+            irq_unlock(flags);
+
+            if (page)
+            {
+                page_free(page);
+            }
+
+            task_yield();
+        }
+
+        task_sleep(PAGE_ZERO_INTERVAL);
+    }
+}
+
+void page_zero_get_stats(struct page_zero_stats *stats)
+{
+    *stats = zero_state.stats;
+    stats->depth = zero_state.count;
+}
+
+void page_zero_report(void)
+{
+    uint64_t total = zero_state.stats.hits + zero_state.stats.misses;
+
+    kprintf("zeroed page pool: %zu/%u pages, %lu hits %lu misses (%lu%%), "
+            "%lu zeroed\n",
+            zero_state.count,
+            PAGE_ZERO_POOL_SIZE,
+            zero_state.stats.hits,
+            zero_state.stats.misses,
+            total ? zero_state.stats.hits * 100 / total : 0,
+            zero_state.stats.zeroed);
+}
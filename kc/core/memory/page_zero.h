@@ -0,0 +1,18 @@
+#pragma once
+
+#include "memory.h"
+
+struct page_zero_stats
+{
+    size_t depth;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t zeroed;
+};
+
+void page_zero_init(void);
+
+kc_phys_addr page_zero_alloc(enum page_alloc_flags type);
+
+void page_zero_get_stats(struct page_zero_stats *stats);
+void page_zero_report(void);
@@ -0,0 +1,139 @@
+/* per-cpu fault lookup cache
+ *
+ * faults come in runs over the same region, a heap or stack growing or a
+ * buffer being filled, so each cpu remembers the last few nodes a fault
+ * landed in and checks those before walking the tree from the root.
+ *
+ * every insert and delete gives the tree a new generation from a count
+ * shared by all trees. a cpu whose cache was filled under another
+ * generation, or from another tree, throws it away before looking, so it
+ * never hands out a node that was taken out of the tree in the meantime,
+ * not even when a new tree took the place of a freed one.
+ */
+
+#include "vm_lookup.h"
+
+#include "cpu.h"
+#include "cpu/irq.h"
+
+#include <stdbool.h>
+
+#include <lib/kstdio.h>
+
+#define VM_LOOKUP_WAYS 4
+
+static struct vm_lookup_cpu
+{
+    struct vm_tree *tree;
+    uint64_t generation;
+    // most recently hit first
+    struct vm_tree_node *nodes[VM_LOOKUP_WAYS];
+    struct vm_lookup_stats stats;
+}
+__attribute__((aligned(64)))
+lookup_state[CPU_COUNT_MAX];
+
+static bool lookup_contains(struct vm_tree_node *node, uintptr_t address)
+{
+    return node &&
+        (address >= node->key.address) &&
+        (address - node->key.address < node->key.size);
+}
+
+// move the node at index to the front, dropping the last one if it's new
+static void lookup_promote(
+        struct vm_lookup_cpu *cpu,
+        unsigned index,
+        struct vm_tree_node *node)
+{
+    for (; index; index--)
+    {
+        cpu->nodes[index] = cpu->nodes[index - 1];
+    }
+
+    cpu->nodes[0] = node;
+}
+
+struct vm_tree_node *vm_lookup(struct vm_tree *tree, void *address)
+{
+    uint64_t flags = irq_lock();
+    uint64_t begin = cpu_timestamp();
+    struct vm_lookup_cpu *cpu = &lookup_state[cpu_get_index()];
+    struct vm_tree_node *node = NULL;
+    unsigned index;
+
+    if ((cpu->tree != tree) || (cpu->generation != tree->generation))
+    {
+        for (index = 0; index < VM_LOOKUP_WAYS; index++)
+        {
+            cpu->nodes[index] = NULL;
+        }
+
+        cpu->tree = tree;
+        cpu->generation = tree->generation;
+        cpu->stats.flushes++;
+    }
+
+    for (index = 0; index < VM_LOOKUP_WAYS; index++)
+    {
+        if (lookup_contains(cpu->nodes[index], (uintptr_t)address))
+        {
+            node = cpu->nodes[index];
+            break;
+        }
+    }
+
+    if (node)
+    {
+        lookup_promote(cpu, index, node);
+        cpu->stats.hits++;
+        cpu->stats.hit_cycles += cpu_timestamp() - begin;
+    }
+    else
+    {
+        struct vm_tree_key key = {(uintptr_t)address, 1};
+
+        if ((node = vmt_search_key(tree, &key)))
+        {
+            lookup_promote(cpu, VM_LOOKUP_WAYS - 1, node);
+        }
+
+        cpu->stats.misses++;
+        cpu->stats.miss_cycles += cpu_timestamp() - begin;
+    }
+
+    irq_unlock(flags);
+    return node;
+}
+
+void vm_lookup_get_stats(unsigned cpu, struct vm_lookup_stats *stats)
+{
+    if (cpu < CPU_COUNT_MAX)
+    {
+        *stats = lookup_state[cpu].stats;
+    }
+}
+
+void vm_lookup_report(void)
+{
+    for (unsigned cpu = 0; cpu < CPU_COUNT_MAX; cpu++)
+    {
+        struct vm_lookup_stats *stats = &lookup_state[cpu].stats;
+        uint64_t total = stats->hits + stats->misses;
+
+        if (!total)
+        {
+            continue;
+        }
+
+        kprintf("cpu %u fault lookups: %lu hits %lu misses (%lu%%) "
+                "%lu flushes, %lu cycles per hit %lu per miss\n",
+                cpu,
+                stats->hits,
+                stats->misses,
+                stats->hits * 100 / total,
+                stats->flushes,
+                stats->hits ? stats->hit_cycles / stats->hits : 0,
+                stats->misses ? stats->miss_cycles / stats->misses : 0);
+    }
+}
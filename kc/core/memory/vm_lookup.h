@@ -0,0 +1,17 @@
+#pragma once
+
+#include "memory.h"
+
+struct vm_lookup_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t flushes;
+    uint64_t hit_cycles;
+    uint64_t miss_cycles;
+};
+
+struct vm_tree_node *vm_lookup(struct vm_tree *tree, void *address);
+
+void vm_lookup_get_stats(unsigned cpu, struct vm_lookup_stats *stats);
+void vm_lookup_report(void);
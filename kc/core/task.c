@@ -16,7 +16,10 @@
 
 static const size_t INTERRUPT_STACK_SIZE = 4096;
 static const size_t THREAD_SIZE = 16834;
-static const enum vm_alloc_flags ALLOC_FLAGS = VM_ALLOC_ANY|VM_ALLOC_ANONYMOUS;
+// stacks and the threads on top of them are populated up front, nothing
+// the scheduler touches can take a page fault
+static const enum vm_alloc_flags ALLOC_FLAGS =
+    VM_ALLOC_ANY|VM_ALLOC_ANONYMOUS|VM_ALLOC_IMMEDIATE;
 
 extern uint64_t *get_tss_rsp0(void);
 
@@ -54,12 +57,16 @@ static struct kc_thread *first_ready_thread;
 static struct kc_thread *last_ready_thread;
 static struct kc_thread *sleeping_threads;
 
+// threads to start once task management begins
+static struct task_entry_list *entry_list;
+
 static volatile atomic_uint_fast64_t preempt_switch_count = 0;
 static volatile atomic_bool preempt_switch_flag = false;
 
 static void idle_thread_entry(void)
 {
-    kprintf("idle thread started\n");
+    kprintf("idle thread started %lu cycles after boot\n",
+            cpu_timestamp() - cpu_boot_timestamp());
     unlock_scheduler();
     
     __asm__ ("sti");
@@ -108,7 +115,13 @@ static void sleepy_thread_entry(void)
 static void create_interrupt_stack(size_t size)
 {
     char *rsp0 = vm_alloc(size, ALLOC_FLAGS);
-    memset(rsp0, 0, size);
+
+    if (!rsp0)
+    {
+        kprintf("error: no memory for the interrupt stack\n");
+        PANIC(OUT_OF_MEMORY);
+    }
+
     *get_tss_rsp0() = (uintptr_t)rsp0 + size;
 }
 
@@ -123,7 +136,6 @@ noreturn void task_init(void)
             timesource->nanoseconds_delta());
 
     // XXX: unfuck this mess at some point
-    // XXX: make this also not demand-allocated or it's gonna fail
     create_interrupt_stack(INTERRUPT_STACK_SIZE);
 
     // initalize static threads
@@ -133,6 +145,14 @@ noreturn void task_init(void)
     current_thread = idle_thread;
     ready_thread_push_back(sleepy_thread);
 
+    while (entry_list)
+    {
+        struct task_entry_list *entry = entry_list;
+        ready_thread_push_back(create_thread(entry->func));
+        entry_list = entry->next;
+        heap_free(entry);
+    }
+
     idle_thread->status = RUNNING;
     cpu_set_thread(&idle_thread->state, NULL, get_tss_rsp0());
 
@@ -173,6 +193,43 @@ void task_schedule(void)
     }
 }
 
+int task_append_thread(void (*func)(void))
+{
+    struct task_entry_list *item = heap_alloc(sizeof(*item));
+
+    if (!item)
+    {
+        return -1;
+    }
+
+    item->func = func;
+    item->next = entry_list;
+    entry_list = item;
+
+    return 0;
+}
+
+void task_yield(void)
+{
+    lock_scheduler();
+    task_schedule();
+    unlock_scheduler();
+}
+
+void task_sleep(uint64_t nanoseconds)
+{
+    sleep_thread(nanoseconds);
+}
+
+noreturn void task_exit(void)
+{
+    // terminated threads are never put back on the ready list
+    block_thread(TERMINATED);
+
+    // shouldn't ever get here
+    PANIC(DEAD_END);
+}
+
 static uint64_t scheduler_flags;
 
 static void lock_scheduler(void)
@@ -220,9 +277,25 @@ void update_time(void)
     }
 }
 
+// switch the running thread over to another page map
+void task_set_page_map(uint64_t map)
+{
+    lock_scheduler();
+    current_thread->state.page_map = map;
+    mmu_set_map(map);
+    unlock_scheduler();
+}
+
 static struct kc_thread *create_thread(void (*thread_f)(void))
 {
     char *task_bottom = vm_alloc(16384, ALLOC_FLAGS);
+
+    if (!task_bottom)
+    {
+        kprintf("error: no memory for a thread stack\n");
+        PANIC(OUT_OF_MEMORY);
+    }
+
     struct kc_thread *thread =
         (struct kc_thread *)(task_bottom + 16384 - sizeof(*thread));
 
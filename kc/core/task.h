@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdnoreturn.h>
 
 enum kc_thread_status
 {
@@ -32,6 +33,18 @@ extern void cpu_set_thread(
         struct kc_thread_state *next,
         uint64_t *cpu_tss_rsp0);
 
-void task_init(void);
+struct task_entry_list
+{
+    void (*func)(void);
+    struct task_entry_list *next;
+};
+
+noreturn void task_init(void);
 void task_schedule(void);
 
+int task_append_thread(void (*func)(void));
+void task_yield(void);
+void task_sleep(uint64_t nanoseconds);
+noreturn void task_exit(void);
+void task_set_page_map(uint64_t map);
+
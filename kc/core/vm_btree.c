@@ -0,0 +1,745 @@
+/* b-tree index for vm regions
+ *
+ * stands in for the red-black tree in vm_tree.c when built with
+ * VM_TREE=btree. the tree nodes then only carry a region's key and
+ * object, and the index over them is kept in wide nodes of four cache
+ * lines. each packs the start address, gap and pointer of up to nine
+ * regions or children in arrays, so a lookup scans a few lines per level
+ * instead of chasing one scattered node per level of a binary tree.
+ * leaves are linked in address order for walking neighbors.
+ *
+ * index nodes are carved from whole frames, a frame goes back once none
+ * of its nodes are used and there are plenty of others to spare. the
+ * first frame is static, for the regions set up before there is a frame
+ * allocator.
+ */
+
+#include "vm_tree.h"
+#include "memory.h"
+#include "panic.h"
+#include "cpu/irq.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <lib/kstdio.h>
+#include <lib/kstring.h>
+
+#define VMB_SLOTS 9
+#define VMB_MIN ((VMB_SLOTS + 1) / 2)
+
+// the generations of all trees, as in vm_tree.c
+static atomic_uint_fast64_t tree_generation;
+
+struct vm_btree_node
+{
+    struct vm_btree_node *parent;
+    struct vm_btree_node *prev;
+    struct vm_btree_node *next;
+    uint32_t count;
+    uint32_t leaf;
+    // the lowest start address under each slot
+    uintptr_t low[VMB_SLOTS];
+    // a leaf's region gaps, or the largest gap under each child
+    size_t gap[VMB_SLOTS];
+    // regions in a leaf, child nodes otherwise
+    void *slot[VMB_SLOTS];
+}
+__attribute__((aligned(64)));
+
+// sits in place of the first node of each frame
+struct vm_btree_frame
+{
+    struct vm_btree_frame *prev;
+    struct vm_btree_frame *next;
+    struct vm_btree_node *free;
+    size_t used;
+};
+
+#define VMB_FRAME_NODES (page_size(1) / sizeof(struct vm_btree_node) - 1)
+
+static struct vm_btree_pool
+{
+    // frames with free nodes
+    struct vm_btree_frame *frames;
+    size_t free_count;
+    size_t frame_count;
+    struct vm_btree_node boot[page_size(1) / sizeof(struct vm_btree_node)]
+        __attribute__((aligned(4096)));
+}
+pool;
+
+#define node_end(n) ((n)->key.address + (n)->key.size)
+#define region(n, i) ((struct vm_tree_node *)(n)->slot[i])
+#define child(n, i) ((struct vm_btree_node *)(n)->slot[i])
+
+static void frame_link(struct vm_btree_frame *frame)
+{
+    frame->prev = NULL;
+    frame->next = pool.frames;
+
+    if (pool.frames)
+    {
+        pool.frames->prev = frame;
+    }
+
+    pool.frames = frame;
+}
+
+static void frame_unlink(struct vm_btree_frame *frame)
+{
+    if (frame->prev)
+    {
+        frame->prev->next = frame->next;
+    }
+    else
+    {
+        pool.frames = frame->next;
+    }
+
+    if (frame->next)
+    {
+        frame->next->prev = frame->prev;
+    }
+}
+
+static void frame_init(struct vm_btree_frame *frame)
+{
+    struct vm_btree_node *nodes = (struct vm_btree_node *)frame;
+
+    *frame = (struct vm_btree_frame){NULL, NULL, NULL, 0};
+
+    for (size_t i = VMB_FRAME_NODES; i > 0; i--)
+    {
+        nodes[i].parent = frame->free;
+        frame->free = &nodes[i];
+    }
+
+    frame_link(frame);
+    pool.free_count += VMB_FRAME_NODES;
+    pool.frame_count++;
+}
+
+// get enough nodes in hand that a change to the tree doesn't have to go
+// to the frame allocator halfway through
+static void pool_reserve(size_t count)
+{
+    if (!pool.frame_count)
+    {
+        frame_init((struct vm_btree_frame *)pool.boot);
+    }
+
+    while (pool.free_count < count)
+    {
+        kc_phys_addr frame = page_alloc(PAGE_ALLOC_ANY);
+
+        if (!frame)
+        {
+            kprintf("error: failed allocating vm index nodes\n");
+            PANIC(OUT_OF_MEMORY);
+        }
+
+        frame_init(phys_to_virt(frame));
+    }
+}
+
+static struct vm_btree_node *pool_get(bool leaf)
+{
+    struct vm_btree_frame *frame = pool.frames;
+    struct vm_btree_node *node = frame->free;
+
+    frame->free = node->parent;
+    frame->used++;
+    pool.free_count--;
+
+    if (!frame->free)
+    {
+        frame_unlink(frame);
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->leaf = leaf;
+    return node;
+}
+
+static void pool_put(struct vm_btree_node *node)
+{
+    struct vm_btree_frame *frame = (void *)page_address(node, 1);
+
+    if (!frame->free)
+    {
+        frame_link(frame);
+    }
+
+    node->parent = frame->free;
+    frame->free = node;
+    frame->used--;
+    pool.free_count++;
+
+    // hand back empty frames as long as there are two more to spare
+    if (!frame->used &&
+            (frame != (struct vm_btree_frame *)pool.boot) &&
+            (pool.free_count >= 3 * VMB_FRAME_NODES))
+    {
+        frame_unlink(frame);
+        pool.free_count -= VMB_FRAME_NODES;
+        pool.frame_count--;
+        page_free(virt_to_phys(frame));
+    }
+}
+
+// index of the last slot starting below address, -1 if there isn't one
+static int slot_below(struct vm_btree_node *n, uintptr_t address)
+{
+    int i = (int)n->count - 1;
+
+    while ((i >= 0) && (n->low[i] >= address))
+    {
+        i--;
+    }
+
+    return i;
+}
+
+static unsigned slot_of(struct vm_btree_node *n, void *slot)
+{
+    unsigned i = 0;
+
+    while (n->slot[i] != slot)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+static size_t max_gap(struct vm_btree_node *n)
+{
+    size_t gap = 0;
+
+    for (unsigned i = 0; i < n->count; i++)
+    {
+        gap = n->gap[i] > gap ? n->gap[i] : gap;
+    }
+
+    return gap;
+}
+
+static void slot_set(
+        struct vm_btree_node *n,
+        unsigned i,
+        uintptr_t low,
+        size_t gap,
+        void *slot)
+{
+    n->low[i] = low;
+    n->gap[i] = gap;
+    n->slot[i] = slot;
+
+    if (n->leaf)
+    {
+        ((struct vm_tree_node *)slot)->leaf = n;
+    }
+    else
+    {
+        ((struct vm_btree_node *)slot)->parent = n;
+    }
+}
+
+// put something into a node with room for it
+static void slot_insert(
+        struct vm_btree_node *n,
+        unsigned at,
+        uintptr_t low,
+        size_t gap,
+        void *slot)
+{
+    for (unsigned i = n->count; i > at; i--)
+    {
+        slot_set(n, i, n->low[i - 1], n->gap[i - 1], n->slot[i - 1]);
+    }
+
+    slot_set(n, at, low, gap, slot);
+    n->count++;
+}
+
+static void slot_remove(struct vm_btree_node *n, unsigned at)
+{
+    n->count--;
+
+    for (unsigned i = at; i < n->count; i++)
+    {
+        slot_set(n, i, n->low[i + 1], n->gap[i + 1], n->slot[i + 1]);
+    }
+}
+
+// move all of src's slots to the end of dst
+static void slot_append(struct vm_btree_node *dst, struct vm_btree_node *src)
+{
+    for (unsigned i = 0; i < src->count; i++)
+    {
+        slot_set(dst, dst->count++, src->low[i], src->gap[i], src->slot[i]);
+    }
+
+    src->count = 0;
+}
+
+// bring the low addresses and gaps kept for n and its ancestors up to date
+static void update_up(struct vm_btree_node *n)
+{
+    for (struct vm_btree_node *p = n->parent; p; n = p, p = p->parent)
+    {
+        unsigned i = slot_of(p, n);
+
+        p->low[i] = n->low[0];
+        p->gap[i] = max_gap(n);
+    }
+}
+
+static void node_insert(
+        struct vm_tree *T,
+        struct vm_btree_node *n,
+        unsigned at,
+        uintptr_t low,
+        size_t gap,
+        void *slot);
+
+// move the upper half of a full node to a new one next to it
+static struct vm_btree_node *node_split(
+        struct vm_tree *T,
+        struct vm_btree_node *n)
+{
+    struct vm_btree_node *right = pool_get(n->leaf);
+    unsigned keep = (n->count + 1) / 2;
+
+    for (unsigned i = keep; i < n->count; i++)
+    {
+        slot_set(right, right->count++, n->low[i], n->gap[i], n->slot[i]);
+    }
+
+    n->count = keep;
+
+    if (n->leaf)
+    {
+        right->next = n->next;
+        right->prev = n;
+
+        if (n->next)
+        {
+            n->next->prev = right;
+        }
+
+        n->next = right;
+    }
+
+    if (!n->parent)
+    {
+        struct vm_btree_node *root = pool_get(false);
+
+        slot_insert(root, 0, n->low[0], max_gap(n), n);
+        T->index = root;
+    }
+
+    struct vm_btree_node *p = n->parent;
+    unsigned i = slot_of(p, n);
+
+    p->gap[i] = max_gap(n);
+    node_insert(T, p, i + 1, right->low[0], max_gap(right), right);
+
+    return right;
+}
+
+static void node_insert(
+        struct vm_tree *T,
+        struct vm_btree_node *n,
+        unsigned at,
+        uintptr_t low,
+        size_t gap,
+        void *slot)
+{
+    if (n->count == VMB_SLOTS)
+    {
+        struct vm_btree_node *right = node_split(T, n);
+
+        if (at > n->count)
+        {
+            at -= n->count;
+            n = right;
+        }
+    }
+
+    slot_insert(n, at, low, gap, slot);
+}
+
+// fix up a node that may have dropped below half full
+static void node_rebalance(struct vm_tree *T, struct vm_btree_node *n)
+{
+    struct vm_btree_node *p = n->parent;
+
+    if (!p)
+    {
+        // a root with one child gives way to it, an empty one to nothing
+        if (!n->leaf && (n->count == 1))
+        {
+            T->index = child(n, 0);
+            T->index->parent = NULL;
+            pool_put(n);
+        }
+        else if (!n->count)
+        {
+            T->index = NULL;
+            pool_put(n);
+        }
+
+        return;
+    }
+
+    if (n->count >= VMB_MIN)
+    {
+        return;
+    }
+
+    unsigned i = slot_of(p, n);
+    struct vm_btree_node *left = i > 0 ? child(p, i - 1) : NULL;
+    struct vm_btree_node *right = i + 1 < p->count ? child(p, i + 1) : NULL;
+
+    if (left && (left->count > VMB_MIN))
+    {
+        unsigned last = left->count - 1;
+
+        slot_insert(n, 0, left->low[last], left->gap[last], left->slot[last]);
+        left->count--;
+        p->gap[i - 1] = max_gap(left);
+        p->low[i] = n->low[0];
+        p->gap[i] = max_gap(n);
+    }
+    else if (right && (right->count > VMB_MIN))
+    {
+        slot_insert(n, n->count, right->low[0], right->gap[0], right->slot[0]);
+        slot_remove(right, 0);
+        p->gap[i] = max_gap(n);
+        p->low[i + 1] = right->low[0];
+        p->gap[i + 1] = max_gap(right);
+    }
+    else
+    {
+        // the sibling is at the minimum, so both fit in one node
+        if (left)
+        {
+            right = n;
+            n = left;
+            i--;
+        }
+
+        slot_append(n, right);
+
+        if (n->leaf)
+        {
+            n->next = right->next;
+
+            if (right->next)
+            {
+                right->next->prev = n;
+            }
+        }
+
+        slot_remove(p, i + 1);
+        pool_put(right);
+        p->gap[i] = max_gap(n);
+        node_rebalance(T, p);
+    }
+}
+
+const char *vmt_get_index_name(void)
+{
+    return "b-tree";
+}
+
+void vmt_init_node(
+        struct vm_tree *tree,
+        struct vm_tree_node *node,
+        struct vm_object *object,
+        void *base,
+        void *head)
+{
+    memset(node, 0, sizeof(*node));
+    node->key =
+        (struct vm_tree_key)
+        {
+            (uintptr_t)base,
+            (uintptr_t)head - (uintptr_t)base
+        };
+    node->object = object;
+
+    struct vm_tree_node *ek = vmt_search_key(tree, &node->key);
+
+    if (ek)
+    {
+        kprintf("fatal: attempt to insert overlapping vm node\n"
+                "node 1: %p: %p @ %zu bytes\n"
+                "node 2: %p: %p @ %zu bytes\n",
+                node->key.address, node->key.size,
+                ek->key.address, ek->key.size);
+
+        PANIC(GENERAL_PANIC);
+    }
+
+    // the node pool is shared by every tree
+    uint64_t flags = irq_lock();
+
+    // a split on every level and a new root at most
+    size_t height = 1;
+
+    for (struct vm_btree_node *n = tree->index; n && !n->leaf; n = child(n, 0))
+    {
+        height++;
+    }
+
+    pool_reserve(height + 1);
+    tree->generation = atomic_fetch_add(&tree_generation, 1) + 1;
+
+    if (!tree->index)
+    {
+        tree->index = pool_get(true);
+    }
+
+    struct vm_btree_node *n = tree->index;
+
+    while (!n->leaf)
+    {
+        int i = slot_below(n, node->key.address);
+        n = child(n, i < 0 ? 0 : i);
+    }
+
+    unsigned at = slot_below(n, node->key.address) + 1;
+    struct vm_tree_node *pred = at > 0 ? region(n, at - 1) :
+        n->prev ? region(n->prev, n->prev->count - 1) : NULL;
+    struct vm_tree_node *succ = at < n->count ? region(n, at) :
+        n->next ? region(n->next, 0) : NULL;
+
+    node->gap = node->key.address - (pred ? node_end(pred) : 0);
+    node_insert(tree, n, at, node->key.address, node->gap, node);
+    update_up(node->leaf);
+
+    if (succ)
+    {
+        succ->gap = succ->key.address - node_end(node);
+        succ->leaf->gap[slot_of(succ->leaf, succ)] = succ->gap;
+        update_up(succ->leaf);
+    }
+
+    irq_unlock(flags);
+}
+
+void vmt_delete(struct vm_tree *T, struct vm_tree_node *N)
+{
+    uint64_t flags = irq_lock();
+    struct vm_tree_node *pred = vmn_predecessor_node(N);
+    struct vm_tree_node *succ = vmn_successor_node(N);
+    struct vm_btree_node *n = N->leaf;
+
+    T->generation = atomic_fetch_add(&tree_generation, 1) + 1;
+    slot_remove(n, slot_of(n, N));
+    N->leaf = NULL;
+
+    // the space N took is part of its successor's gap now
+    if (succ)
+    {
+        succ->gap = succ->key.address - (pred ? node_end(pred) : 0);
+        succ->leaf->gap[slot_of(succ->leaf, succ)] = succ->gap;
+    }
+
+    node_rebalance(T, n);
+
+    // whatever is left of N's leaf holds one of its neighbors
+    if (pred)
+    {
+        update_up(pred->leaf);
+    }
+
+    if (succ)
+    {
+        update_up(succ->leaf);
+    }
+
+    irq_unlock(flags);
+}
+
+struct vm_tree_node *vmt_search_key(
+        struct vm_tree *tree,
+        struct vm_tree_key *key)
+{
+    uintptr_t end = key->address + key->size;
+    struct vm_btree_node *n = tree->index;
+
+    while (n)
+    {
+        int i = slot_below(n, end);
+
+        if (i < 0)
+        {
+            return NULL;
+        }
+
+        if (n->leaf)
+        {
+            struct vm_tree_node *N = region(n, i);
+            return node_end(N) > key->address ? N : NULL;
+        }
+
+        n = child(n, i);
+    }
+
+    return NULL;
+}
+
+static struct vm_btree_node *leaf_edge(struct vm_tree *tree, bool last);
+
+struct vm_tree_node *vmt_first(struct vm_tree *tree)
+{
+    struct vm_btree_node *n = leaf_edge(tree, false);
+
+    return n ? region(n, 0) : NULL;
+}
+
+struct vm_tree_node *vmn_predecessor_node(struct vm_tree_node *N)
+{
+    struct vm_btree_node *n = N->leaf;
+    unsigned i = slot_of(n, N);
+
+    return i > 0 ? region(n, i - 1) :
+        n->prev ? region(n->prev, n->prev->count - 1) : NULL;
+}
+
+struct vm_tree_node *vmn_successor_node(struct vm_tree_node *N)
+{
+    struct vm_btree_node *n = N->leaf;
+    unsigned i = slot_of(n, N);
+
+    return i + 1 < n->count ? region(n, i + 1) :
+        n->next ? region(n->next, 0) : NULL;
+}
+
+struct vm_object *vmt_get_object(struct vm_tree *tree, void *address)
+{
+    struct vm_tree_key key = {(uintptr_t)address, 1};
+    struct vm_tree_node *node = vmt_search_key(tree, &key);
+
+    return node ? node->object : NULL;
+}
+
+// where in [start, end) a block of size bytes fits between base and limit,
+// 0 if it doesn't
+static uintptr_t gap_fit(
+        uintptr_t start,
+        uintptr_t end,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    start = start < base ? base : start;
+    start = (start + align - 1) & ~(align - 1);
+    end = end > limit ? limit : end;
+
+    return (start < end) && (end - start >= size) ? start : 0;
+}
+
+// the lowest fitting gap under n, passing over any child whose largest
+// gap is too small or lies entirely outside [base, limit)
+static uintptr_t gap_search(
+        struct vm_btree_node *n,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    for (unsigned i = 0; i < n->count; i++)
+    {
+        // every gap from here on starts above the limit
+        if ((i > 0) && (n->low[i - 1] >= limit))
+        {
+            break;
+        }
+
+        uintptr_t below = n->leaf ? n->low[i] :
+            i + 1 < n->count ? n->low[i + 1] : UINTPTR_MAX;
+
+        if ((n->gap[i] < size) || (below <= base))
+        {
+            continue;
+        }
+
+        uintptr_t found = n->leaf ?
+            gap_fit(n->low[i] - n->gap[i], n->low[i], base, limit, size,
+                    align) :
+            gap_search(child(n, i), base, limit, size, align);
+
+        if (found)
+        {
+            return found;
+        }
+    }
+
+    return 0;
+}
+
+static struct vm_btree_node *leaf_edge(struct vm_tree *tree, bool last)
+{
+    struct vm_btree_node *n = tree->index;
+
+    while (n && !n->leaf)
+    {
+        n = child(n, last ? n->count - 1 : 0);
+    }
+
+    return n;
+}
+
+void *vmt_find_gap(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    uintptr_t found = tree->index ?
+        gap_search(tree->index, base, limit, size, align) : 0;
+
+    if (!found)
+    {
+        // the space above the last region doesn't belong to any gap
+        struct vm_btree_node *n = leaf_edge(tree, true);
+        found = gap_fit(n ? node_end(region(n, n->count - 1)) : 0,
+                limit, base, limit, size, align);
+    }
+
+    return (void *)found;
+}
+
+void vmt_get_gap_stats(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        struct vm_tree_gap_stats *stats)
+{
+    *stats = (struct vm_tree_gap_stats){0, 0, 0};
+
+    for (struct vm_btree_node *n = leaf_edge(tree, false); n; n = n->next)
+    {
+        for (unsigned i = 0; (i < n->count) && (n->low[i] < limit); i++)
+        {
+            uintptr_t start = n->low[i] - n->gap[i];
+            start = start < base ? base : start;
+
+            if (n->low[i] > start)
+            {
+                size_t gap = n->low[i] - start;
+
+                stats->holes++;
+                stats->free += gap;
+                stats->largest = gap > stats->largest ? gap : stats->largest;
+            }
+        }
+    }
+}
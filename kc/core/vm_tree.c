@@ -31,9 +31,16 @@
 #include "vm_tree.h"
 #include "panic.h"
 
+#include <stdatomic.h>
+
 #include <lib/kstdio.h>
 #include <lib/kstring.h>
 
+// every tree takes its generations from this one count, so a tree that is
+// set up where a freed one was never repeats a generation the fault
+// lookup cache may still hold
+static atomic_uint_fast64_t tree_generation;
+
 #define assert(expr)
 
 #define NIL NULL
@@ -67,6 +74,44 @@ static int compare_key(struct vm_tree_key const * const k1,
     return compare(k1->address, k1->size, k2->address, k2->size);
 }
 
+#define node_end(n) ((n)->key.address + (n)->key.size)
+
+// every node knows the free space below it in address order and the
+// largest such gap in its subtree, so whatever changes the shape of the
+// tree under a node has to recompute max_gap from there up to the root
+static void update_max_gap(struct vm_tree_node *N)
+{
+    size_t max_gap = N->gap;
+
+    for (int dir = LEFT; dir <= RIGHT; dir++)
+    {
+        if (N->child[dir] && (N->child[dir]->max_gap > max_gap))
+        {
+            max_gap = N->child[dir]->max_gap;
+        }
+    }
+
+    N->max_gap = max_gap;
+}
+
+static void propagate_max_gap(struct vm_tree_node *N)
+{
+    for (; N; N = N->parent)
+    {
+        update_max_gap(N);
+    }
+}
+
+static void set_gap(struct vm_tree_node *N, struct vm_tree_node *pred)
+{
+    N->gap = N->key.address - (pred ? node_end(pred) : 0);
+}
+
+const char *vmt_get_index_name(void)
+{
+    return "red-black tree";
+}
+
 void vmt_init_node(
         struct vm_tree *tree,
         struct vm_tree_node *node,
@@ -85,20 +130,38 @@ void vmt_init_node(
     struct vm_tree_node *ek = NULL;
     if (!(ek = vmt_search_key(tree, &node->key)))
     {
-        struct vm_tree_node *p = vmn_predecessor_key(
-                tree->root,
-                &node->key);
-        if (!p)
+        // walk down to the leaf the node goes under, picking up its
+        // neighbors in address order on the way
+        struct vm_tree_node *p = NULL;
+        struct vm_tree_node *pred = NULL;
+        struct vm_tree_node *succ = NULL;
+        enum vm_tree_direction dir = LEFT;
+
+        for (struct vm_tree_node *n = tree->root; n; n = n->child[dir])
         {
-            // the tree root should be in place of a missing predecessor
-            p = tree->root;
+            p = n;
+            dir = vmn_child_direction(node, n);
+
+            if (dir == RIGHT)
+            {
+                pred = n;
+            }
+            else
+            {
+                succ = n;
+            }
         }
-        vmt_insert(
-                tree,
-                node,
-                p,
-                vmn_child_direction(node, p));
+
         node->object = object;
+        set_gap(node, pred);
+        if (succ)
+        {
+            set_gap(succ, node);
+        }
+
+        vmt_insert(tree, node, p, dir);
+        propagate_max_gap(node);
+        propagate_max_gap(succ);
     }
     else
     {
@@ -129,6 +192,9 @@ static struct vm_tree_node* RotateDirRoot(
         G->child[ P == G->right ? RIGHT : LEFT ] = S;
     else
         T->root = S;
+    // P is below S now
+    update_max_gap(P);
+    update_max_gap(S);
     return S; // new root of subtree
 }
 
@@ -145,6 +211,7 @@ void vmt_insert(
     struct vm_tree_node* G;  // -> parent node of P
     struct vm_tree_node* U;  // -> uncle of N
 
+    T->generation = atomic_fetch_add(&tree_generation, 1) + 1;
     N->color = RED;
     N->left  = NIL;
     N->right = NIL;
@@ -198,7 +265,7 @@ Case_I56: // P red && U black:
     return; // insertion complete
 } // end of RBinsert1
 
-void vmt_delete(
+static void delete_black_leaf(
         struct vm_tree* T, // -> red–black tree
         struct vm_tree_node* N)  // -> node to be deleted
 {
@@ -278,6 +345,92 @@ Case_D6: // D red && S black:
     return; // deletion complete
 } // end of RBdelete2
 
+// put N's in-order successor Y in N's place and N in Y's, leaving N with
+// no left child
+static void swap_successor(
+        struct vm_tree *T,
+        struct vm_tree_node *N,
+        struct vm_tree_node *Y)
+{
+    struct vm_tree_node *P = N->parent;
+    struct vm_tree_node *Q = Y->parent;
+    struct vm_tree_node *R = Y->right;
+    enum vm_tree_color color = N->color;
+
+    if (P != NULL)
+        P->child[childDir(N)] = Y;
+    else
+        T->root = Y;
+
+    Y->parent = P;
+    Y->left = N->left;
+    Y->left->parent = Y;
+
+    if (Q == N) {
+        // Y was N's right child
+        Y->right = N;
+        N->parent = Y;
+    } else {
+        Y->right = N->right;
+        Y->right->parent = Y;
+        Q->left = N;
+        N->parent = Q;
+    }
+
+    N->left = NIL;
+    N->right = R;
+    if (R != NIL)
+        R->parent = N;
+
+    N->color = Y->color;
+    Y->color = color;
+}
+
+void vmt_delete(
+        struct vm_tree* T, // -> red–black tree
+        struct vm_tree_node* N)  // -> node to be deleted
+{
+    struct vm_tree_node *pred = vmn_predecessor_node(N);
+    struct vm_tree_node *succ = vmn_successor_node(N);
+
+    T->generation = atomic_fetch_add(&tree_generation, 1) + 1;
+
+    if (N->left != NIL && N->right != NIL)
+        swap_successor(T, N, succ);
+
+    // N has at most one child now
+    struct vm_tree_node *P = N->parent;
+    struct vm_tree_node *C = N->left != NIL ? N->left : N->right;
+
+    if (C != NIL) {
+        // only a black node can have a single child, which is red
+        C->parent = P;
+        if (P != NULL)
+            P->child[childDir(N)] = C;
+        else
+            T->root = C;
+        C->color = BLACK;
+        P = C;
+    } else if (P == NULL) {
+        T->root = NIL;
+    } else if (N->color == RED) {
+        P->child[childDir(N)] = NIL;
+    } else {
+        delete_black_leaf(T, N);
+    }
+
+    // the space N took is part of its successor's gap now
+    if (succ != NIL)
+        set_gap(succ, pred);
+
+    propagate_max_gap(P);
+    propagate_max_gap(succ);
+
+    N->parent = NIL;
+    N->left = NIL;
+    N->right = NIL;
+}
+
 enum vm_tree_direction vmn_child_direction(
         struct vm_tree_node *n,
         struct vm_tree_node *p
@@ -334,6 +487,30 @@ struct vm_tree_node *vmn_predecessor_key(
     return P;
 }
 
+struct vm_tree_node *vmt_first(struct vm_tree *tree)
+{
+    return vmn_min(tree->root);
+}
+
+// the node just below a given one in address order
+struct vm_tree_node *vmn_predecessor_node(
+        struct vm_tree_node *N)
+{
+    if (N && N->left)
+    {
+        return vmn_max(N->left);
+    }
+
+    struct vm_tree_node *p = N->parent;
+    while (p && N == p->left)
+    {
+        N = p;
+        p = p->parent;
+    }
+
+    return p;
+}
+
 // search for the successor node for a given key
 struct vm_tree_node *vmn_successor_node(
         struct vm_tree_node *N)
@@ -385,3 +562,106 @@ struct vm_object *vmt_get_object(struct vm_tree *tree, void *address)
     return NULL;
 }
 
+// where in N's gap a block of size bytes fits between base and limit, 0 if
+// it doesn't
+static uintptr_t gap_fit(
+        struct vm_tree_node *N,
+        uintptr_t start,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    uintptr_t end = N ? N->key.address : limit;
+
+    start = start < base ? base : start;
+    start = (start + align - 1) & ~(align - 1);
+    end = end > limit ? limit : end;
+
+    return (start < end) && (end - start >= size) ? start : 0;
+}
+
+// the lowest fitting gap in the subtree, skipping any subtree whose
+// largest gap is too small as a whole
+static uintptr_t gap_search(
+        struct vm_tree_node *N,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    if (!N || (N->max_gap < size))
+    {
+        return 0;
+    }
+
+    uintptr_t found = 0;
+
+    // all of the left subtree lies below N
+    if (N->key.address > base)
+    {
+        found = gap_search(N->left, base, limit, size, align);
+    }
+
+    if (!found)
+    {
+        found = gap_fit(N, N->key.address - N->gap, base, limit, size, align);
+    }
+
+    if (!found && (node_end(N) < limit))
+    {
+        found = gap_search(N->right, base, limit, size, align);
+    }
+
+    return found;
+}
+
+// the lowest address in [base, limit) that a block of size bytes aligned
+// to align fits at without touching any node, NULL if there is none
+void *vmt_find_gap(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align)
+{
+    uintptr_t found = gap_search(tree->root, base, limit, size, align);
+
+    if (!found)
+    {
+        // the space above the last node doesn't belong to any gap
+        struct vm_tree_node *last = vmn_max(tree->root);
+        found = gap_fit(NULL, last ? node_end(last) : 0, base, limit, size,
+                align);
+    }
+
+    return (void *)found;
+}
+
+// add up the holes between nodes in [base, limit), not counting the space
+// after the last node in it
+void vmt_get_gap_stats(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        struct vm_tree_gap_stats *stats)
+{
+    *stats = (struct vm_tree_gap_stats){0, 0, 0};
+
+    for (struct vm_tree_node *N = vmn_min(tree->root);
+            N && (N->key.address < limit);
+            N = vmn_successor_node(N))
+    {
+        uintptr_t start = N->key.address - N->gap;
+        start = start < base ? base : start;
+
+        if (N->key.address > start)
+        {
+            size_t gap = N->key.address - start;
+
+            stats->holes++;
+            stats->free += gap;
+            stats->largest = gap > stats->largest ? gap : stats->largest;
+        }
+    }
+}
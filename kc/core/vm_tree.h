@@ -53,6 +53,7 @@ struct vm_tree_key
 };
 
 struct vm_object;
+struct vm_btree_node;
 
 struct vm_tree_node
 {
@@ -61,24 +62,36 @@ struct vm_tree_node
     struct vm_tree_node *child[2];
     enum vm_tree_color color;
     struct vm_tree_key key;
+    // free space between this node and its predecessor, and the largest
+    // such gap anywhere in the subtree rooted here
+    size_t gap;
+    size_t max_gap;
+    // the leaf holding this node when regions are indexed by a b-tree
+    struct vm_btree_node *leaf;
     // object that owns this node
     struct vm_object *object;
 };
 
+// free space between nodes in some range of the address space
+struct vm_tree_gap_stats
+{
+    size_t holes;
+    size_t free;
+    size_t largest;
+};
+
 struct vm_tree
 {
     struct vm_tree_node *root;
+    struct vm_btree_node *index;
+    // taken from a count shared by all trees on every insert and delete,
+    // so it never goes back to a value any tree had before
+    uint64_t generation;
 };
 
-void vmt_insert(
-        struct vm_tree *,
-        struct vm_tree_node *,
-        struct vm_tree_node *,
-        enum vm_tree_direction);
-
-enum vm_tree_direction vmn_child_direction(
-        struct vm_tree_node *n,
-        struct vm_tree_node *p);
+// the index behind these is picked at build time, vm_tree.c keeps the
+// regions in a red-black tree and vm_btree.c in a b-tree
+const char *vmt_get_index_name(void);
 
 void vmt_init_node(
         struct vm_tree *tree,
@@ -91,6 +104,35 @@ void vmt_delete(struct vm_tree*, struct vm_tree_node*);
 
 struct vm_tree_node *vmt_search_key(struct vm_tree *, struct vm_tree_key *);
 
+struct vm_tree_node *vmt_first(struct vm_tree *);
+struct vm_tree_node *vmn_predecessor_node(struct vm_tree_node *);
+struct vm_tree_node *vmn_successor_node(struct vm_tree_node *);
+
+struct vm_object *vmt_get_object(struct vm_tree *, void *address);
+
+void *vmt_find_gap(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        size_t size,
+        size_t align);
+void vmt_get_gap_stats(
+        struct vm_tree *tree,
+        uintptr_t base,
+        uintptr_t limit,
+        struct vm_tree_gap_stats *stats);
+
+// red-black tree internals, only there when vm_tree.c is built
+void vmt_insert(
+        struct vm_tree *,
+        struct vm_tree_node *,
+        struct vm_tree_node *,
+        enum vm_tree_direction);
+
+enum vm_tree_direction vmn_child_direction(
+        struct vm_tree_node *n,
+        struct vm_tree_node *p);
+
 struct vm_tree_node *vmn_predecessor_key(
         struct vm_tree_node *,
         struct vm_tree_key *);
@@ -100,6 +142,3 @@ struct vm_tree_node *vmn_successor_key(
 
 struct vm_tree_node *vmn_min(struct vm_tree_node *node);
 struct vm_tree_node *vmn_max(struct vm_tree_node *node);
-
-struct vm_object *vmt_get_object(struct vm_tree *, void *address);
-